@@ -0,0 +1,36 @@
+#!/usr/bin/env lua
+
+-- The glimmer effect from glimmer.lua, but played by the
+-- device's animation thread. `animate` returns immediately,
+-- so the script is free to do other work while the LEDs
+-- change.
+
+local blink = require 'blink'
+
+local function glimmer(d, n, r, g, b)
+   local millis = 300
+   local wait = 250
+
+   return d:animate({
+      { millis = millis, red = r, green = g, blue = b, led = 1 },
+      { millis = millis, red = r//2, green = g//2, blue = b//2, led = 2, wait = wait },
+      { millis = millis, red = r//2, green = g//2, blue = b//2, led = 1 },
+      { millis = millis, red = r, green = g, blue = b, led = 2, wait = wait },
+   }, n)
+end
+
+local d = blink.open()
+
+if d then
+   glimmer(d, 5, 120, 230, 90)
+
+   local ticks = 0
+   while d:animating() do
+      -- real work would go here
+      ticks = ticks + 1
+      blink.sleep(50)
+   end
+   print(string.format('did %d units of work while animating', ticks))
+
+   d:fade(300, 0, 0, 0, 0)
+end
@@ -0,0 +1,24 @@
+#!/usr/bin/env lua
+
+local blink = require 'blink'
+
+-- Shares the attached blink(1)s with other processes, which
+-- reach them with blink.connect(path[, id or serial]). The socket's
+-- permissions can be given in octal, e.g. 660; by default only its owner
+-- can connect.
+local path = arg[1] or '/tmp/blinkd.sock'
+local mode = arg[2] and tonumber(arg[2], 8)
+
+local server, err = blink.serve(path, mode)
+if not server then
+   io.stderr:write(err, '\n')
+   os.exit(1)
+end
+
+print('serving on ' .. path)
+while true do
+   blink.sleep(60000)
+   local stats = server:stats()
+   print(string.format('%d clients, %d requests, %d coalesced',
+                       stats.clients, stats.requests, stats.coalesced))
+end
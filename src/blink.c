@@ -32,8 +32,30 @@
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined(__linux__)
+#include <linux/netlink.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -43,6 +65,19 @@
 #define BLINK1_ERR (-1)
 #define PATTERNPLAY_START 1
 #define PATTERNPLAY_STOP 0
+#define PATTERN_SLOTS 32
+#define MK1_PATTERN_SLOTS 12
+#define LEDN_FIRMWARE 204
+#define LED_COUNT 2
+#define PACKED_COLOR_LEN 3
+#define PACKED_LINE_LEN 6
+#define POOL_THREADS 8
+#define MAX_DEVICES 32
+#define SERIAL_LEN 8
+#define HOTPLUG_POLL_MS 2000
+#define HOTPLUG_SETTLE_MS 100
+#define HOTPLUG_SETTLE_TRIES 5
+#define PATTERN_CACHE_SIZE 64
 
 // @fixme why are these #defineS and the others are static constS?
 #define BADDEVSPEC_MSG "ID must be either an integer in [0, n-1] (n = number of attached blinks) or a valid serial number."
@@ -57,8 +92,31 @@
 #define DISCONNECTED_BLINK_MSG "blink(1): disconnected"
 #define BLINK_STRING_FMT "[blink(1) %s: #%s]"
 #define BAD_RETRIEVAL_MSG "could not retrieve rgb"
+#define BADTIMELINE_MSG "keyframe %d: %s"
+#define EMPTYTIMELINE_MSG "timeline must contain at least one keyframe"
+#define ENDLESSTIMELINE_MSG "a timeline that loops forever must contain a non-zero wait"
+#define NOTHREAD_MSG "could not start animation thread"
+#define NOWRITER_MSG "could not start writer thread"
+#define NOREQUEST_MSG "could not queue request"
+#define CLOSEDREQUEST_MSG "could not queue request: device is closed"
+#define GROUP_STRING_FMT "[blink(1) group: %d devices]"
+#define BADPATTERNLINE_MSG "pattern line %d: %s"
+#define PATTERNWRITEERR_MSG "could not write pattern lines:%s"
+#define PATTERNREADERR_MSG "could not read pattern lines:%s"
+#define BADPACKEDCOLOR_MSG "packed color must be a 3 byte string"
+#define BADPACKEDCOLORS_MSG "packed colors must be a string of 3 byte colors"
+#define BADPACKEDPATTERN_MSG "packed pattern must be a string of at most 32 6 byte lines"
+#define CONNECTERR_MSG "could not connect to %s: %s"
+#define REMOTEOPENERR_MSG "server at %s could not open the blink(1)"
+#define SERVEERR_MSG "could not serve on %s: %s"
+#define SERVER_STRING_FMT "[blink(1) server: %s]"
 
 static const char *BLINK_TYPENAME = "net.bluedino.Blink1";
+static const char *GROUP_TYPENAME = "net.bluedino.Blink1Group";
+static const char *POOL_TYPENAME = "net.bluedino.Blink1Pool";
+static const char *HOTPLUG_TYPENAME = "net.bluedino.Blink1Hotplug";
+static const char *REQUEST_TYPENAME = "net.bluedino.Blink1Request";
+static const char *SERVER_TYPENAME = "net.bluedino.Blink1Server";
 static const char *VID_KEY = "VID";
 static const char *PID_KEY = "PID";
 static const char *VERSION_KEY = "_VERSION";
@@ -70,1016 +128,8858 @@ static const char *RED_KEY = "red";
 static const char *GREEN_KEY = "green";
 static const char *BLUE_KEY = "blue";
 static const char *MILLIS_KEY = "millis";
+static const char *LED_KEY = "led";
+static const char *WAIT_KEY = "wait";
+static const char *REFRESH_KEY = "refresh";
+static const char *PACKED_KEY = "packed";
+static const char *EXPECTED_KEY = "expected";
+
+// address used as the registry key of the compiled pattern string cache
+static const char patternCache = 0;
 
 const char *LUABLINK_VERSION = "2.0.0";
 
-typedef struct blinker {
-  blink1_device *device;
-} blinker;
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * A single step of an animation: fade LED <led> to (r, g, b) over <millis>,
+ * then wait <wait> milliseconds before starting the next keyframe.
+ */
+typedef struct keyframe {
+  uint16_t millis;
+  uint8_t r, g, b;
+  uint8_t led;
+  uint32_t wait;
+} keyframe;
+
+/*
+ * Per-device animation engine. The worker thread is started lazily by the
+ * first call to animate and lives until the device is closed. All fields
+ * are protected by <lock>; <generation> is bumped every time the timeline is
+ * replaced or cancelled so the worker can notice while it is sleeping. If
+ * <notify> is set, a timeline that runs to its end is reported as an event.
+ */
+typedef struct animator {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  keyframe *frames;
+  int nframes;
+  int count;
+  int notify;
+  unsigned long generation;
+} animator;
+
+/*
+ * How a stream is doing: frames sent, skipped to catch up and rejected by the
+ * device, when they were sent relative to their deadlines, and the sum and
+ * sum of squares of the intervals between sends, for the jitter.
+ */
+typedef struct streamreport {
+  uint64_t sent;
+  uint64_t dropped;
+  uint64_t failed;
+  uint64_t start;
+  uint64_t stop;
+  uint64_t lastSend;
+  uint64_t lateNanos;
+  uint64_t maxLateNanos;
+  double intervals;
+  double intervalSquares;
+} streamreport;
+
+/*
+ * Per-device frame streamer. Like the animator, the worker thread is started
+ * by the first stream and lives until the device is closed, and everything is
+ * protected by <lock>. <frames> holds <nframes> packed frames of <stride>
+ * bytes: r, g, b for both LEDs, or r, g, b for LED 1 followed by LED 2.
+ */
+typedef struct streamer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  uint8_t *frames;
+  size_t nframes;
+  int stride;
+  uint64_t period;
+  int count;
+  int drop;
+  unsigned long generation;
+  streamreport report;
+} streamer;
+
+/*
+ * Opt-in write-behind queue for set and fade. <pending> holds at most one
+ * command per target (index 0 is both LEDs, 1 and 2 a single LED), packed
+ * into a 64-bit word; a replaced command is counted as coalesced. Producers
+ * replace commands and the writer thread takes all of them at once, both
+ * under <lock>, so what the writer takes is always a consistent snapshot.
+ */
+typedef struct writebehind {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  int started;
+  int quit;
+  int busy;
+  atomic_int enabled;
+  uint64_t pending[LED_COUNT + 1];
+  atomic_uint_fast64_t submitted;
+  atomic_uint_fast64_t transmitted;
+  atomic_uint_fast64_t coalesced;
+  atomic_uint_fast64_t failed;
+} writebehind;
+
+/*
+ * Host-side watchdog for the firmware's serverdown mode. While <armed>, the
+ * device plays pattern lines <startpos> to <endpos> unless it is tickled
+ * within <timeout> milliseconds. The watchdog thread, started when first
+ * armed and living until the device is closed, tickles it every <interval>
+ * nanoseconds, but only if the application has set <beat> since the last
+ * tickle; an interval without one is counted as missed. <lock> protects
+ * everything but <beat> and the counters, and is held while talking to the
+ * device so that a tickle can't re-arm a device that was just disarmed.
+ */
+typedef struct watchdog {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  int armed;
+  unsigned long generation;
+  uint32_t timeout;
+  uint64_t interval;
+  uint8_t stay;
+  uint8_t startpos;
+  uint8_t endpos;
+  atomic_int beat;
+  atomic_uint_fast64_t tickles;
+  atomic_uint_fast64_t missed;
+} watchdog;
+
+/*
+ * How a color layer combines with what the layers below it show.
+ */
+typedef enum blendmode {
+  BLEND_REPLACE,
+  BLEND_ADD,
+  BLEND_MULTIPLY,
+  BLEND_MAX
+} blendmode;
+
+/*
+ * A named layer of the compositor: a color for LED <led> (0 for both), or a
+ * timeline if <frames> is not NULL. <seq> is unique to each post of the
+ * layer, and <expires> is the CLOCK_MONOTONIC time it is withdrawn at, or 0
+ * if it never is.
+ */
+typedef struct layer {
+  char *name;
+  unsigned long seq;
+  int priority;
+  blendmode blend;
+  uint64_t expires;
+  uint16_t millis;
+  rgb_t color;
+  uint8_t led;
+  keyframe *frames;
+  int nframes;
+  int count;
+} layer;
+
+/*
+ * An entry of the compositor's timer heap: the layer posted as <seq>
+ * expires at <deadline>. Entries are not removed when their layer is
+ * reposted or withdrawn; they are just ignored when they come up.
+ */
+typedef struct expiry {
+  uint64_t deadline;
+  unsigned long seq;
+} expiry;
+
+typedef enum shownkind {
+  SHOWN_NOTHING,
+  SHOWN_COLORS,
+  SHOWN_TIMELINE
+} shownkind;
+
+/*
+ * Per-device layer compositor. <layers> is kept in the order they stack,
+ * highest priority first and, within a priority, newest first. The device
+ * is only written to when the output computed from them differs from
+ * what was last shown: <shown>, and <shownColors> or the <shownTimeline>
+ * layer's seq. The worker thread, started by the first layer with a TTL
+ * and living until the device is closed, withdraws layers as they expire.
+ * Everything is protected by <lock>, which is held while talking to the
+ * device so that outputs are sent in the order they were computed.
+ */
+typedef struct compositor {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  layer *layers;
+  int nlayers;
+  int maxlayers;
+  expiry *heap;
+  int nheap;
+  int maxheap;
+  unsigned long seq;
+  shownkind shown;
+  rgb_t shownColors[LED_COUNT];
+  unsigned long shownTimeline;
+} compositor;
+
+struct request;
+
+/*
+ * FIFO of asynchronous requests for one device, run in order by the
+ * device's I/O thread, which is started by the first request. Once the
+ * device is closed, <closed> is set and no more requests are taken.
+ */
+typedef struct ioqueue {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  int closed;
+  struct request *head;
+  struct request *tail;
+} ioqueue;
+
+/*
+ * One line of the device's pattern RAM. <led> is the LED the line applies
+ * to: 0 for both, 1 or 2 for one of them.
+ */
+typedef struct patternslot {
+  uint16_t millis;
+  uint8_t r, g, b;
+  uint8_t led;
+} patternslot;
+
+/*
+ * The last color commanded for one LED. A set is recorded as a fade of
+ * 0 milliseconds; while a fade is in flight the displayed color is
+ * interpolated between <from> and <to>. <sent> is <to> as sent to the
+ * device, after color correction.
+ */
+typedef struct ledstate {
+  rgb_t from;
+  rgb_t to;
+  rgb_t sent;
+  uint16_t millis;
+  uint64_t start;
+} ledstate;
+
+/*
+ * Kinds of call to the blink1 library that reach the device.
+ */
+typedef enum hidop {
+  HID_SET,
+  HID_FADE,
+  HID_READRGB,
+  HID_VERSION,
+  HID_PLAYLOOP,
+  HID_READPLAY,
+  HID_SETLEDN,
+  HID_WRITELINE,
+  HID_READLINE,
+  HID_SAVE,
+  HID_SERVERDOWN,
+  HID_OPS
+} hidop;
+
+#define LATENCY_BUCKETS 24
+
+/*
+ * Counters for one kind of call: how many were made and failed, how many
+ * were suppressed as duplicates without reaching the device, the USB reports
+ * they took and an estimate of their bytes (a full report buffer each), and
+ * how long they took, in total, at worst, and as a histogram with
+ * power-of-two microsecond buckets.
+ */
+typedef struct hidcounters {
+  atomic_uint_fast64_t calls;
+  atomic_uint_fast64_t failures;
+  atomic_uint_fast64_t suppressed;
+  atomic_uint_fast64_t reports;
+  atomic_uint_fast64_t bytes;
+  atomic_uint_fast64_t nanos;
+  atomic_uint_fast64_t maxNanos;
+  atomic_uint_fast64_t buckets[LATENCY_BUCKETS];
+} hidcounters;
+
+/*
+ * A blinker's color correction: a table for each of red, green and blue
+ * mapping a requested level to the one sent to the device.
+ */
+typedef struct correction {
+  int calibrated;
+  uint8_t lut[3][256];
+} correction;
+
+/*
+ * What a blinker is bound to. <type>, <mk2> and <serial> describe the device
+ * and are kept when its handle is closed or lost. A blinker opened with
+ * blink.connect talks to a daemon instead of a device: <fd> is its socket,
+ * -1 once closed, and the device is described by what the daemon said about
+ * it when it was opened.
+ */
+typedef struct remotelink {
+  int remote;
+  int fd;
+  int type;
+  int mk2;
+  char serial[SERIAL_LEN + 1];
+} remotelink;
+
+/*
+ * Opt-in suppression of sets and fades that would not change what the device
+ * shows: those whose color, after correction, each LED they change has
+ * already settled on. If <maxAge> is not 0, a color is sent again anyway
+ * once that many nanoseconds have passed since it last was. Protected by the
+ * blinker's io lock.
+ */
+typedef struct dedup {
+  int enabled;
+  uint64_t maxAge;
+} dedup;
+
+/*
+ * Reconnection for a blinker with a local device. After RECONNECT_FAILURES
+ * transfers in a row have failed the handle is closed, and the worker thread,
+ * started by the first loss and living until the device is closed, reopens
+ * the device by serial number, waiting longer after each failed attempt.
+ * <colors> and <play> hold the last state commanded, whether or not it
+ * reached the device, to be sent again once it is back. Everything is
+ * protected by the blinker's io lock.
+ */
+typedef struct reconnector {
+  pthread_t thread;
+  pthread_cond_t wake;
+  int started;
+  int quit;
+  int failures;
+  unsigned long reconnects;
+  rgb_t colors[LED_COUNT];
+  uint32_t colorsKnown;
+  int playing;
+  uint8_t play[3];
+} reconnector;
+
+typedef enum eventkind {
+  EVENT_REQUEST,
+  EVENT_ANIMATION
+} eventkind;
+
+/*
+ * Something for dispatch to deliver: a request that finished, or the
+ * blinker whose animation did.
+ */
+typedef struct event {
+  eventkind kind;
+  void *source;
+  struct event *next;
+} event;
+
+/*
+ * Events for the Lua state that loaded the library, and a pipe whose read
+ * end is readable while there are any, for external event loops to poll.
+ * <signalled> is set while a byte is in the pipe, so that at most one ever
+ * is, and <hotplug> when the set of attached devices may have changed. The
+ * notifier is shared by the state's hotplug object and its blinkers, whose
+ * threads post to it, and freed when the last of them lets go. The queue
+ * is protected by <lock>; <next> links the registry's list of notifiers.
+ */
+typedef struct notifier {
+  pthread_mutex_t lock;
+  int fds[2];
+  atomic_int signalled;
+  atomic_int hotplug;
+  atomic_int refs;
+  event *head;
+  event *tail;
+  struct notifier *next;
+} notifier;
+
+/*
+ * <pattern> is the host's copy of the device's pattern RAM; bit n of
+ * <patternKnown> is set when <pattern>[n] is known to match the device.
+ * <patternLed> is the LED the device applies written pattern lines to, or
+ * -1 if unknown. It starts at 0, the LED a device powers up with, which
+ * closeBlinker puts back. <patternRepeats> is the repeat count of the last
+ * pattern string written.
+ * Likewise <leds> holds the last color commanded for each LED and bit n of
+ * <ledsKnown> is set when <leds>[n] can be trusted. All are protected by <io>.
+ * A blinker connected to a daemon shares the device with the daemon's other
+ * clients, so its known bits stay clear; the daemon's own blinker keeps
+ * the device's state.
+ * <patternSlots> is the number of lines the device's pattern RAM holds and
+ * <firmware> its firmware version, 0 until first needed.
+ */
+typedef struct blinker {
+  blink1_device *device;
+  notifier *events;
+  remotelink link;
+  reconnector reconnect;
+  dedup dedup;
+  pthread_mutex_t io;
+  int patternSlots;
+  int firmware;
+  correction color;
+  animator anim;
+  streamer stream;
+  patternslot pattern[PATTERN_SLOTS];
+  uint32_t patternKnown;
+  int patternLed;
+  int patternRepeats;
+  ledstate leds[LED_COUNT];
+  uint32_t ledsKnown;
+  writebehind queue;
+  watchdog watchdog;
+  compositor layers;
+  ioqueue requests;
+  hidcounters stats[HID_OPS];
+} blinker;
+
+/*
+ * NOTE: Most of the Blink1 library functions _claim_ to return -1 on error, and 0 on
+ *       success. This doesn't seem to be true. As best I can tell, they do all return -1
+ *       on error; but testing (on OS X 10.9.4) shows most (I didn't test all) of the functions
+ *       return 9 on success.
+ *
+ *       On a related note, given the way the blink1 and hid code is written, it is not currently
+ *       possible to retrieve meaningful error codes/messages on error. So we are left knowing
+ *       only that an error occured. It's not clear to me that knowing more specifics would be
+ *       useful, however.
+ *
+ */
+
+static uint64_t nowNanos(void);
+static void checkTransport(blinker *bd, int result);
+
+/************************************************************************************
+ *
+ * Metrics
+ *
+ ************************************************************************************/
+
+/*
+ * Every blink1 library call that talks to the device is counted under one of
+ * these, both in the blinker it was made for and in process-wide totals that
+ * outlive closed devices. Counters are only ever added to with relaxed atomics,
+ * so recording never takes a lock and reading them never blocks a transfer; a
+ * snapshot taken while transfers are in flight may be off by the calls in flight.
+ */
+static const char *hidOpNames[HID_OPS] = {
+  "set", "fade", "readrgb", "version", "playloop", "readplay",
+  "setledn", "writeline", "readline", "save", "serverdown",
+};
+
+// reads are a request report followed by the device's reply
+static const int hidOpReports[HID_OPS] = { 1, 1, 2, 2, 1, 2, 1, 1, 2, 1, 1 };
+
+static hidcounters processStats[HID_OPS];
+
+/*
+ * Bucket 0 counts transfers that took less than 1 microsecond, bucket i those
+ * that took [2^(i-1), 2^i) microseconds, and the last bucket everything longer.
+ */
+static int latencyBucket(uint64_t nanos) {
+  uint64_t micros = nanos / 1000;
+  int i = 0;
+
+  while (micros != 0 && i < LATENCY_BUCKETS - 1) {
+    micros >>= 1;
+    i++;
+  }
+
+  return i;
+}
+
+static void countTransfer(hidcounters *c, int reports, int failed, uint64_t nanos) {
+  atomic_fetch_add_explicit(&c->calls, 1, memory_order_relaxed);
+  if (failed) {
+    atomic_fetch_add_explicit(&c->failures, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&c->reports, reports, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->bytes, (uint64_t)reports * blink1_buf_size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->nanos, nanos, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->buckets[latencyBucket(nanos)], 1, memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&c->maxNanos, memory_order_relaxed);
+  while (nanos > max &&
+         !atomic_compare_exchange_weak_explicit(&c->maxNanos, &max, nanos, memory_order_relaxed, memory_order_relaxed)) {
+    // max now holds the current value; try again
+  }
+}
+
+/*
+ * Records a call of kind <op> to <bd>'s device that started at <start> and
+ * returned <result>, and whether it suggests the device has been lost (see
+ * Reconnection). Called with the io lock held. Returns <result>.
+ */
+static int recordTransfer(blinker *bd, hidop op, uint64_t start, int result) {
+  uint64_t nanos = nowNanos() - start;
+  int failed = (result == BLINK1_ERR);
+
+  countTransfer(&bd->stats[op], hidOpReports[op], failed, nanos);
+  countTransfer(&processStats[op], hidOpReports[op], failed, nanos);
+  checkTransport(bd, result);
+
+  return result;
+}
+
+/*
+ * Records a call of kind <op> to <bd>'s device that was not made because it
+ * would not have changed anything.
+ */
+static void recordSuppressed(blinker *bd, hidop op) {
+  atomic_fetch_add_explicit(&bd->stats[op].suppressed, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&processStats[op].suppressed, 1, memory_order_relaxed);
+}
+
+static void resetCounters(hidcounters *stats) {
+  for (int op = 0; op < HID_OPS; op++) {
+    hidcounters *c = &stats[op];
+    atomic_store_explicit(&c->calls, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->failures, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->suppressed, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->reports, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->nanos, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->maxNanos, 0, memory_order_relaxed);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      atomic_store_explicit(&c->buckets[i], 0, memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Returns the upper bound, in microseconds, of the bucket holding the
+ * <p>th fraction of the <n> transfers counted in <buckets>.
+ */
+static double latencyPercentile(const uint64_t *buckets, uint64_t n, double p) {
+  uint64_t want = (uint64_t)ceil(n * p);
+  uint64_t seen = 0;
+
+  for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen >= want) {
+      return (double)(1ULL << i);
+    }
+  }
+
+  return HUGE_VAL;
+}
+
+static void setNumberField(lua_State *L, const char *key, lua_Number value) {
+  lua_pushnumber(L, value);
+  lua_setfield(L, -2, key);
+}
+
+static void setIntegerField(lua_State *L, const char *key, lua_Integer value) {
+  lua_pushinteger(L, value);
+  lua_setfield(L, -2, key);
+}
+
+/*
+ * Pushes a table of the counters in <stats>, keyed by operation name. Kinds
+ * of call that were never made are left out.
+ */
+static void pushCounters(lua_State *L, hidcounters *stats) {
+  lua_createtable(L, 0, HID_OPS);
+
+  for (int op = 0; op < HID_OPS; op++) {
+    hidcounters *c = &stats[op];
+    uint64_t calls = atomic_load_explicit(&c->calls, memory_order_relaxed);
+    uint64_t suppressed = atomic_load_explicit(&c->suppressed, memory_order_relaxed);
+    if (calls == 0 && suppressed == 0) {
+      continue;
+    }
+
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t counted = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      buckets[i] = atomic_load_explicit(&c->buckets[i], memory_order_relaxed);
+      counted += buckets[i];
+    }
+    double total = atomic_load_explicit(&c->nanos, memory_order_relaxed) / 1000.0;
+
+    lua_createtable(L, 0, 12);
+    setIntegerField(L, "calls", calls);
+    setIntegerField(L, "failures", atomic_load_explicit(&c->failures, memory_order_relaxed));
+    setIntegerField(L, "suppressed", suppressed);
+    setIntegerField(L, "reports", atomic_load_explicit(&c->reports, memory_order_relaxed));
+    setIntegerField(L, "bytes", atomic_load_explicit(&c->bytes, memory_order_relaxed));
+    setNumberField(L, "total_us", total);
+    setNumberField(L, "mean_us", (calls > 0) ? total / calls : 0.0);
+    setNumberField(L, "max_us", atomic_load_explicit(&c->maxNanos, memory_order_relaxed) / 1000.0);
+    setNumberField(L, "p50_us", latencyPercentile(buckets, counted, 0.50));
+    setNumberField(L, "p99_us", latencyPercentile(buckets, counted, 0.99));
+
+    lua_createtable(L, 0, 4);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      if (buckets[i] != 0) {
+        if (i < LATENCY_BUCKETS - 1) {
+          lua_pushinteger(L, 1LL << i);
+        } else {
+          lua_pushnumber(L, HUGE_VAL);
+        }
+        lua_pushinteger(L, buckets[i]);
+        lua_rawset(L, -3);
+      }
+    }
+    lua_setfield(L, -2, "histogram");
+
+    lua_setfield(L, -2, hidOpNames[op]);
+  }
+}
+
+/************************************************************************************
+ *
+ * Color Correction
+ *
+ ************************************************************************************/
+
+/*
+ * blink1-lib's gamma correction is a single switch for the whole process, so
+ * it is turned off when the library is loaded and colors are corrected here
+ * instead, on their way to the device, by tables kept in each blinker. A
+ * blinker that hasn't been calibrated uses blink1-lib's curve, or none,
+ * following blink.gamma() and blink.noGamma().
+ */
+
+#define GAMMA_MAX 8.0
+
+static uint8_t degammaTable[256];
+static uint8_t gammaTable[256];
+static pthread_once_t gammaOnce = PTHREAD_ONCE_INIT;
+static atomic_int gammaDefault = 1;
+
+/*
+ * degammaTable maps a color to what blink1-lib sends the device when gamma
+ * correction is on; gammaTable maps back to the smallest color giving at
+ * least that value.
+ */
+static void initGammaTables(void) {
+  for (int i = 0; i < 256; i++) {
+    degammaTable[i] = blink1_degamma(i);
+  }
+
+  int in = 0;
+  for (int out = 0; out < 256; out++) {
+    while (in < 255 && degammaTable[in] < out) {
+      in++;
+    }
+    gammaTable[out] = in;
+  }
+}
+
+/*
+ * Fills in <cc>'s tables: each level goes through the gamma curve, blink1-lib's
+ * if <gamma> is 0 or x^gamma otherwise, and is then scaled by its channel's
+ * entry in <scale>.
+ */
+static void calibrate(correction *cc, double gamma, const double scale[3]) {
+  for (int i = 0; i < 256; i++) {
+    double level = (gamma == 0.0) ? degammaTable[i] : 255.0 * pow(i / 255.0, gamma);
+
+    for (int c = 0; c < 3; c++) {
+      long out = lround(level * scale[c]);
+      cc->lut[c][i] = (out > 255) ? 255 : out;
+    }
+  }
+  cc->calibrated = 1;
+}
+
+/*
+ * Corrects a color about to be sent to <bd>. Called with the io lock held,
+ * which is also held while the tables are changed.
+ */
+static void correctRGB(const blinker *bd, uint8_t *r, uint8_t *g, uint8_t *b) {
+  if (bd->color.calibrated) {
+    *r = bd->color.lut[0][*r];
+    *g = bd->color.lut[1][*g];
+    *b = bd->color.lut[2][*b];
+  } else if (atomic_load_explicit(&gammaDefault, memory_order_relaxed)) {
+    *r = degammaTable[*r];
+    *g = degammaTable[*g];
+    *b = degammaTable[*b];
+  }
+}
+
+/*
+ * Maps a color read back from <bd> to the smallest color that corrects to at
+ * least it, which undoes correctRGB as far as it can be undone. Called with
+ * the io lock held.
+ */
+static void uncorrectRGB(const blinker *bd, uint8_t *r, uint8_t *g, uint8_t *b) {
+  uint8_t *c[3] = { r, g, b };
+
+  if (bd->color.calibrated) {
+    for (int k = 0; k < 3; k++) {
+      int in = 0;
+      while (in < 255 && bd->color.lut[k][in] < *c[k]) {
+        in++;
+      }
+      *c[k] = in;
+    }
+  } else if (atomic_load_explicit(&gammaDefault, memory_order_relaxed)) {
+    *r = gammaTable[*r];
+    *g = gammaTable[*g];
+    *b = gammaTable[*b];
+  }
+}
+
+static void correctSlot(const blinker *bd, patternslot *slot) {
+  correctRGB(bd, &slot->r, &slot->g, &slot->b);
+}
+
+/************************************************************************************
+ *
+ * Remote Transport
+ *
+ ************************************************************************************/
+
+/*
+ * The protocol spoken between blink.connect and blink.serve over a Unix domain
+ * socket. A request is an op, the length of its arguments and the arguments;
+ * a reply is the blink1 library's result as a big-endian 32 bit integer, the
+ * length of what was read back and that data. Ops are those of the HID
+ * counters, so a request is counted under the same op at either end, plus
+ * REMOTE_OPEN to choose the device. A client has one request outstanding at
+ * a time.
+ */
+
+#define REMOTE_OPEN 0x80
+#define REMOTE_HEADER_LEN 2
+#define REMOTE_REPLY_HEADER_LEN 5
+#define REMOTE_PAYLOAD_MAX 255
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static int sendAll(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, SEND_FLAGS);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int recvAll(int fd, uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(fd, data, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * Sends request <op> with <nargs> bytes of arguments over <fd> and waits for
+ * the reply, copying up to <nreply> bytes of it to <reply>. Returns the
+ * result, or BLINK1_ERR if the daemon can't be reached or sent back less than
+ * was asked for.
+ */
+static int remoteRequest(int fd, uint8_t op, const uint8_t *args, size_t nargs, uint8_t *reply, size_t nreply) {
+  uint8_t frame[REMOTE_HEADER_LEN + REMOTE_PAYLOAD_MAX];
+  frame[0] = op;
+  frame[1] = nargs;
+  memcpy(frame + REMOTE_HEADER_LEN, args, nargs);
+
+  uint8_t header[REMOTE_REPLY_HEADER_LEN];
+  uint8_t payload[REMOTE_PAYLOAD_MAX];
+  if (fd < 0 || sendAll(fd, frame, REMOTE_HEADER_LEN + nargs) != 0 ||
+      recvAll(fd, header, sizeof(header)) != 0 || recvAll(fd, payload, header[4]) != 0) {
+    return BLINK1_ERR;
+  }
+
+  int32_t result = (int32_t)((uint32_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3]);
+  if (result != BLINK1_ERR && header[4] < nreply) {
+    return BLINK1_ERR;
+  }
+  memcpy(reply, payload, nreply);
+
+  return result;
+}
+
+/*
+ * Sends a transfer for <bd> to its daemon. Called with the io lock held, which
+ * also keeps requests on the socket from interleaving.
+ */
+static int remoteCall(blinker *bd, uint8_t op, const uint8_t *args, size_t nargs, uint8_t *reply, size_t nreply) {
+  return remoteRequest(bd->link.fd, op, args, nargs, reply, nreply);
+}
+
+static int remoteReadRGB(blinker *bd, uint16_t *millis, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t n) {
+  uint8_t reply[5];
+  int result = remoteCall(bd, HID_READRGB, &n, 1, reply, sizeof(reply));
+  if (result != BLINK1_ERR) {
+    *millis = reply[0] << 8 | reply[1];
+    *r = reply[2];
+    *g = reply[3];
+    *b = reply[4];
+  }
+
+  return result;
+}
+
+static int remoteReadPlayState(blinker *bd, uint8_t *playing, uint8_t *playstart, uint8_t *playend,
+                               uint8_t *playcount, uint8_t *playpos) {
+  uint8_t reply[5];
+  int result = remoteCall(bd, HID_READPLAY, NULL, 0, reply, sizeof(reply));
+  if (result != BLINK1_ERR) {
+    *playing = reply[0];
+    *playstart = reply[1];
+    *playend = reply[2];
+    *playcount = reply[3];
+    *playpos = reply[4];
+  }
+
+  return result;
+}
+
+static int remoteWriteLine(blinker *bd, const patternslot *slot, uint8_t pos) {
+  uint8_t args[] = { slot->millis >> 8, slot->millis & 0xff, slot->r, slot->g, slot->b, slot->led, pos };
+
+  return remoteCall(bd, HID_WRITELINE, args, sizeof(args), NULL, 0);
+}
+
+static int remoteReadLine(blinker *bd, patternslot *slot, uint8_t pos) {
+  uint8_t reply[6];
+  int result = remoteCall(bd, HID_READLINE, &pos, 1, reply, sizeof(reply));
+  if (result != BLINK1_ERR) {
+    *slot = (patternslot){ (uint16_t)(reply[0] << 8 | reply[1]), reply[2], reply[3], reply[4], reply[5] };
+  }
+
+  return result;
+}
+
+/************************************************************************************
+ *
+ * Device Access
+ *
+ ************************************************************************************/
+
+/*
+ * Every HID transfer goes through one of these wrappers. A blinker may be
+ * driven by its Lua state and by its animation thread at the same time and
+ * neither hidapi nor the blink1 library is safe to use concurrently on a
+ * single handle, so each transfer holds the blinker's io mutex.
+ */
+
+/*
+ * LED numbers follow the blink1 library: 0 means both LEDs, 1 and 2 a single
+ * LED. Reads of LED 0 report the first LED.
+ */
+static int ledIndex(uint8_t n) {
+  return (n == 2) ? 1 : 0;
+}
+
+static int sameColor(rgb_t a, rgb_t b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static rgb_t ledColorAt(const ledstate *led, uint64_t now) {
+  uint64_t elapsed = (now - led->start) / NSEC_PER_MSEC;
+  if (elapsed >= led->millis) {
+    return led->to;
+  }
+
+  int t = (int)elapsed;
+  int span = led->millis;
+  rgb_t c;
+  c.r = led->from.r + (led->to.r - led->from.r) * t / span;
+  c.g = led->from.g + (led->to.g - led->from.g) * t / span;
+  c.b = led->from.b + (led->to.b - led->from.b) * t / span;
+
+  return c;
+}
+
+/*
+ * Records a set or fade of LED <n> after a transfer. A failed transfer leaves
+ * the LED's color unknown.
+ */
+static void shadowColor(blinker *bd, int result, uint16_t millis, rgb_t want, rgb_t sent, uint8_t n) {
+  uint64_t now = nowNanos();
+
+  for (int i = 0; i < LED_COUNT; i++) {
+    if (n != 0 && ledIndex(n) != i) {
+      continue;
+    }
+
+    if (result == BLINK1_ERR) {
+      bd->ledsKnown &= ~(1u << i);
+      continue;
+    }
+
+    ledstate *led = &bd->leds[i];
+    rgb_t from = (bd->ledsKnown & (1u << i)) ? ledColorAt(led, now) : want;
+    led->from = from;
+    led->to = want;
+    led->sent = sent;
+    led->millis = millis;
+    led->start = now;
+    if (!bd->link.remote) {
+      bd->ledsKnown |= (1u << i);
+    }
+  }
+}
+
+/*
+ * Records the color last commanded for LED <n>, to be restored if the device
+ * has to be reopened (see Reconnection).
+ */
+static void commandColor(blinker *bd, uint8_t r, uint8_t g, uint8_t b, uint8_t n) {
+  reconnector *rc = &bd->reconnect;
+
+  for (int i = 0; i < LED_COUNT; i++) {
+    if (n == 0 || ledIndex(n) == i) {
+      rc->colors[i] = (rgb_t){ r, g, b };
+      rc->colorsKnown |= (1u << i);
+    }
+  }
+  rc->playing = 0;
+}
+
+/*
+ * True if deduplication is on and each LED that <n> selects has settled on
+ * the corrected color <r, g, b>, sent recently enough. Never true for a
+ * blinker connected to a daemon, which can't know what other clients sent.
+ * Called with the io lock held.
+ */
+static int unchanged(blinker *bd, uint8_t r, uint8_t g, uint8_t b, uint8_t n) {
+  if (!bd->dedup.enabled || bd->link.remote) {
+    return 0;
+  }
+
+  uint64_t now = nowNanos();
+  for (int i = 0; i < LED_COUNT; i++) {
+    if (n != 0 && ledIndex(n) != i) {
+      continue;
+    }
+
+    const ledstate *led = &bd->leds[i];
+    uint64_t age = now - led->start;
+    if (!(bd->ledsKnown & (1u << i)) || led->sent.r != r || led->sent.g != g || led->sent.b != b ||
+        age < led->millis * NSEC_PER_MSEC || (bd->dedup.maxAge != 0 && age >= bd->dedup.maxAge)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int blinker_setRGB(blinker *bd, uint8_t r, uint8_t g, uint8_t b) {
+  pthread_mutex_lock(&bd->io);
+  commandColor(bd, r, g, b, 0);
+  uint8_t cr = r, cg = g, cb = b;
+  correctRGB(bd, &cr, &cg, &cb);
+  if (unchanged(bd, cr, cg, cb, 0)) {
+    recordSuppressed(bd, HID_SET);
+    pthread_mutex_unlock(&bd->io);
+    return 0;
+  }
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_SET, start, bd->link.remote
+                              ? remoteCall(bd, HID_SET, (uint8_t[]){ cr, cg, cb }, 3, NULL, 0)
+                              : blink1_setRGB(bd->device, cr, cg, cb));
+  shadowColor(bd, result, 0, (rgb_t){ r, g, b }, (rgb_t){ cr, cg, cb }, 0);
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+static int blinker_fadeToRGBN(blinker *bd, uint16_t millis, uint8_t r, uint8_t g, uint8_t b, uint8_t n) {
+  pthread_mutex_lock(&bd->io);
+  commandColor(bd, r, g, b, n);
+  uint8_t cr = r, cg = g, cb = b;
+  correctRGB(bd, &cr, &cg, &cb);
+  if (unchanged(bd, cr, cg, cb, n)) {
+    recordSuppressed(bd, HID_FADE);
+    pthread_mutex_unlock(&bd->io);
+    return 0;
+  }
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_FADE, start, bd->link.remote
+                              ? remoteCall(bd, HID_FADE, (uint8_t[]){ millis >> 8, millis & 0xff, cr, cg, cb, n }, 6, NULL, 0)
+                              : blink1_fadeToRGBN(bd->device, millis, cr, cg, cb, n));
+  shadowColor(bd, result, millis, (rgb_t){ r, g, b }, (rgb_t){ cr, cg, cb }, n);
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+static int blinker_readRGB(blinker *bd, uint16_t *millis, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t n) {
+  pthread_mutex_lock(&bd->io);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_READRGB, start, bd->link.remote
+                              ? remoteReadRGB(bd, millis, r, g, b, n)
+                              : blink1_readRGB(bd->device, millis, r, g, b, n));
+  if (result != BLINK1_ERR) {
+    // The device reports corrected colors. If it shows what was last sent,
+    // the color asked for is still the one to report; if the LED was changed
+    // behind our back, it is only known as far as the correction can be
+    // undone. A fade in flight is left alone.
+    int i = ledIndex(n);
+    ledstate *led = &bd->leds[i];
+    rgb_t shown = { *r, *g, *b };
+    uint64_t now = nowNanos();
+    int known = bd->ledsKnown & (1u << i);
+    int settled = now - led->start >= (uint64_t)led->millis * NSEC_PER_MSEC;
+
+    if (known && settled && sameColor(led->sent, shown)) {
+      *r = led->to.r;
+      *g = led->to.g;
+      *b = led->to.b;
+    } else {
+      uncorrectRGB(bd, r, g, b);
+      if (!known || settled) {
+        led->from = led->to = (rgb_t){ *r, *g, *b };
+        led->sent = shown;
+        led->millis = *millis;
+        led->start = now - (uint64_t)*millis * NSEC_PER_MSEC;
+        if (!bd->link.remote) {
+          bd->ledsKnown |= (1u << i);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+/*
+ * Returns the color LED <n> is currently displaying, computed from the last
+ * commanded color when it is known. The device is only asked if <refresh>
+ * is set or the color is unknown.
+ */
+static int blinker_currentRGB(blinker *bd, uint16_t *millis, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t n, int refresh) {
+  int i = ledIndex(n);
+
+  pthread_mutex_lock(&bd->io);
+  if (!refresh && (bd->ledsKnown & (1u << i))) {
+    rgb_t c = ledColorAt(&bd->leds[i], nowNanos());
+    *r = c.r;
+    *g = c.g;
+    *b = c.b;
+    *millis = bd->leds[i].millis;
+    pthread_mutex_unlock(&bd->io);
+    return 0;
+  }
+  pthread_mutex_unlock(&bd->io);
+
+  return blinker_readRGB(bd, millis, r, g, b, n);
+}
+
+static int blinker_getVersion(blinker *bd) {
+  pthread_mutex_lock(&bd->io);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_VERSION, start, bd->link.remote
+                              ? remoteCall(bd, HID_VERSION, NULL, 0, NULL, 0)
+                              : blink1_getVersion(bd->device));
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+static int blinker_playloop(blinker *bd, uint8_t play, uint8_t startpos, uint8_t endpos, uint8_t count) {
+  pthread_mutex_lock(&bd->io);
+  bd->reconnect.playing = play;
+  memcpy(bd->reconnect.play, (uint8_t[]){ startpos, endpos, count }, 3);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_PLAYLOOP, start, bd->link.remote
+                              ? remoteCall(bd, HID_PLAYLOOP, (uint8_t[]){ play, startpos, endpos, count }, 4, NULL, 0)
+                              : blink1_playloop(bd->device, play, startpos, endpos, count));
+  // Once the device plays a pattern on its own we no longer know what it displays.
+  bd->ledsKnown = 0;
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+static int blinker_readPlayState(blinker *bd, uint8_t *playing, uint8_t *playstart,
+                                 uint8_t *playend, uint8_t *playcount, uint8_t *playpos) {
+  pthread_mutex_lock(&bd->io);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_READPLAY, start, bd->link.remote
+                              ? remoteReadPlayState(bd, playing, playstart, playend, playcount, playpos)
+                              : blink1_readPlayState(bd->device, playing, playstart, playend, playcount, playpos));
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+static int blinker_serverdown(blinker *bd, uint8_t on, uint32_t millis, uint8_t stay, uint8_t startpos, uint8_t endpos) {
+  pthread_mutex_lock(&bd->io);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_SERVERDOWN, start, bd->link.remote
+                              ? remoteCall(bd, HID_SERVERDOWN, (uint8_t[]){ on, millis >> 24, millis >> 16, millis >> 8, millis,
+                                                                            stay, startpos, endpos }, 8, NULL, 0)
+                              : blink1_serverdown(bd->device, on, millis, stay, startpos, endpos));
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+/*
+ * Records what the device's pattern RAM holds at <pos> after a transfer. A
+ * failed transfer leaves the slot's contents unknown, as does any transfer
+ * through a daemon.
+ */
+static void shadowPatternLine(blinker *bd, int result, const patternslot *slot, uint8_t pos) {
+  if (pos >= PATTERN_SLOTS) {
+    return;
+  }
+
+  if (result == BLINK1_ERR || bd->link.remote) {
+    bd->patternKnown &= ~(1u << pos);
+  } else {
+    bd->pattern[pos] = *slot;
+    bd->patternKnown |= (1u << pos);
+  }
+}
+
+/*
+ * Writes one pattern line, already color corrected, first telling the device
+ * which LED it applies to if that differs from the last line written. A
+ * daemon is sent the LED with the line, since other clients may write lines
+ * for other LEDs in between. Called with the io lock held.
+ */
+static int writePatternSlot(blinker *bd, const patternslot *slot, uint8_t pos) {
+  if (bd->link.remote) {
+    uint64_t start = nowNanos();
+    int result = recordTransfer(bd, HID_WRITELINE, start, remoteWriteLine(bd, slot, pos));
+    shadowPatternLine(bd, result, slot, pos);
+    return result;
+  }
+
+  if (bd->patternLed != slot->led) {
+    uint64_t start = nowNanos();
+    if (recordTransfer(bd, HID_SETLEDN, start, blink1_setLEDN(bd->device, slot->led)) == BLINK1_ERR) {
+      bd->patternLed = -1;
+      shadowPatternLine(bd, BLINK1_ERR, slot, pos);
+      return BLINK1_ERR;
+    }
+    bd->patternLed = slot->led;
+  }
+
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_WRITELINE, start,
+                              blink1_writePatternLine(bd->device, slot->millis, slot->r, slot->g, slot->b, pos));
+  shadowPatternLine(bd, result, slot, pos);
+
+  return result;
+}
+
+static int blinker_writePatternLine(blinker *bd, const patternslot *slot, uint8_t pos) {
+  patternslot corrected = *slot;
+
+  pthread_mutex_lock(&bd->io);
+  correctSlot(bd, &corrected);
+  int result = writePatternSlot(bd, &corrected, pos);
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+/*
+ * Reads one pattern line. Firmware older than 2.04 has no per-LED pattern
+ * lines, so once the firmware version is known the plain read is used for
+ * it. Called with the io lock held.
+ */
+static int readPatternSlot(blinker *bd, patternslot *slot, uint8_t pos) {
+  uint64_t start = nowNanos();
+  int result;
+
+  if (bd->link.remote) {
+    // the daemon knows which read its device needs
+    result = recordTransfer(bd, HID_READLINE, start, remoteReadLine(bd, slot, pos));
+  } else if (bd->firmware != 0 && bd->firmware < LEDN_FIRMWARE) {
+    slot->led = 0;
+    result = recordTransfer(bd, HID_READLINE, start,
+                            blink1_readPatternLine(bd->device, &slot->millis, &slot->r, &slot->g, &slot->b, pos));
+  } else {
+    result = recordTransfer(bd, HID_READLINE, start,
+                            blink1_readPatternLineN(bd->device, &slot->millis, &slot->r, &slot->g, &slot->b, &slot->led, pos));
+    // firmware without per-LED patterns reports garbage here
+    if (result != BLINK1_ERR && slot->led > LED_COUNT) {
+      slot->led = 0;
+    }
+  }
+
+  if (result != BLINK1_ERR) {
+    shadowPatternLine(bd, result, slot, pos);
+  }
+
+  return result;
+}
+
+static int blinker_readPatternLine(blinker *bd, patternslot *slot, uint8_t pos) {
+  pthread_mutex_lock(&bd->io);
+  int result = readPatternSlot(bd, slot, pos);
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+/*
+ * Reads pattern lines 0 to <n> - 1 into <slots> back to back, holding the io
+ * lock throughout. Bit n of *failed is set for each line that could not be
+ * read, including lines past the end of the device's pattern RAM; those
+ * slots are zeroed.
+ */
+static void blinker_readPattern(blinker *bd, patternslot *slots, int n, uint32_t *failed) {
+  *failed = 0;
+
+  pthread_mutex_lock(&bd->io);
+  if (bd->firmware == 0 && !bd->link.remote) {
+    uint64_t start = nowNanos();
+    int version = recordTransfer(bd, HID_VERSION, start, blink1_getVersion(bd->device));
+    if (version > 0) {
+      bd->firmware = version;
+    }
+  }
+
+  for (int pos = 0; pos < n; pos++) {
+    if (pos >= bd->patternSlots || readPatternSlot(bd, &slots[pos], pos) == BLINK1_ERR) {
+      memset(&slots[pos], 0, sizeof(patternslot));
+      *failed |= (1u << pos);
+    }
+  }
+  pthread_mutex_unlock(&bd->io);
+}
+
+/*
+ * Corrects <n> pattern lines in place, as they would be written to <bd>.
+ */
+static void blinker_correctPattern(blinker *bd, patternslot *slots, int n) {
+  pthread_mutex_lock(&bd->io);
+  for (int pos = 0; pos < n; pos++) {
+    correctSlot(bd, &slots[pos]);
+  }
+  pthread_mutex_unlock(&bd->io);
+}
+
+/*
+ * Writes <n> pattern lines to the slots starting at <first>, skipping slots
+ * whose contents already match the host's copy of the device's pattern RAM
+ * unless <force> is set. Bit n of *failed is set for each slot that could not
+ * be written, including those past the end of the device's pattern RAM, which
+ * are not sent. Returns the number of lines written; the setLEDN reports that
+ * may precede them are not counted, since callers report lines to Lua.
+ */
+static int blinker_uploadPattern(blinker *bd, const patternslot *slots, int first, int n, int force, uint32_t *failed) {
+  int sent = 0;
+  *failed = 0;
+
+  pthread_mutex_lock(&bd->io);
+  int room = (first < bd->patternSlots) ? bd->patternSlots - first : 0;
+  for (int pos = first + room; pos < first + n; pos++) {
+    *failed |= (1u << pos);
+  }
+  if (n > room) {
+    n = room;
+  }
+
+  for (int pos = first; pos < first + n; pos++) {
+    patternslot want = slots[pos - first];
+    const patternslot *have = &bd->pattern[pos];
+
+    // the shadow holds lines as the device does, so compare them corrected
+    correctSlot(bd, &want);
+    if (!force && (bd->patternKnown & (1u << pos)) &&
+        have->millis == want.millis && have->r == want.r && have->g == want.g && have->b == want.b &&
+        have->led == want.led) {
+      continue;
+    }
+
+    int result = writePatternSlot(bd, &want, pos);
+    sent++;  // a line, however many reports it took
+
+    if (result == BLINK1_ERR) {
+      *failed |= (1u << pos);
+    }
+  }
+  pthread_mutex_unlock(&bd->io);
+
+  return sent;
+}
+
+static int blinker_savePattern(blinker *bd) {
+  pthread_mutex_lock(&bd->io);
+  uint64_t start = nowNanos();
+  int result = recordTransfer(bd, HID_SAVE, start, bd->link.remote
+                              ? remoteCall(bd, HID_SAVE, NULL, 0, NULL, 0)
+                              : blink1_savePattern(bd->device));
+  pthread_mutex_unlock(&bd->io);
+
+  return result;
+}
+
+/************************************************************************************
+ *
+ * Timing
+ *
+ ************************************************************************************/
+
+static uint64_t nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Condition variables used by worker threads wait on absolute CLOCK_MONOTONIC
+ * deadlines so that wall-clock adjustments don't stretch or shrink animations.
+ * macOS has no pthread_condattr_setclock, so there we convert the remaining
+ * time into a CLOCK_REALTIME deadline instead.
+ */
+static void initCond(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#if defined(__linux__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static int condWaitUntil(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline) {
+  struct timespec ts;
+#if defined(__linux__)
+  ts.tv_sec = deadline / NSEC_PER_SEC;
+  ts.tv_nsec = deadline % NSEC_PER_SEC;
+#else
+  uint64_t now = nowNanos();
+  uint64_t remaining = (deadline > now) ? deadline - now : 0;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t abs = (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec + remaining;
+  ts.tv_sec = abs / NSEC_PER_SEC;
+  ts.tv_nsec = abs % NSEC_PER_SEC;
+#endif
+
+  return pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+/************************************************************************************
+ *
+ * Notifications
+ *
+ ************************************************************************************/
+
+static notifier *newNotifier(void) {
+  notifier *n = calloc(1, sizeof(notifier));
+  if (n == NULL) {
+    return NULL;
+  }
+
+  if (pipe(n->fds) != 0) {
+    free(n);
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(n->fds[i], F_SETFL, fcntl(n->fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(n->fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  pthread_mutex_init(&n->lock, NULL);
+  atomic_init(&n->signalled, 0);
+  atomic_init(&n->hotplug, 0);
+  atomic_init(&n->refs, 1);
+
+  return n;
+}
+
+static notifier *retainNotifier(notifier *n) {
+  if (n != NULL) {
+    atomic_fetch_add(&n->refs, 1);
+  }
+
+  return n;
+}
+
+static void releaseNotifier(notifier *n) {
+  if (n == NULL || atomic_fetch_sub(&n->refs, 1) != 1) {
+    return;
+  }
+
+  while (n->head != NULL) {
+    event *e = n->head;
+    n->head = e->next;
+    free(e);
+  }
+  close(n->fds[0]);
+  close(n->fds[1]);
+  pthread_mutex_destroy(&n->lock);
+  free(n);
+}
+
+/*
+ * Makes the read end of the pipe readable, if it isn't already.
+ */
+static void signalNotifier(notifier *n) {
+  if (!atomic_exchange(&n->signalled, 1)) {
+    ssize_t ignored = write(n->fds[1], "", 1);
+    (void)ignored;
+  }
+}
+
+/*
+ * Queues an event of <kind> about <source> and signals. An event that can't
+ * be allocated is lost.
+ */
+static void postEvent(notifier *n, eventkind kind, void *source) {
+  if (n == NULL) {
+    return;
+  }
+
+  event *e = malloc(sizeof(event));
+  if (e == NULL) {
+    return;
+  }
+  e->kind = kind;
+  e->source = source;
+  e->next = NULL;
+
+  pthread_mutex_lock(&n->lock);
+  if (n->tail == NULL) {
+    n->head = e;
+  } else {
+    n->tail->next = e;
+  }
+  n->tail = e;
+  pthread_mutex_unlock(&n->lock);
+
+  signalNotifier(n);
+}
+
+/*
+ * Takes the oldest event off the queue, or returns NULL if there is none.
+ * The caller frees it. <more> is set if other events are still queued.
+ */
+static event *takeEvent(notifier *n, int *more) {
+  pthread_mutex_lock(&n->lock);
+  event *e = n->head;
+  if (e != NULL) {
+    n->head = e->next;
+    if (n->head == NULL) {
+      n->tail = NULL;
+    }
+  }
+  *more = (n->head != NULL);
+  pthread_mutex_unlock(&n->lock);
+
+  return e;
+}
+
+/*
+ * Drops the queued events about <source>, which is going away.
+ */
+static void dropEvents(notifier *n, void *source) {
+  pthread_mutex_lock(&n->lock);
+  event **link = &n->head;
+  n->tail = NULL;
+  while (*link != NULL) {
+    event *e = *link;
+    if (e->source == source) {
+      *link = e->next;
+      free(e);
+    } else {
+      n->tail = e;
+      link = &e->next;
+    }
+  }
+  pthread_mutex_unlock(&n->lock);
+}
+
+/*
+ * Empties the pipe once everything has been delivered. The flag is cleared
+ * before the queue is checked, so an event posted meanwhile either is seen
+ * here or signals again.
+ */
+static void settleNotifier(notifier *n) {
+  char buf[64];
+
+  atomic_store(&n->signalled, 0);
+  while (read(n->fds[0], buf, sizeof(buf)) > 0) {
+    // discard
+  }
+
+  pthread_mutex_lock(&n->lock);
+  int pending = (n->head != NULL);
+  pthread_mutex_unlock(&n->lock);
+
+  if (pending || atomic_load(&n->hotplug)) {
+    signalNotifier(n);
+  }
+}
+
+/************************************************************************************
+ *
+ * Animation Engine
+ *
+ ************************************************************************************/
+
+/*
+ * Worker thread body. Keyframes are issued on absolute deadlines measured from
+ * the start of the timeline, so the time spent in each HID transfer does not
+ * accumulate as drift. The animator lock is dropped while talking to the device.
+ */
+static void *animatorMain(void *arg) {
+  blinker *bd = arg;
+  animator *a = &bd->anim;
+
+  pthread_mutex_lock(&a->lock);
+  while (!a->quit) {
+    if (a->frames == NULL) {
+      pthread_cond_wait(&a->wake, &a->lock);
+      continue;
+    }
+
+    unsigned long generation = a->generation;
+    uint64_t deadline = nowNanos();
+    int frame = 0;
+    int repeat = 0;
+
+    while (!a->quit && generation == a->generation) {
+      if (nowNanos() < deadline) {
+        condWaitUntil(&a->wake, &a->lock, deadline);
+        continue;
+      }
+
+      keyframe k = a->frames[frame];
+      pthread_mutex_unlock(&a->lock);
+      blinker_fadeToRGBN(bd, k.millis, k.r, k.g, k.b, k.led);
+      pthread_mutex_lock(&a->lock);
+
+      deadline += k.wait * NSEC_PER_MSEC;
+      if (++frame == a->nframes) {
+        frame = 0;
+        if (a->count != 0 && ++repeat == a->count) {
+          if (generation == a->generation) {
+            free(a->frames);
+            a->frames = NULL;
+            a->nframes = 0;
+            a->generation++;
+            pthread_cond_broadcast(&a->wake);
+            if (a->notify) {
+              postEvent(bd->events, EVENT_ANIMATION, bd);
+            }
+          }
+          break;
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+
+  return NULL;
+}
+
+static void initAnimator(animator *a) {
+  pthread_mutex_init(&a->lock, NULL);
+  initCond(&a->wake);
+  a->started = 0;
+  a->quit = 0;
+  a->frames = NULL;
+  a->nframes = 0;
+  a->count = 0;
+  a->notify = 0;
+  a->generation = 0;
+}
+
+/*
+ * Replaces the current timeline (if any) with <frames>, taking ownership of
+ * the array. Passing NULL cancels the running animation. Returns 0, or -1 if
+ * the worker thread could not be started.
+ */
+static int setTimeline(blinker *bd, keyframe *frames, int nframes, int count) {
+  animator *a = &bd->anim;
+
+  pthread_mutex_lock(&a->lock);
+  if (frames != NULL && !a->started) {
+    if (pthread_create(&a->thread, NULL, animatorMain, bd) != 0) {
+      pthread_mutex_unlock(&a->lock);
+      free(frames);
+      return -1;
+    }
+    a->started = 1;
+  }
+
+  free(a->frames);
+  a->frames = frames;
+  a->nframes = nframes;
+  a->count = count;
+  a->generation++;
+  pthread_cond_broadcast(&a->wake);
+  pthread_mutex_unlock(&a->lock);
+
+  return 0;
+}
+
+static void stopAnimator(blinker *bd) {
+  animator *a = &bd->anim;
+
+  pthread_mutex_lock(&a->lock);
+  int started = a->started;
+  a->quit = 1;
+  a->started = 0;
+  pthread_cond_broadcast(&a->wake);
+  pthread_mutex_unlock(&a->lock);
+
+  if (started) {
+    pthread_join(a->thread, NULL);
+  }
+
+  free(a->frames);
+  a->frames = NULL;
+  a->nframes = 0;
+}
+
+/************************************************************************************
+ *
+ * Frame Streaming
+ *
+ ************************************************************************************/
+
+#define STREAM_RGB 3
+#define STREAM_RGB2 6
+
+/*
+ * Sends one packed frame. Called without the streamer lock held.
+ */
+static int sendFrame(blinker *bd, const uint8_t *f, int stride) {
+  if (stride == STREAM_RGB) {
+    return blinker_setRGB(bd, f[0], f[1], f[2]);
+  }
+
+  int result = blinker_fadeToRGBN(bd, 0, f[0], f[1], f[2], 1);
+  if (blinker_fadeToRGBN(bd, 0, f[3], f[4], f[5], 2) == BLINK1_ERR) {
+    result = BLINK1_ERR;
+  }
+
+  return result;
+}
+
+/*
+ * Worker thread body. Frame i of a stream is due at start + i * period, so,
+ * as with the animator, the cost of each transfer doesn't add up as drift.
+ * When the device can't keep up and <drop> is set, frames whose successors
+ * are already due are skipped rather than sent late; otherwise every frame is
+ * sent, as quickly as the device allows, until the stream is back on time.
+ */
+static void *streamerMain(void *arg) {
+  blinker *bd = arg;
+  streamer *s = &bd->stream;
+
+  pthread_mutex_lock(&s->lock);
+  while (!s->quit) {
+    if (s->frames == NULL) {
+      pthread_cond_wait(&s->wake, &s->lock);
+      continue;
+    }
+
+    unsigned long generation = s->generation;
+    uint64_t total = (s->count == 0) ? UINT64_MAX : (uint64_t)s->count * s->nframes;
+    uint64_t start = s->report.start;
+    uint64_t due = 0;
+
+    while (!s->quit && generation == s->generation && due < total) {
+      uint64_t deadline = start + due * s->period;
+      uint64_t now = nowNanos();
+      if (now < deadline) {
+        condWaitUntil(&s->wake, &s->lock, deadline);
+        continue;
+      }
+
+      if (s->drop) {
+        uint64_t behind = (now - deadline) / s->period;
+        if (behind > total - due - 1) {
+          behind = total - due - 1;
+        }
+        due += behind;
+        deadline += behind * s->period;
+        s->report.dropped += behind;
+      }
+
+      uint8_t frame[STREAM_RGB2];
+      memcpy(frame, s->frames + (due % s->nframes) * s->stride, s->stride);
+      int stride = s->stride;
+      pthread_mutex_unlock(&s->lock);
+      uint64_t issued = nowNanos();
+      int result = sendFrame(bd, frame, stride);
+      pthread_mutex_lock(&s->lock);
+
+      if (generation != s->generation) {
+        break;
+      }
+
+      streamreport *r = &s->report;
+      uint64_t late = issued - deadline;
+      if (r->sent > 0) {
+        double interval = (double)(issued - r->lastSend);
+        r->intervals += interval;
+        r->intervalSquares += interval * interval;
+      }
+      r->sent++;
+      r->failed += (result == BLINK1_ERR);
+      r->lastSend = issued;
+      r->lateNanos += late;
+      if (late > r->maxLateNanos) {
+        r->maxLateNanos = late;
+      }
+      due++;
+    }
+
+    if (generation == s->generation) {
+      free(s->frames);
+      s->frames = NULL;
+      s->nframes = 0;
+      s->report.stop = nowNanos();
+      s->generation++;
+      pthread_cond_broadcast(&s->wake);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return NULL;
+}
+
+static void initStreamer(streamer *s) {
+  pthread_mutex_init(&s->lock, NULL);
+  initCond(&s->wake);
+  s->started = 0;
+  s->quit = 0;
+  s->frames = NULL;
+  s->nframes = 0;
+  s->stride = STREAM_RGB;
+  s->period = 0;
+  s->count = 0;
+  s->drop = 1;
+  s->generation = 0;
+  memset(&s->report, 0, sizeof(s->report));
+}
+
+/*
+ * Replaces the current stream (if any) with <nframes> frames of <stride> bytes,
+ * taking ownership of <frames>. Passing NULL stops the running stream. Returns 0,
+ * or -1 if the worker thread could not be started.
+ */
+static int setStream(blinker *bd, uint8_t *frames, size_t nframes, int stride, uint64_t period, int count, int drop) {
+  streamer *s = &bd->stream;
+
+  pthread_mutex_lock(&s->lock);
+  if (frames != NULL && !s->started) {
+    if (pthread_create(&s->thread, NULL, streamerMain, bd) != 0) {
+      pthread_mutex_unlock(&s->lock);
+      free(frames);
+      return -1;
+    }
+    s->started = 1;
+  }
+
+  if (s->frames != NULL) {
+    s->report.stop = nowNanos();
+  }
+  free(s->frames);
+  s->frames = frames;
+  s->nframes = nframes;
+  if (frames != NULL) {
+    s->stride = stride;
+    s->period = period;
+    s->count = count;
+    s->drop = drop;
+    memset(&s->report, 0, sizeof(s->report));
+    s->report.start = nowNanos();
+  }
+  s->generation++;
+  pthread_cond_broadcast(&s->wake);
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+static void stopStreamer(blinker *bd) {
+  streamer *s = &bd->stream;
+
+  pthread_mutex_lock(&s->lock);
+  int started = s->started;
+  s->quit = 1;
+  s->started = 0;
+  pthread_cond_broadcast(&s->wake);
+  pthread_mutex_unlock(&s->lock);
+
+  if (started) {
+    pthread_join(s->thread, NULL);
+  }
+
+  free(s->frames);
+  s->frames = NULL;
+  s->nframes = 0;
+}
+
+/************************************************************************************
+ *
+ * Write-behind Queue
+ *
+ ************************************************************************************/
+
+#define CMD_VALID (1ULL << 63)
+#define CMD_SET (1ULL << 62)
+
+static uint64_t packCommand(int isSet, uint16_t millis, uint8_t r, uint8_t g, uint8_t b) {
+  return CMD_VALID | (isSet ? CMD_SET : 0) | ((uint64_t)millis << 32) |
+    ((uint64_t)r << 16) | ((uint64_t)g << 8) | (uint64_t)b;
+}
+
+static int transmitCommand(blinker *bd, uint64_t cmd, uint8_t n) {
+  uint16_t millis = (uint16_t)(cmd >> 32);
+  uint8_t r = (uint8_t)(cmd >> 16);
+  uint8_t g = (uint8_t)(cmd >> 8);
+  uint8_t b = (uint8_t)cmd;
+
+  if (cmd & CMD_SET) {
+    return blinker_setRGB(bd, r, g, b);
+  }
+
+  return blinker_fadeToRGBN(bd, millis, r, g, b, n);
+}
+
+/*
+ * Called with the queue's lock held.
+ */
+static int queueEmpty(writebehind *q) {
+  for (int n = 0; n <= LED_COUNT; n++) {
+    if (q->pending[n] != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Writer thread body. Each round takes every pending command at once, then
+ * sends the command for both LEDs before single-LED commands: queueing a
+ * command for both LEDs discards any pending single-LED commands, so
+ * whatever single-LED commands were taken with it were queued after it.
+ */
+static void *writerMain(void *arg) {
+  blinker *bd = arg;
+  writebehind *q = &bd->queue;
+  uint64_t taken[LED_COUNT + 1];
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->quit || !queueEmpty(q)) {
+    if (queueEmpty(q)) {
+      q->busy = 0;
+      pthread_cond_broadcast(&q->idle);
+      if (!q->quit) {
+        pthread_cond_wait(&q->wake, &q->lock);
+      }
+      continue;
+    }
+    memcpy(taken, q->pending, sizeof(taken));
+    memset(q->pending, 0, sizeof(q->pending));
+    q->busy = 1;
+    pthread_mutex_unlock(&q->lock);
+
+    for (int n = 0; n <= LED_COUNT; n++) {
+      uint64_t cmd = taken[n];
+      if (cmd == 0) {
+        continue;
+      }
+
+      if (transmitCommand(bd, cmd, n) == BLINK1_ERR) {
+        atomic_fetch_add(&q->failed, 1);
+      }
+      atomic_fetch_add(&q->transmitted, 1);
+    }
+
+    pthread_mutex_lock(&q->lock);
+  }
+  q->busy = 0;
+  pthread_cond_broadcast(&q->idle);
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+static void initQueue(writebehind *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  initCond(&q->wake);
+  initCond(&q->idle);
+  q->started = 0;
+  q->quit = 0;
+  q->busy = 0;
+  atomic_init(&q->enabled, 0);
+  memset(q->pending, 0, sizeof(q->pending));
+  atomic_init(&q->submitted, 0);
+  atomic_init(&q->transmitted, 0);
+  atomic_init(&q->coalesced, 0);
+  atomic_init(&q->failed, 0);
+}
+
+/*
+ * Sends a set (isSet) or fade of LED <n>, either directly or, if write-behind is
+ * enabled, by queueing it for the writer thread. Queued commands always succeed.
+ */
+static int submitColor(blinker *bd, int isSet, uint16_t millis, uint8_t r, uint8_t g, uint8_t b, uint8_t n) {
+  writebehind *q = &bd->queue;
+
+  if (!atomic_load(&q->enabled)) {
+    return isSet ? blinker_setRGB(bd, r, g, b) : blinker_fadeToRGBN(bd, millis, r, g, b, n);
+  }
+
+  atomic_fetch_add(&q->submitted, 1);
+  pthread_mutex_lock(&q->lock);
+  if (isSet || n == 0) {
+    for (int i = 1; i <= LED_COUNT; i++) {
+      if (q->pending[i] != 0) {
+        q->pending[i] = 0;
+        atomic_fetch_add(&q->coalesced, 1);
+      }
+    }
+    n = 0;
+  }
+  if (q->pending[n] != 0) {
+    atomic_fetch_add(&q->coalesced, 1);
+  }
+  q->pending[n] = packCommand(isSet, millis, r, g, b);
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+/*
+ * Waits until everything queued so far has been transmitted, or until
+ * <deadline> (0 = no deadline). Returns 1 if the queue drained.
+ */
+static int flushQueue(blinker *bd, uint64_t deadline) {
+  writebehind *q = &bd->queue;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->started && (q->busy || !queueEmpty(q))) {
+    if (deadline == 0) {
+      pthread_cond_wait(&q->idle, &q->lock);
+    } else if (condWaitUntil(&q->idle, &q->lock, deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  int drained = !q->busy && queueEmpty(q);
+  pthread_mutex_unlock(&q->lock);
+
+  return drained;
+}
+
+static int startQueue(blinker *bd) {
+  writebehind *q = &bd->queue;
+
+  pthread_mutex_lock(&q->lock);
+  if (!q->started) {
+    q->quit = 0;
+    if (pthread_create(&q->thread, NULL, writerMain, bd) != 0) {
+      pthread_mutex_unlock(&q->lock);
+      return -1;
+    }
+    q->started = 1;
+  }
+  atomic_store(&q->enabled, 1);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+/*
+ * Turns write-behind off. Anything still queued is transmitted before the
+ * writer thread exits.
+ */
+static void stopQueue(blinker *bd) {
+  writebehind *q = &bd->queue;
+
+  pthread_mutex_lock(&q->lock);
+  atomic_store(&q->enabled, 0);
+  int started = q->started;
+  q->quit = 1;
+  q->started = 0;
+  pthread_cond_broadcast(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+
+  if (started) {
+    pthread_join(q->thread, NULL);
+  }
+}
+
+/************************************************************************************
+ *
+ * Watchdog
+ *
+ ************************************************************************************/
+
+/*
+ * The firmware counts the serverdown timeout in 10 ms ticks, in 16 bits.
+ */
+#define WATCHDOG_MIN_MILLIS 10
+#define WATCHDOG_MAX_MILLIS 655350
+
+static void *watchdogMain(void *arg) {
+  blinker *bd = arg;
+  watchdog *w = &bd->watchdog;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->quit) {
+    if (!w->armed) {
+      pthread_cond_wait(&w->wake, &w->lock);
+      continue;
+    }
+
+    unsigned long generation = w->generation;
+    uint64_t deadline = nowNanos() + w->interval;
+    while (!w->quit && generation == w->generation && nowNanos() < deadline) {
+      condWaitUntil(&w->wake, &w->lock, deadline);
+    }
+    if (w->quit || generation != w->generation) {
+      continue;
+    }
+
+    if (atomic_exchange(&w->beat, 0)) {
+      blinker_serverdown(bd, 1, w->timeout, w->stay, w->startpos, w->endpos);
+      atomic_fetch_add(&w->tickles, 1);
+    } else {
+      atomic_fetch_add(&w->missed, 1);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+static void initWatchdog(watchdog *w) {
+  pthread_mutex_init(&w->lock, NULL);
+  initCond(&w->wake);
+  w->started = 0;
+  w->quit = 0;
+  w->armed = 0;
+  w->generation = 0;
+  atomic_init(&w->beat, 0);
+  atomic_init(&w->tickles, 0);
+  atomic_init(&w->missed, 0);
+}
+
+/*
+ * Arms the device's serverdown mode with the settings in <w> and starts
+ * tickling it. Returns the result of the transfer, or BLINK1_ERR if the
+ * watchdog thread could not be started.
+ */
+static int armWatchdog(blinker *bd, const watchdog *settings) {
+  watchdog *w = &bd->watchdog;
+
+  pthread_mutex_lock(&w->lock);
+  if (!w->started) {
+    w->quit = 0;
+    if (pthread_create(&w->thread, NULL, watchdogMain, bd) != 0) {
+      pthread_mutex_unlock(&w->lock);
+      return BLINK1_ERR;
+    }
+    w->started = 1;
+  }
+
+  int result = blinker_serverdown(bd, 1, settings->timeout, settings->stay, settings->startpos, settings->endpos);
+  if (result != BLINK1_ERR) {
+    w->timeout = settings->timeout;
+    w->interval = settings->interval;
+    w->stay = settings->stay;
+    w->startpos = settings->startpos;
+    w->endpos = settings->endpos;
+    w->armed = 1;
+    w->generation++;
+    atomic_store(&w->beat, 0);
+    pthread_cond_signal(&w->wake);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return result;
+}
+
+/*
+ * Turns serverdown mode off, if it is on. Returns the result of the transfer.
+ */
+static int disarmWatchdog(blinker *bd) {
+  watchdog *w = &bd->watchdog;
+  int result = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->armed) {
+    result = blinker_serverdown(bd, 0, 0, w->stay, w->startpos, w->endpos);
+    w->armed = (result == BLINK1_ERR);
+    w->generation++;
+    pthread_cond_signal(&w->wake);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return result;
+}
+
+/*
+ * Disarms the device and stops the watchdog thread.
+ */
+static void stopWatchdog(blinker *bd) {
+  watchdog *w = &bd->watchdog;
+
+  disarmWatchdog(bd);
+
+  pthread_mutex_lock(&w->lock);
+  int started = w->started;
+  w->quit = 1;
+  w->started = 0;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+
+  if (started) {
+    pthread_join(w->thread, NULL);
+  }
+}
+
+/************************************************************************************
+ *
+ * Color Adjustment
+ *
+ ************************************************************************************/
+
+#define max(x, y) ( ((x) < (y)) ? (y) : (x) )
+#define min(x, y) ( ((x) < (y)) ? (x) : (y) )
+
+/*
+ * Colors are asked for on a perceptual scale and corrected on their way to the
+ * device, so equal steps in the levels asked for look like equal steps in
+ * brightness. Dimming and brightening move the brightest channel an eighth of
+ * the range down or up and scale the other two with it, which keeps the hue.
+ * Black stays black.
+ */
+#define BRIGHTNESS_STEP 32
+
+static void scaleBrightness(uint8_t *r, uint8_t *g, uint8_t *b, int step) {
+  int hi = max(*r, max(*g, *b));
+  if (hi == 0) {
+    return;
+  }
+
+  int to = max(0, min(255, hi + step));
+  *r = (*r * to + hi / 2) / hi;
+  *g = (*g * to + hi / 2) / hi;
+  *b = (*b * to + hi / 2) / hi;
+}
+
+/*
+ * Reads the color dim and brighten start from. Anything still in the
+ * write-behind queue is sent first, so it is the color last asked for.
+ */
+static int commandedRGB(blinker *bd, uint8_t *r, uint8_t *g, uint8_t *b) {
+  uint16_t millis;
+
+  if (atomic_load(&bd->queue.enabled)) {
+    flushQueue(bd, 0);
+  }
+
+  return blinker_currentRGB(bd, &millis, r, g, b, 0, 0);
+}
+
+static int blinker_dim(blinker *bd) {
+  uint8_t r, g, b;
+
+  if (commandedRGB(bd, &r, &g, &b) == BLINK1_ERR) {
+    return BLINK1_ERR;
+  }
+
+  scaleBrightness(&r, &g, &b, -BRIGHTNESS_STEP);
+
+  return submitColor(bd, 1, 0, r, g, b, 0);
+}
+
+static int blinker_brighten(blinker *bd) {
+  uint8_t r, g, b;
+
+  if (commandedRGB(bd, &r, &g, &b) == BLINK1_ERR) {
+    return BLINK1_ERR;
+  }
+
+  scaleBrightness(&r, &g, &b, BRIGHTNESS_STEP);
+
+  return submitColor(bd, 1, 0, r, g, b, 0);
+}
+
+/************************************************************************************
+ *
+ * Compositor
+ *
+ ************************************************************************************/
+
+static rgb_t blendColor(rgb_t below, rgb_t above, blendmode mode) {
+  switch (mode) {
+  case BLEND_ADD:
+    return (rgb_t){ min(255, below.r + above.r), min(255, below.g + above.g), min(255, below.b + above.b) };
+  case BLEND_MULTIPLY:
+    return (rgb_t){ below.r * above.r / 255, below.g * above.g / 255, below.b * above.b / 255 };
+  case BLEND_MAX:
+    return (rgb_t){ max(below.r, above.r), max(below.g, above.g), max(below.b, above.b) };
+  default:
+    return above;
+  }
+}
+
+/*
+ * Whether layer <l> shows on LED index <i>. A timeline covers both LEDs.
+ */
+static int covers(const layer *l, int i) {
+  return l->frames != NULL || l->led == 0 || l->led == i + 1;
+}
+
+/*
+ * Computes the color of each LED: the topmost opaque layer covering it, or
+ * black if there is none or it is a timeline, with the blended color layers
+ * above it applied from the bottom up.
+ */
+static void composeColors(const compositor *c, rgb_t *out) {
+  for (int i = 0; i < LED_COUNT; i++) {
+    int base = 0;
+    while (base < c->nlayers) {
+      const layer *l = &c->layers[base];
+      if (covers(l, i) && (l->frames != NULL || l->blend == BLEND_REPLACE)) {
+        break;
+      }
+      base++;
+    }
+
+    rgb_t color = { 0, 0, 0 };
+    if (base < c->nlayers && c->layers[base].frames == NULL) {
+      color = c->layers[base].color;
+    }
+    for (int j = base - 1; j >= 0; j--) {
+      if (covers(&c->layers[j], i)) {
+        color = blendColor(color, c->layers[j].color, c->layers[j].blend);
+      }
+    }
+    out[i] = color;
+  }
+}
+
+/*
+ * Brings the device in line with the layers: plays the top layer if it is
+ * a timeline, otherwise fades each LED to its composed color, over the top
+ * layer's millis, unless it already shows it. With no layers at all the
+ * device is turned off. Returns the result of the last transfer that failed,
+ * or 0. Called with the compositor lock held.
+ */
+static int render(blinker *bd) {
+  compositor *c = &bd->layers;
+  const layer *top = (c->nlayers > 0) ? &c->layers[0] : NULL;
+
+  if (top != NULL && top->frames != NULL) {
+    if (c->shown == SHOWN_TIMELINE && c->shownTimeline == top->seq) {
+      return 0;
+    }
+
+    keyframe *frames = malloc(top->nframes * sizeof(keyframe));
+    if (frames == NULL) {
+      return BLINK1_ERR;
+    }
+    memcpy(frames, top->frames, top->nframes * sizeof(keyframe));
+    setStream(bd, NULL, 0, 0, 0, 0, 0);
+    if (setTimeline(bd, frames, top->nframes, top->count) != 0) {
+      return BLINK1_ERR;
+    }
+    c->shown = SHOWN_TIMELINE;
+    c->shownTimeline = top->seq;
+    return 0;
+  }
+
+  if (top == NULL && c->shown == SHOWN_NOTHING) {
+    return 0;
+  }
+  if (c->shown == SHOWN_TIMELINE) {
+    setTimeline(bd, NULL, 0, 0);
+  }
+
+  rgb_t want[LED_COUNT];
+  composeColors(c, want);
+  uint16_t millis = (top != NULL) ? top->millis : 0;
+  int force = (c->shown != SHOWN_COLORS);
+  int result = 0;
+
+  if (sameColor(want[0], want[1])) {
+    if (force || !sameColor(want[0], c->shownColors[0]) || !sameColor(want[1], c->shownColors[1])) {
+      result = blinker_fadeToRGBN(bd, millis, want[0].r, want[0].g, want[0].b, 0);
+      if (result != BLINK1_ERR) {
+        c->shownColors[0] = c->shownColors[1] = want[0];
+      }
+    }
+  } else {
+    for (int i = 0; i < LED_COUNT; i++) {
+      if (force || !sameColor(want[i], c->shownColors[i])) {
+        int r = blinker_fadeToRGBN(bd, millis, want[i].r, want[i].g, want[i].b, i + 1);
+        if (r == BLINK1_ERR) {
+          result = r;
+        } else {
+          c->shownColors[i] = want[i];
+        }
+      }
+    }
+  }
+
+  // after a failure, send everything again on the next change
+  if (result == BLINK1_ERR) {
+    c->shown = SHOWN_NOTHING;
+  } else {
+    c->shown = (top != NULL) ? SHOWN_COLORS : SHOWN_NOTHING;
+  }
+
+  return result;
+}
+
+static int findLayer(const compositor *c, const char *name) {
+  for (int i = 0; i < c->nlayers; i++) {
+    if (strcmp(c->layers[i].name, name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void removeLayer(compositor *c, int i) {
+  free(c->layers[i].name);
+  free(c->layers[i].frames);
+  memmove(&c->layers[i], &c->layers[i + 1], (c->nlayers - i - 1) * sizeof(layer));
+  c->nlayers--;
+}
+
+static void siftUp(expiry *heap, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap[parent].deadline <= heap[i].deadline) {
+      break;
+    }
+    expiry tmp = heap[parent];
+    heap[parent] = heap[i];
+    heap[i] = tmp;
+    i = parent;
+  }
+}
+
+static void siftDown(expiry *heap, int n, int i) {
+  for (;;) {
+    int least = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < n && heap[left].deadline < heap[least].deadline) {
+      least = left;
+    }
+    if (right < n && heap[right].deadline < heap[least].deadline) {
+      least = right;
+    }
+    if (least == i) {
+      break;
+    }
+    expiry tmp = heap[least];
+    heap[least] = heap[i];
+    heap[i] = tmp;
+    i = least;
+  }
+}
+
+static expiry popExpiry(compositor *c) {
+  expiry top = c->heap[0];
+  c->heap[0] = c->heap[--c->nheap];
+  siftDown(c->heap, c->nheap, 0);
+
+  return top;
+}
+
+/*
+ * Rebuilds the heap from the live layers, dropping the entries left behind
+ * by reposted and withdrawn ones, once they outnumber the live ones.
+ */
+static void pruneExpiries(compositor *c) {
+  if (c->nheap < 2 * c->nlayers + 16) {
+    return;
+  }
+
+  c->nheap = 0;
+  for (int i = 0; i < c->nlayers; i++) {
+    if (c->layers[i].expires != 0) {
+      c->heap[c->nheap++] = (expiry){ c->layers[i].expires, c->layers[i].seq };
+    }
+  }
+  for (int i = c->nheap / 2 - 1; i >= 0; i--) {
+    siftDown(c->heap, c->nheap, i);
+  }
+}
+
+/*
+ * Worker thread body: withdraws each layer when its TTL runs out and shows
+ * what is left.
+ */
+static void *compositorMain(void *arg) {
+  blinker *bd = arg;
+  compositor *c = &bd->layers;
+
+  pthread_mutex_lock(&c->lock);
+  while (!c->quit) {
+    if (c->nheap == 0) {
+      pthread_cond_wait(&c->wake, &c->lock);
+      continue;
+    }
+    if (nowNanos() < c->heap[0].deadline) {
+      condWaitUntil(&c->wake, &c->lock, c->heap[0].deadline);
+      continue;
+    }
+
+    unsigned long seq = popExpiry(c).seq;
+    for (int i = 0; i < c->nlayers; i++) {
+      if (c->layers[i].seq == seq) {
+        removeLayer(c, i);
+        render(bd);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+static void initCompositor(compositor *c) {
+  pthread_mutex_init(&c->lock, NULL);
+  initCond(&c->wake);
+  c->started = 0;
+  c->quit = 0;
+  c->layers = NULL;
+  c->nlayers = 0;
+  c->maxlayers = 0;
+  c->heap = NULL;
+  c->nheap = 0;
+  c->maxheap = 0;
+  c->seq = 0;
+  c->shown = SHOWN_NOTHING;
+  c->shownTimeline = 0;
+}
+
+/*
+ * Starts the thread that expires layers, if it isn't running. Returns 0, or
+ * -1 if it could not be started.
+ */
+static int startCompositor(blinker *bd) {
+  compositor *c = &bd->layers;
+
+  pthread_mutex_lock(&c->lock);
+  if (!c->started) {
+    c->quit = 0;
+    if (pthread_create(&c->thread, NULL, compositorMain, bd) != 0) {
+      pthread_mutex_unlock(&c->lock);
+      return -1;
+    }
+    c->started = 1;
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return 0;
+}
+
+/*
+ * Posts layer <l>, replacing any layer with the same name, and updates the
+ * device if that changes what it should show. Takes ownership of the name
+ * and frames in <l>, whose seq is assigned here. Returns the result of
+ * render, or BLINK1_ERR without posting if out of memory.
+ */
+static int postLayer(blinker *bd, layer *l) {
+  compositor *c = &bd->layers;
+
+  pthread_mutex_lock(&c->lock);
+  if (c->nlayers == c->maxlayers || (l->expires != 0 && c->nheap == c->maxheap)) {
+    int maxlayers = (c->nlayers == c->maxlayers) ? 2 * c->maxlayers + 4 : c->maxlayers;
+    int maxheap = (c->nheap == c->maxheap) ? 2 * c->maxheap + 4 : c->maxheap;
+    layer *layers = realloc(c->layers, maxlayers * sizeof(layer));
+    if (layers != NULL) {
+      c->layers = layers;
+      c->maxlayers = maxlayers;
+    }
+    expiry *heap = realloc(c->heap, maxheap * sizeof(expiry));
+    if (heap != NULL) {
+      c->heap = heap;
+      c->maxheap = maxheap;
+    }
+    if (layers == NULL || heap == NULL) {
+      pthread_mutex_unlock(&c->lock);
+      free(l->name);
+      free(l->frames);
+      return BLINK1_ERR;
+    }
+  }
+
+  int old = findLayer(c, l->name);
+  if (old >= 0) {
+    removeLayer(c, old);
+  }
+
+  l->seq = ++c->seq;
+  int i = 0;
+  while (i < c->nlayers && c->layers[i].priority > l->priority) {
+    i++;
+  }
+  memmove(&c->layers[i + 1], &c->layers[i], (c->nlayers - i) * sizeof(layer));
+  c->layers[i] = *l;
+  c->nlayers++;
+
+  if (l->expires != 0) {
+    c->heap[c->nheap++] = (expiry){ l->expires, l->seq };
+    siftUp(c->heap, c->nheap - 1);
+    if (c->heap[0].seq == l->seq) {
+      pthread_cond_signal(&c->wake);
+    }
+  }
+  pruneExpiries(c);
+
+  int result = render(bd);
+  pthread_mutex_unlock(&c->lock);
+
+  return result;
+}
+
+/*
+ * Withdraws the layer called <name> and updates the device if that changes
+ * what it should show. Returns 1 if the layer was withdrawn and 0 if there
+ * was none, or BLINK1_ERR if updating the device failed.
+ */
+static int withdrawLayer(blinker *bd, const char *name) {
+  compositor *c = &bd->layers;
+  int result = 0;
+
+  pthread_mutex_lock(&c->lock);
+  int i = findLayer(c, name);
+  if (i >= 0) {
+    removeLayer(c, i);
+    result = (render(bd) == BLINK1_ERR) ? BLINK1_ERR : 1;
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return result;
+}
+
+/*
+ * Stops the compositor's thread and drops every layer, leaving the device
+ * as it is.
+ */
+static void stopCompositor(blinker *bd) {
+  compositor *c = &bd->layers;
+
+  pthread_mutex_lock(&c->lock);
+  int started = c->started;
+  c->quit = 1;
+  c->started = 0;
+  pthread_cond_signal(&c->wake);
+  pthread_mutex_unlock(&c->lock);
+
+  if (started) {
+    pthread_join(c->thread, NULL);
+  }
+
+  while (c->nlayers > 0) {
+    removeLayer(c, c->nlayers - 1);
+  }
+  free(c->layers);
+  free(c->heap);
+  c->layers = NULL;
+  c->heap = NULL;
+  c->maxlayers = 0;
+  c->maxheap = 0;
+  c->nheap = 0;
+  c->shown = SHOWN_NOTHING;
+}
+
+/************************************************************************************
+ *
+ * Color Kernels
+ *
+ ************************************************************************************/
+
+/*
+ * Batch versions of the color conversions, working on packed arrays of
+ * 3 byte colors so palettes can be computed with one call from Lua.
+ */
+
+typedef enum colorspace {
+  SPACE_RGB,
+  SPACE_HSB,
+  SPACE_LINEAR
+} colorspace;
+
+/*
+ * The inverse of the blink1 library's hsbtorgb: hue, saturation and
+ * brightness in [0, 255], hue 0 being red.
+ */
+static void rgbToHsb(const uint8_t *rgb, uint8_t *hsb) {
+  int r = rgb[0], g = rgb[1], b = rgb[2];
+  int hi = max(r, max(g, b));
+  int lo = min(r, min(g, b));
+  int delta = hi - lo;
+  int hue = 0;
+
+  // hue in sixths of a turn, each 256 wide, as hsbtorgb has it
+  if (delta != 0) {
+    if (hi == r) {
+      hue = (g - b) * 256 / delta;
+    } else if (hi == g) {
+      hue = 512 + (b - r) * 256 / delta;
+    } else {
+      hue = 1024 + (r - g) * 256 / delta;
+    }
+    if (hue < 0) {
+      hue += 1536;
+    }
+  }
+
+  hsb[0] = (hue + 3) / 6 % 256;
+  hsb[1] = (hi == 0) ? 0 : (delta * 255 + hi / 2) / hi;
+  hsb[2] = hi;
+}
+
+static void convertColors(const uint8_t *in, uint8_t *out, size_t n, colorspace from, colorspace to) {
+  for (size_t i = 0; i < n; i++, in += 3, out += 3) {
+    uint8_t rgb[3];
+
+    switch (from) {
+    case SPACE_HSB: {
+      rgb_t c;
+      hsbtorgb(&c, (uint8_t *)in);
+      rgb[0] = c.r; rgb[1] = c.g; rgb[2] = c.b;
+      break;
+    }
+    case SPACE_LINEAR:
+      rgb[0] = gammaTable[in[0]]; rgb[1] = gammaTable[in[1]]; rgb[2] = gammaTable[in[2]];
+      break;
+    default:
+      rgb[0] = in[0]; rgb[1] = in[1]; rgb[2] = in[2];
+      break;
+    }
+
+    switch (to) {
+    case SPACE_HSB:
+      rgbToHsb(rgb, out);
+      break;
+    case SPACE_LINEAR:
+      out[0] = degammaTable[rgb[0]]; out[1] = degammaTable[rgb[1]]; out[2] = degammaTable[rgb[2]];
+      break;
+    default:
+      out[0] = rgb[0]; out[1] = rgb[1]; out[2] = rgb[2];
+      break;
+    }
+  }
+}
+
+/*
+ * Weighted average of two bytes, rounded, with weight <w> in [0, 255] for <b>.
+ * (x + 1 + (x >> 8)) >> 8 is x / 255 for every x that can occur here.
+ */
+static inline uint8_t mix(uint8_t a, uint8_t b, unsigned w) {
+  unsigned x = a * (255 - w) + b * w + 127;
+
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+/*
+ * out[i] = mix(a[i], b[i], w) for <len> bytes. The SSE2 loop computes
+ * exactly what mix does, 16 bytes at a time.
+ */
+static void blendBytes(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t len, unsigned w) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wa = _mm_set1_epi16(255 - w);
+  const __m128i wb = _mm_set1_epi16(w);
+  const __m128i bias = _mm_set1_epi16(128);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+    lo = _mm_add_epi16(lo, bias);
+    hi = _mm_add_epi16(hi, bias);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+
+  for (; i < len; i++) {
+    out[i] = mix(a[i], b[i], w);
+  }
+}
+
+/*
+ * Blends <n> colors, a color at a time. <b> holds <n> colors, or just one if
+ * <bstride> is 0; likewise <w> holds <n> weights, or one if <wstride> is 0.
+ */
+static void blendColors(const uint8_t *a, const uint8_t *b, size_t bstride, const uint8_t *w, size_t wstride,
+                        uint8_t *out, size_t n) {
+  for (size_t i = 0; i < n; i++, a += 3, b += bstride, w += wstride, out += 3) {
+    out[0] = mix(a[0], b[0], *w);
+    out[1] = mix(a[1], b[1], *w);
+    out[2] = mix(a[2], b[2], *w);
+  }
+}
+
+/*
+ * Fills <out> with <n> colors evenly spaced from <from> to <to>, inclusive.
+ */
+static void gradientColors(const uint8_t *from, const uint8_t *to, uint8_t *out, size_t n) {
+  for (size_t i = 0; i < n; i++, out += 3) {
+    // position along the gradient in 1/65536ths
+    uint64_t t = (n == 1) ? 0 : (uint64_t)i * 65536 / (n - 1);
+    for (int c = 0; c < 3; c++) {
+      int64_t span = (int64_t)to[c] - from[c];
+      out[c] = from[c] + (span * (int64_t)t + (span < 0 ? -32768 : 32768)) / 65536;
+    }
+  }
+}
+
+/************************************************************************************
+ *
+ * Keyframe Compression
+ *
+ ************************************************************************************/
+
+/*
+ * The device fades between colors by itself, so a dense run of frames can be
+ * replaced by the few fades that pass within a tolerance of every frame.
+ *
+ * Segments are fitted greedily, one LED at a time. A segment starts from the
+ * color the device holds at the end of the previous one, which is what it
+ * will actually fade from, and is extended a frame at a time while some
+ * slope keeps every frame it covers within the tolerance: each frame narrows
+ * the range of allowed slopes for each channel, so a segment is fitted in
+ * time proportional to its length. The segment ends on a whole color in the
+ * final range, the one nearest the last frame covered.
+ */
+
+#define MAX_FADE_MILLIS 65535
+
+typedef struct segment {
+  int start, end;
+  uint8_t from[3], to[3];
+} segment;
+
+// milliseconds from the first frame to frame <k>
+static uint32_t frameMillis(int k, double fps) {
+  return (uint32_t)llround(k * 1000.0 / fps);
+}
+
+/*
+ * Fits segments to the <n> colors at <colors>, <stride> bytes apart, within
+ * <tol> of each channel. Frames must be at most MAX_FADE_MILLIS apart, so
+ * each segment covers at least one. <out> must have room for <n> segments.
+ * Returns the number of segments; none if there is only one color.
+ */
+static int fitSegments(const uint8_t *colors, size_t stride, int n, double fps, double tol, segment *out) {
+  const double slack = 1e-9;
+  uint8_t at[3] = { colors[0], colors[1], colors[2] };
+  int count = 0;
+  int s = 0;
+
+  while (s < n - 1) {
+    double lo[3] = { -INFINITY, -INFINITY, -INFINITY };
+    double hi[3] = { INFINITY, INFINITY, INFINITY };
+    segment *seg = &out[count++];
+
+    seg->start = s;
+    memcpy(seg->from, at, 3);
+
+    for (int j = s + 1; j < n && frameMillis(j, fps) - frameMillis(s, fps) <= MAX_FADE_MILLIS; j++) {
+      const uint8_t *v = colors + j * stride;
+      double d = j - s;
+      double nlo[3], nhi[3];
+      uint8_t to[3];
+      int fits = 1;
+
+      for (int c = 0; c < 3 && fits; c++) {
+        nlo[c] = fmax(lo[c], (v[c] - tol - at[c]) / d);
+        nhi[c] = fmin(hi[c], (v[c] + tol - at[c]) / d);
+
+        // whole colors the segment can end on
+        double first = fmax(0.0, ceil(at[c] + nlo[c] * d - slack));
+        double last = fmin(255.0, floor(at[c] + nhi[c] * d + slack));
+        if (first > last) {
+          fits = 0;
+        } else {
+          to[c] = (uint8_t)fmin(last, fmax(first, v[c]));
+        }
+      }
+
+      // the first frame always fits: it can end on that frame's color
+      if (!fits) {
+        break;
+      }
+      memcpy(lo, nlo, sizeof(lo));
+      memcpy(hi, nhi, sizeof(hi));
+      memcpy(seg->to, to, 3);
+      seg->end = j;
+    }
+
+    memcpy(at, seg->to, 3);
+    s = seg->end;
+  }
+
+  return count;
+}
+
+/*
+ * Accumulates the error of the <nsegs> segments fitted to <colors>: the
+ * largest and the total difference of any channel in any frame from what the
+ * device shows while fading along the segments.
+ */
+static void measureFit(const uint8_t *colors, size_t stride, const segment *segs, int nsegs,
+                       double *maxError, double *totalError) {
+  for (int i = 0; i < nsegs; i++) {
+    const segment *seg = &segs[i];
+    double span = seg->end - seg->start;
+
+    // each segment's first frame is the previous one's last
+    for (int k = (i == 0) ? seg->start : seg->start + 1; k <= seg->end; k++) {
+      const uint8_t *v = colors + k * stride;
+      for (int c = 0; c < 3; c++) {
+        double shown = seg->from[c] + (seg->to[c] - seg->from[c]) * (k - seg->start) / span;
+        double error = fabs(shown - v[c]);
+        *maxError = fmax(*maxError, error);
+        *totalError += error;
+      }
+    }
+  }
+}
+
+typedef struct timedframe {
+  uint32_t at;
+  int seq;
+  keyframe k;
+} timedframe;
+
+static int compareTimed(const void *a, const void *b) {
+  const timedframe *x = a, *y = b;
+
+  if (x->at != y->at) {
+    return (x->at > y->at) - (x->at < y->at);
+  }
+  if (x->k.led != y->k.led) {
+    return x->k.led - y->k.led;
+  }
+  return x->seq - y->seq;
+}
+
+/*
+ * Turns the segments fitted for one LED into keyframes for <led>, appended at
+ * <out>: the first color is set, then each segment that changes the color is
+ * a fade; segments that hold a color need no keyframe. Returns the number of
+ * keyframes added.
+ */
+static int segmentsToFrames(const uint8_t *first, const segment *segs, int nsegs, uint8_t led, double fps,
+                            timedframe *out) {
+  int n = 0;
+
+  out[n++] = (timedframe){ 0, 0, { 0, first[0], first[1], first[2], led, 0 } };
+  for (int i = 0; i < nsegs; i++) {
+    const segment *seg = &segs[i];
+    if (memcmp(seg->from, seg->to, 3) == 0) {
+      continue;
+    }
+
+    uint32_t at = frameMillis(seg->start, fps);
+    uint16_t millis = frameMillis(seg->end, fps) - at;
+    out[n] = (timedframe){ at, n, { millis, seg->to[0], seg->to[1], seg->to[2], led, 0 } };
+    n++;
+  }
+
+  return n;
+}
+
+/*
+ * Orders the <n> keyframes at <frames> by start time and sets each one's wait
+ * to the time until the next starts, the last one's to the time left until
+ * <total>.
+ */
+static void scheduleFrames(timedframe *frames, int n, uint32_t total) {
+  qsort(frames, n, sizeof(timedframe), compareTimed);
+
+  for (int i = 0; i < n; i++) {
+    uint32_t next = (i + 1 < n) ? frames[i + 1].at : total;
+    frames[i].k.wait = (next > frames[i].at) ? next - frames[i].at : 0;
+  }
+}
+
+/************************************************************************************
+ *
+ * Pattern Compiler
+ *
+ ************************************************************************************/
+
+/*
+ * Many timelines can be played by the device itself, from its pattern RAM, so
+ * the host needn't stay awake to play them. A pattern line fades an LED (or
+ * both) to a color, and the next line starts when the fade ends. A keyframe
+ * therefore becomes a line that fades until the next keyframe starts. If the
+ * keyframe's fade is meant to be shorter than that, the line is followed by
+ * one that holds the color for the rest of the time. Times are rounded to the
+ * device's 10 ms ticks.
+ *
+ * If the lines repeat, only one repetition is kept and it is played more
+ * times. If the lines still don't fit, holds are folded back into the lines
+ * before them, stretching their fades. After that, lines are dropped, those
+ * whose colors differ least from what is shown before them first, and each
+ * dropped line's time goes to the line before it.
+ */
+
+#define PATTERN_TICK_MILLIS 10
+#define MAX_LINE_MILLIS 65530
+#define MAX_PLAY_COUNT 255
+
+typedef struct plannedline {
+  patternslot slot;
+  uint32_t want;
+  int hold;
+} plannedline;
+
+typedef struct patternplan {
+  plannedline *lines;
+  int n;
+  int count;
+  int folded;
+  int dropped;
+  rgb_t color[LED_COUNT];
+  uint32_t known;
+} patternplan;
+
+static uint32_t toTicks(uint32_t millis) {
+  return (millis + PATTERN_TICK_MILLIS / 2) / PATTERN_TICK_MILLIS * PATTERN_TICK_MILLIS;
+}
+
+/*
+ * The number of lines needed at most for <k>: one to fade and enough holds to
+ * cover its wait.
+ */
+static size_t linesFor(const keyframe *k) {
+  return 2 + k->wait / MAX_LINE_MILLIS;
+}
+
+static void addLine(patternplan *p, const keyframe *k, uint32_t millis, uint32_t want, int hold) {
+  // consecutive holds of the same color are one hold
+  if (hold && p->n > 0) {
+    plannedline *last = &p->lines[p->n - 1];
+    if (last->hold && last->slot.led == k->led && last->slot.r == k->r && last->slot.g == k->g &&
+        last->slot.b == k->b && last->slot.millis + millis <= MAX_LINE_MILLIS) {
+      last->slot.millis += millis;
+      return;
+    }
+  }
+
+  p->lines[p->n++] = (plannedline){ { millis, k->r, k->g, k->b, k->led }, want, hold };
+}
+
+// true if the LEDs <k> changes already show its color
+static int holdsColor(const patternplan *p, const keyframe *k) {
+  for (int i = 0; i < LED_COUNT; i++) {
+    if (k->led != 0 && ledIndex(k->led) != i) {
+      continue;
+    }
+    const rgb_t *c = &p->color[i];
+    if (!(p->known & (1u << i)) || c->r != k->r || c->g != k->g || c->b != k->b) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void addKeyframe(patternplan *p, const keyframe *k) {
+  uint32_t left = toTicks(k->wait);
+  if (left < PATTERN_TICK_MILLIS) {
+    left = PATTERN_TICK_MILLIS;
+  }
+
+  if (!holdsColor(p, k)) {
+    uint32_t fade = toTicks(k->millis);
+    fade = (fade < PATTERN_TICK_MILLIS) ? PATTERN_TICK_MILLIS : (fade > MAX_LINE_MILLIS) ? MAX_LINE_MILLIS : fade;
+    fade = (fade < left) ? fade : left;
+    addLine(p, k, fade, k->millis, 0);
+    left -= fade;
+  }
+
+  while (left > 0) {
+    uint32_t hold = (left < MAX_LINE_MILLIS) ? left : MAX_LINE_MILLIS;
+    addLine(p, k, hold, 0, 1);
+    left -= hold;
+  }
+
+  for (int i = 0; i < LED_COUNT; i++) {
+    if (k->led == 0 || ledIndex(k->led) == i) {
+      p->color[i] = (rgb_t){ k->r, k->g, k->b };
+      p->known |= (1u << i);
+    }
+  }
+}
+
+/*
+ * Keeps one repetition if the lines are a run of identical ones, as long as
+ * the play count can still be given to the device.
+ */
+static void foldRepeats(patternplan *p) {
+  for (int period = 1; period < p->n; period++) {
+    int times = p->n / period;
+    if (p->n % period != 0 || (p->count != 0 && p->count * times > MAX_PLAY_COUNT)) {
+      continue;
+    }
+
+    int i = period;
+    while (i < p->n && memcmp(&p->lines[i].slot, &p->lines[i - period].slot, sizeof(patternslot)) == 0) {
+      i++;
+    }
+    if (i == p->n) {
+      p->n = period;
+      p->count *= times;
+      p->folded = times;
+      return;
+    }
+  }
+}
+
+/*
+ * How far the color shown strays if line <i> is dropped: nothing for a hold,
+ * otherwise the largest difference in any channel from the color its LED
+ * shows instead.
+ */
+static int dropCost(const patternplan *p, int i) {
+  const patternslot *line = &p->lines[i].slot;
+
+  if (p->lines[i].hold) {
+    return 0;
+  }
+
+  for (int j = i - 1; j >= 0; j--) {
+    const patternslot *prev = &p->lines[j].slot;
+    if (prev->led == line->led || prev->led == 0) {
+      return max(abs(line->r - prev->r), max(abs(line->g - prev->g), abs(line->b - prev->b)));
+    }
+  }
+
+  return 255;
+}
+
+/*
+ * Merges the line that costs least to drop, the shortest of those that cost
+ * the same, into the line before it. Returns 0 if no line can be merged.
+ */
+static int mergeCheapest(patternplan *p) {
+  int best = -1, bestCost = 0;
+
+  for (int i = 1; i < p->n; i++) {
+    const patternslot *line = &p->lines[i].slot;
+    if (p->lines[i - 1].slot.millis + line->millis > MAX_LINE_MILLIS) {
+      continue;
+    }
+
+    int cost = dropCost(p, i);
+    if (best < 0 || cost < bestCost || (cost == bestCost && line->millis < p->lines[best].slot.millis)) {
+      best = i;
+      bestCost = cost;
+    }
+  }
+  if (best < 0) {
+    return 0;
+  }
+
+  p->lines[best - 1].slot.millis += p->lines[best].slot.millis;
+  if (!p->lines[best].hold) {
+    p->dropped++;
+  }
+  memmove(&p->lines[best], &p->lines[best + 1], (p->n - best - 1) * sizeof(plannedline));
+  p->n--;
+
+  return 1;
+}
+
+/*
+ * Compiles the <n> keyframes at <frames>, played <count> times, into at most
+ * <budget> lines. <p->lines> must have room for the lines needed by every
+ * keyframe. Returns 0, or -1 if the timeline can't be made to fit.
+ */
+static int compileTimeline(patternplan *p, const keyframe *frames, int n, int count, int budget) {
+  p->n = 0;
+  p->count = count;
+  p->folded = 1;
+  p->dropped = 0;
+  p->known = 0;
+
+  for (int i = 0; i < n; i++) {
+    addKeyframe(p, &frames[i]);
+  }
+
+  foldRepeats(p);
+  while (p->n > budget) {
+    if (!mergeCheapest(p)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Pushes a table describing how <p> was compiled.
+ */
+static void pushCompileReport(lua_State *L, const patternplan *p) {
+  int holds = 0;
+  uint32_t worst = 0;
+  uint64_t period = 0;
+
+  for (int i = 0; i < p->n; i++) {
+    const plannedline *line = &p->lines[i];
+    if (line->hold) {
+      holds++;
+    } else {
+      uint32_t error = (line->slot.millis > line->want) ? line->slot.millis - line->want : line->want - line->slot.millis;
+      worst = (error > worst) ? error : worst;
+    }
+    period += line->slot.millis;
+  }
+
+  lua_createtable(L, 0, 7);
+  setIntegerField(L, "lines", p->n);
+  setIntegerField(L, "count", p->count);
+  setIntegerField(L, "folded", p->folded);
+  setIntegerField(L, "holds", holds);
+  setIntegerField(L, "dropped", p->dropped);
+  setIntegerField(L, "max_timing_error", worst);
+  setIntegerField(L, "period", period);
+}
+
+/************************************************************************************
+ *
+ * Pattern Strings
+ *
+ ************************************************************************************/
+
+/*
+ * Pattern strings use the blink1-tool format: a repeat count followed by
+ * one "color,seconds,led" triple per pattern line, e.g.
+ * "3,#ff0000,0.5,0,#0000ff,0.5,0". Parsing one yields a compiled pattern,
+ * which is ready to upload as is.
+ */
+typedef struct compiledpattern {
+  int repeats;
+  int n;
+  patternslot slots[PATTERN_SLOTS];
+} compiledpattern;
+
+static const char *skipSpace(const char *p) {
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+
+  return p;
+}
+
+/*
+ * Parses the field at *p, which must be followed by a comma or the end of
+ * the string, and advances *p past the comma. Returns 0 if the field is
+ * malformed.
+ */
+static int parseIntField(const char **p, long lo, long hi, long *value) {
+  char *end;
+  const char *q = skipSpace(*p);
+
+  long v = strtol(q, &end, 10);
+  if (end == q || v < lo || v > hi) {
+    return 0;
+  }
+
+  q = skipSpace(end);
+  if (*q != ',' && *q != '\0') {
+    return 0;
+  }
+  *p = (*q == ',') ? q + 1 : q;
+  *value = v;
+
+  return 1;
+}
+
+static int parseColorField(const char **p, patternslot *slot) {
+  char *end;
+  const char *q = skipSpace(*p);
+
+  if (*q == '#') {
+    q++;
+  }
+  for (int i = 0; i < 6; i++) {
+    if (!isxdigit((unsigned char)q[i])) {
+      return 0;
+    }
+  }
+  unsigned long rgb = strtoul(q, &end, 16);
+  if (end - q != 6) {
+    return 0;
+  }
+
+  q = skipSpace(end);
+  if (*q != ',') {
+    return 0;
+  }
+  *p = q + 1;
+  slot->r = (rgb >> 16) & 0xff;
+  slot->g = (rgb >> 8) & 0xff;
+  slot->b = rgb & 0xff;
+
+  return 1;
+}
+
+static int parseSecondsField(const char **p, patternslot *slot) {
+  char *end;
+  const char *q = skipSpace(*p);
+
+  double seconds = strtod(q, &end);
+  if (end == q || !(seconds >= 0.0 && seconds <= 65.535)) {
+    return 0;
+  }
+
+  q = skipSpace(end);
+  if (*q != ',') {
+    return 0;
+  }
+  *p = q + 1;
+  slot->millis = (uint16_t)lround(seconds * 1000.0);
+
+  return 1;
+}
+
+/*
+ * Parses <str> into <cp>. Returns NULL on success, or a description of the
+ * problem, with *line set to the pattern line it was found in (-1 for the
+ * repeat count).
+ */
+static const char *parsePatternString(const char *str, compiledpattern *cp, int *line) {
+  const char *p = str;
+  long value;
+
+  *line = -1;
+  if (!parseIntField(&p, 0, 255, &value)) {
+    return "repeat count must be an integer in range [0, 255]";
+  }
+  cp->repeats = value;
+  cp->n = 0;
+
+  while (*skipSpace(p) != '\0') {
+    *line = cp->n;
+    if (cp->n == PATTERN_SLOTS) {
+      return "pattern must have at most 32 lines";
+    }
+
+    patternslot *slot = &cp->slots[cp->n];
+    if (!parseColorField(&p, slot)) {
+      return "color must be 6 hex digits, optionally preceded by #";
+    }
+    if (!parseSecondsField(&p, slot)) {
+      return "time must be a number of seconds in range [0, 65.535]";
+    }
+    if (!parseIntField(&p, 0, LED_COUNT, &value)) {
+      return "led must be 0, 1 or 2";
+    }
+    slot->led = value;
+    cp->n++;
+  }
+
+  return NULL;
+}
+
+/************************************************************************************
+ *
+ * Commands
+ *
+ ************************************************************************************/
+
+/*
+ * Device operations that can be run away from the Lua thread: fanned out to
+ * the members of a group, or queued on a device's I/O thread.
+ */
+typedef enum cmdop {
+  OP_SET,
+  OP_FADE,
+  OP_DIM,
+  OP_BRIGHTEN,
+  OP_GET,
+  OP_PLAY,
+  OP_STOP,
+  OP_SETPATTPOS,
+  OP_WRITEPATTERN,
+  OP_READPATTERN,
+  OP_SAVEPATTERN
+} cmdop;
+
+/*
+ * Arguments of an operation, checked on the Lua thread before it is run.
+ */
+typedef struct command {
+  cmdop op;
+  const char *errmsg;
+  uint16_t millis;
+  uint8_t r, g, b;
+  uint8_t n;
+  int refresh;
+  uint8_t count, startpos, endpos, pos;
+  int force;
+  int packed;
+  int diff;
+  int nslots;
+  int fill;  // write blank lines after slots, up to the device's pattern size
+  patternslot slots[PATTERN_SLOTS];
+} command;
+
+/*
+ * One device's share of an operation and its outcome.
+ */
+typedef struct task {
+  blinker *bd;
+  const command *cmd;
+  int result;
+  uint16_t millis;
+  uint8_t r, g, b;
+  int sent;
+  uint32_t failed;
+  uint32_t differs;
+  int nslots;
+  patternslot slots[PATTERN_SLOTS];
+} task;
+
+/*
+ * Sets a bit in t->differs for each line read that doesn't match the line
+ * expected, once that is corrected as it would have been written.
+ */
+static void diffPattern(task *t) {
+  patternslot expected[PATTERN_SLOTS];
+
+  memcpy(expected, t->cmd->slots, t->nslots * sizeof(patternslot));
+  blinker_correctPattern(t->bd, expected, t->nslots);
+
+  t->differs = 0;
+  for (int pos = 0; pos < t->nslots; pos++) {
+    const patternslot *have = &t->slots[pos];
+    const patternslot *want = &expected[pos];
+
+    if (have->millis != want->millis || have->r != want->r || have->g != want->g ||
+        have->b != want->b || have->led != want->led) {
+      t->differs |= (1u << pos);
+    }
+  }
+}
+
+static void runTask(task *t) {
+  const command *c = t->cmd;
+  blinker *bd = t->bd;
+
+  switch (c->op) {
+  case OP_SET:
+    t->result = submitColor(bd, 1, 0, c->r, c->g, c->b, 0);
+    break;
+  case OP_FADE:
+    t->result = submitColor(bd, 0, c->millis, c->r, c->g, c->b, c->n);
+    break;
+  case OP_DIM:
+    t->result = blinker_dim(bd);
+    break;
+  case OP_BRIGHTEN:
+    t->result = blinker_brighten(bd);
+    break;
+  case OP_GET:
+    t->result = blinker_currentRGB(bd, &t->millis, &t->r, &t->g, &t->b, c->n, c->refresh);
+    break;
+  case OP_PLAY:
+    t->result = blinker_playloop(bd, PATTERNPLAY_START, c->startpos, c->endpos, c->count);
+    break;
+  case OP_STOP:
+    t->result = blinker_playloop(bd, PATTERNPLAY_STOP, 0, 0, 0);
+    break;
+  case OP_SETPATTPOS:
+    t->result = blinker_writePatternLine(bd, &(patternslot){ c->millis, c->r, c->g, c->b, 0 }, c->pos);
+    break;
+  case OP_WRITEPATTERN:
+    t->sent = blinker_uploadPattern(bd, c->slots, 0, c->fill ? bd->patternSlots : c->nslots, c->force, &t->failed);
+    t->result = (t->failed != 0) ? BLINK1_ERR : 0;
+    break;
+  case OP_READPATTERN:
+    // when diffing, failed lines are part of the result rather than an error
+    t->nslots = c->diff ? c->nslots : bd->patternSlots;
+    blinker_readPattern(bd, t->slots, t->nslots, &t->failed);
+    t->result = (t->failed != 0 && !c->diff) ? BLINK1_ERR : 0;
+    if (c->diff) {
+      diffPattern(t);
+    }
+    break;
+  case OP_SAVEPATTERN:
+    t->result = blinker_savePattern(bd);
+    break;
+  }
+}
+
+/************************************************************************************
+ *
+ * Asynchronous Requests
+ *
+ ************************************************************************************/
+
+/*
+ * A queued operation. It is shared by the I/O thread and the Lua object
+ * returned to the caller, and freed when both have let go of it. <done>
+ * and <watched> are protected by <lock>; the task is only read once <done>
+ * is set. A watched request is posted as an event when it finishes.
+ */
+typedef struct request {
+  command cmd;
+  task t;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int done;
+  int watched;
+  atomic_int refs;
+  struct request *next;
+} request;
+
+static request *newRequest(void) {
+  request *req = calloc(1, sizeof(request));
+  if (req == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&req->lock, NULL);
+  initCond(&req->finished);
+  atomic_init(&req->refs, 2);
+  req->t.cmd = &req->cmd;
+  req->t.result = BLINK1_ERR;
+
+  return req;
+}
+
+static void releaseRequest(request *req) {
+  if (atomic_fetch_sub(&req->refs, 1) == 1) {
+    pthread_mutex_destroy(&req->lock);
+    pthread_cond_destroy(&req->finished);
+    free(req);
+  }
+}
+
+static void finishRequest(request *req) {
+  pthread_mutex_lock(&req->lock);
+  req->done = 1;
+  pthread_cond_broadcast(&req->finished);
+  if (req->watched) {
+    postEvent(req->t.bd->events, EVENT_REQUEST, req);
+  }
+  pthread_mutex_unlock(&req->lock);
+  releaseRequest(req);
+}
+
+/*
+ * Waits until <req> is finished or until <deadline> (0 = no deadline).
+ * Returns true if it finished.
+ */
+static int waitRequest(request *req, uint64_t deadline) {
+  pthread_mutex_lock(&req->lock);
+  while (!req->done) {
+    if (deadline == 0) {
+      pthread_cond_wait(&req->finished, &req->lock);
+    } else if (condWaitUntil(&req->finished, &req->lock, deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  int done = req->done;
+  pthread_mutex_unlock(&req->lock);
+
+  return done;
+}
+
+static void *ioMain(void *arg) {
+  blinker *bd = arg;
+  ioqueue *q = &bd->requests;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    request *req = q->head;
+    if (req == NULL) {
+      if (q->quit) {
+        break;
+      }
+      pthread_cond_wait(&q->wake, &q->lock);
+      continue;
+    }
+
+    q->head = req->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    runTask(&req->t);
+    finishRequest(req);
+
+    pthread_mutex_lock(&q->lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+static void initIoQueue(ioqueue *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  q->started = 0;
+  q->quit = 0;
+  q->closed = 0;
+  q->head = NULL;
+  q->tail = NULL;
+}
+
+/*
+ * Appends <req> to the device's queue. Returns 0, or -1 if the device is
+ * closed or the I/O thread could not be started.
+ */
+static int submitRequest(blinker *bd, request *req) {
+  ioqueue *q = &bd->requests;
+
+  req->t.bd = bd;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->closed) {
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+  if (!q->started) {
+    q->quit = 0;
+    if (pthread_create(&q->thread, NULL, ioMain, bd) != 0) {
+      pthread_mutex_unlock(&q->lock);
+      return -1;
+    }
+    q->started = 1;
+  }
+
+  req->next = NULL;
+  if (q->tail == NULL) {
+    q->head = req;
+  } else {
+    q->tail->next = req;
+  }
+  q->tail = req;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+/*
+ * Runs whatever is still queued, then stops the I/O thread for good.
+ */
+static void stopIoQueue(blinker *bd) {
+  ioqueue *q = &bd->requests;
+
+  pthread_mutex_lock(&q->lock);
+  int started = q->started;
+  q->quit = 1;
+  q->closed = 1;
+  q->started = 0;
+  pthread_cond_broadcast(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+
+  if (started) {
+    pthread_join(q->thread, NULL);
+  }
+}
+
+/************************************************************************************
+ *
+ * Thread Pool
+ *
+ ************************************************************************************/
+
+/*
+ * A small pool of worker threads, shared by all groups of a Lua state, that
+ * runs one batch of tasks at a time. Threads are created on demand, up to
+ * POOL_THREADS, and the dispatching thread works through the batch as well.
+ */
+typedef struct workpool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_t threads[POOL_THREADS];
+  int nthreads;
+  int quit;
+  task *tasks;
+  int ntasks;
+  int next;
+  int remaining;
+} workpool;
+
+static void *poolMain(void *arg) {
+  workpool *p = arg;
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->quit) {
+    if (p->next >= p->ntasks) {
+      pthread_cond_wait(&p->work, &p->lock);
+      continue;
+    }
+
+    task *t = &p->tasks[p->next++];
+    pthread_mutex_unlock(&p->lock);
+    runTask(t);
+    pthread_mutex_lock(&p->lock);
+
+    if (--p->remaining == 0) {
+      pthread_cond_signal(&p->done);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static void initPool(workpool *p) {
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->nthreads = 0;
+  p->quit = 0;
+  p->tasks = NULL;
+  p->ntasks = 0;
+  p->next = 0;
+  p->remaining = 0;
+}
+
+/*
+ * Runs <n> tasks concurrently and returns once all of them are finished.
+ */
+static void runTasks(workpool *p, task *tasks, int n) {
+  pthread_mutex_lock(&p->lock);
+  int wanted = min(n - 1, POOL_THREADS);
+  while (p->nthreads < wanted) {
+    if (pthread_create(&p->threads[p->nthreads], NULL, poolMain, p) != 0) {
+      break;
+    }
+    p->nthreads++;
+  }
+
+  p->tasks = tasks;
+  p->ntasks = n;
+  p->next = 0;
+  p->remaining = n;
+  pthread_cond_broadcast(&p->work);
+
+  while (p->next < p->ntasks) {
+    task *t = &p->tasks[p->next++];
+    pthread_mutex_unlock(&p->lock);
+    runTask(t);
+    pthread_mutex_lock(&p->lock);
+    p->remaining--;
+  }
+  while (p->remaining > 0) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+
+  p->tasks = NULL;
+  p->ntasks = 0;
+  p->next = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void stopPool(workpool *p) {
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 0; i < p->nthreads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  p->nthreads = 0;
+}
+
+/************************************************************************************
+ *
+ * Device Registry
+ *
+ ************************************************************************************/
+
+/*
+ * Enumerating rescans the USB bus, so the result is kept here and only refreshed
+ * after a watcher thread reports that a blink(1) may have come or gone. On Linux
+ * the watcher listens to kernel uevents; elsewhere (or if the netlink socket
+ * can't be opened) it re-enumerates every HOTPLUG_POLL_MS milliseconds.
+ * A uevent can arrive before udev has finished setting the device up, so
+ * after each one the watcher rescans a few more times, backing off from
+ * HOTPLUG_SETTLE_MS milliseconds.
+ *
+ * The registry is shared by every Lua state in the process. <lock> also
+ * serializes use of the blink1 library's own enumeration cache, which
+ * blink1_openById and blink1_openBySerial depend on. <generation> changes
+ * whenever the set of attached devices does. <count> is at most MAX_DEVICES;
+ * <found> is the number the last scan found. <notifiers> lists each state's
+ * notifier, to be signalled when it may have. <stopping> is set while the
+ * last user joins the watcher thread and closes its pipe, outside the lock;
+ * a new watcher can't be started until that is done.
+ */
+typedef struct registry {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int enumerated;
+  atomic_int dirty;
+  int count;
+  int found;
+  char serials[MAX_DEVICES][SERIAL_LEN + 1];
+  int types[MAX_DEVICES];
+  unsigned long generation;
+  pthread_t thread;
+  int users;
+  int started;
+  int stopping;
+  int quit;
+  int wakefd[2];
+  notifier *notifiers;
+} registry;
+
+static registry attached = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wakefd = {-1, -1}
+};
+
+static pthread_once_t registryOnce = PTHREAD_ONCE_INIT;
+
+static void initRegistry(void) {
+  initCond(&attached.wake);
+}
+
+/*
+ * Tells every state the set of attached devices may have changed. Called
+ * with the lock held.
+ */
+static void registryNotify(void) {
+  for (notifier *n = attached.notifiers; n != NULL; n = n->next) {
+    atomic_store(&n->hotplug, 1);
+    signalNotifier(n);
+  }
+}
+
+/*
+ * Rescans the bus and records what was found. Called with the lock held.
+ */
+static void registryEnumerate(void) {
+  char serials[MAX_DEVICES][SERIAL_LEN + 1];
+  int found = blink1_enumerate();
+  int count = min(found, MAX_DEVICES);
+  int changed = !attached.enumerated || count != attached.count;
+
+  for (int i = 0; i < count; i++) {
+    const char *serial = blink1_getCachedSerial(i);
+    snprintf(serials[i], sizeof(serials[i]), "%s", (serial != NULL) ? serial : "");
+    attached.types[i] = blink1_deviceTypeById(i);
+    changed = changed || strcmp(serials[i], attached.serials[i]) != 0;
+  }
+
+  memcpy(attached.serials, serials, sizeof(serials));
+  attached.count = count;
+  attached.found = max(found, 0);
+  attached.enumerated = 1;
+  if (changed) {
+    attached.generation++;
+    registryNotify();
+  }
+}
+
+#if defined(__linux__)
+/*
+ * Returns true if the uevent in <buf> is about a blink(1) or a hidraw node.
+ */
+static int isBlinkEvent(const char *buf, ssize_t len) {
+  char product[32];
+  snprintf(product, sizeof(product), "PRODUCT=%x/%x/", blink1_vid(), blink1_pid());
+
+  for (const char *field = buf; field < buf + len; field += strlen(field) + 1) {
+    if (strncmp(field, product, strlen(product)) == 0 || strcmp(field, "SUBSYSTEM=hidraw") == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int openUevents(void) {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+#else
+static int openUevents(void) {
+  return -1;
+}
+#endif
+
+static void *watcherMain(void *arg) {
+  (void)arg;
+  int fd = openUevents();
+
+  if (fd < 0) {
+    pthread_mutex_lock(&attached.lock);
+    while (!attached.quit) {
+      condWaitUntil(&attached.wake, &attached.lock, nowNanos() + HOTPLUG_POLL_MS * NSEC_PER_MSEC);
+      if (!attached.quit) {
+        registryEnumerate();
+      }
+    }
+    pthread_mutex_unlock(&attached.lock);
+
+    return NULL;
+  }
+
+#if defined(__linux__)
+  struct pollfd fds[2] = {
+    { .fd = fd, .events = POLLIN },
+    { .fd = attached.wakefd[0], .events = POLLIN }
+  };
+  char buf[4096];
+  int settle = 0;
+  int delay = HOTPLUG_SETTLE_MS;
+
+  for (;;) {
+    int ready = poll(fds, 2, (settle > 0) ? delay : -1);
+    if (ready < 0) {
+      if (errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    if (ready == 0) {
+      // still settling after a uevent: rescan, which notifies on a change
+      pthread_mutex_lock(&attached.lock);
+      registryEnumerate();
+      pthread_mutex_unlock(&attached.lock);
+      settle--;
+      delay *= 2;
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+      if (len > 0) {
+        buf[len] = '\0';
+        if (isBlinkEvent(buf, len)) {
+          atomic_store(&attached.dirty, 1);
+          pthread_mutex_lock(&attached.lock);
+          registryNotify();
+          pthread_mutex_unlock(&attached.lock);
+          settle = HOTPLUG_SETTLE_TRIES;
+          delay = HOTPLUG_SETTLE_MS;
+        }
+      }
+    }
+  }
+#endif
+  close(fd);
+
+  return NULL;
+}
+
+/*
+ * Makes sure the registry is current. Called with the lock held. The first
+ * call also starts the watcher thread, after waiting for a previous one to
+ * finish stopping; if that fails, every call rescans.
+ */
+static void registryRefresh(void) {
+  while (attached.stopping) {
+    pthread_cond_wait(&attached.wake, &attached.lock);
+  }
+
+  if (!attached.started && attached.users > 0) {
+    attached.quit = 0;
+    if (pipe(attached.wakefd) == 0) {
+      attached.started = (pthread_create(&attached.thread, NULL, watcherMain, NULL) == 0);
+      if (!attached.started) {
+        close(attached.wakefd[0]);
+        close(attached.wakefd[1]);
+      }
+    }
+  }
+
+  if (!attached.enumerated || !attached.started || atomic_exchange(&attached.dirty, 0)) {
+    registryEnumerate();
+  }
+}
+
+/*
+ * Returns the registry index of <serial>, or -1. Called with the lock held.
+ */
+static int registryFind(const char *serial) {
+  for (int i = 0; i < attached.count; i++) {
+    if (strcasecmp(attached.serials[i], serial) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Opens the device with registry index <devid>, or with <serial> if devid is -1.
+ * If the registry turns out to be stale, it is refreshed and the open retried.
+ */
+static blink1_device *registryOpen(int devid, const char *serial) {
+  blink1_device *device = NULL;
+
+  pthread_mutex_lock(&attached.lock);
+  for (int attempt = 0; attempt < 2 && device == NULL; attempt++) {
+    if (attempt > 0) {
+      atomic_store(&attached.dirty, 1);
+    }
+    registryRefresh();
+
+    int index = (devid > -1) ? devid : registryFind(serial);
+    if (index > -1 && index < attached.count) {
+      device = blink1_openById(index);
+    }
+  }
+  pthread_mutex_unlock(&attached.lock);
+
+  return device;
+}
+
+/*
+ * Every Lua state that loads the library holds a reference to the registry
+ * through its hotplug object, along with the state's notifier, if it has
+ * one; the watcher thread stops with the last one, before the library can
+ * be unloaded.
+ */
+static void registryRetain(notifier *n) {
+  pthread_once(&registryOnce, initRegistry);
+  pthread_mutex_lock(&attached.lock);
+  attached.users++;
+  if (n != NULL) {
+    n->next = attached.notifiers;
+    attached.notifiers = n;
+  }
+  pthread_mutex_unlock(&attached.lock);
+}
+
+static void registryRelease(notifier *n) {
+  pthread_mutex_lock(&attached.lock);
+  for (notifier **link = &attached.notifiers; *link != NULL; link = &(*link)->next) {
+    if (*link == n) {
+      *link = n->next;
+      break;
+    }
+  }
+  int stop = (--attached.users == 0) && attached.started;
+  if (stop) {
+    attached.quit = 1;
+    attached.started = 0;
+    attached.stopping = 1;
+    pthread_cond_broadcast(&attached.wake);
+    ssize_t ignored = write(attached.wakefd[1], "", 1);
+    (void)ignored;
+  }
+  pthread_mutex_unlock(&attached.lock);
+
+  if (stop) {
+    pthread_join(attached.thread, NULL);
+
+    pthread_mutex_lock(&attached.lock);
+    close(attached.wakefd[0]);
+    close(attached.wakefd[1]);
+    attached.wakefd[0] = attached.wakefd[1] = -1;
+    attached.enumerated = 0;
+    attached.stopping = 0;
+    pthread_cond_broadcast(&attached.wake);
+    pthread_mutex_unlock(&attached.lock);
+  }
+}
+
+/************************************************************************************
+ *
+ * Reconnection
+ *
+ ************************************************************************************/
+
+/*
+ * A single failed transfer is usually a glitch, so a device only counts as
+ * lost after RECONNECT_FAILURES failures in a row. Until it is reopened,
+ * calls fail at once: the blink1 library rejects a NULL device. Attempts to
+ * reopen it start RECONNECT_MIN_MS apart and back off to RECONNECT_MAX_MS.
+ */
+
+#define RECONNECT_FAILURES 3
+#define RECONNECT_MIN_MS 50
+#define RECONNECT_MAX_MS 5000
+
+/*
+ * Sends the reopened device what it held before it was lost: the pattern
+ * lines known to have been in its RAM, then the pattern playing or the last
+ * colors commanded. Called with the io lock held.
+ */
+static void replayState(blinker *bd) {
+  reconnector *rc = &bd->reconnect;
+  uint32_t known = bd->patternKnown;
+
+  bd->patternKnown = 0;
+  bd->patternLed = -1;
+  bd->ledsKnown = 0;
+
+  for (int pos = 0; pos < bd->patternSlots && bd->device != NULL; pos++) {
+    if (known & (1u << pos)) {
+      patternslot slot = bd->pattern[pos];
+      writePatternSlot(bd, &slot, pos);
+    }
+  }
+
+  if (bd->device != NULL && rc->playing) {
+    uint64_t start = nowNanos();
+    recordTransfer(bd, HID_PLAYLOOP, start, blink1_playloop(bd->device, 1, rc->play[0], rc->play[1], rc->play[2]));
+    return;
+  }
+
+  for (int i = 0; i < LED_COUNT && bd->device != NULL; i++) {
+    if (rc->colorsKnown & (1u << i)) {
+      rgb_t c = rc->colors[i];
+      uint8_t r = c.r, g = c.g, b = c.b;
+      correctRGB(bd, &r, &g, &b);
+      uint64_t start = nowNanos();
+      int result = recordTransfer(bd, HID_FADE, start, blink1_fadeToRGBN(bd->device, 0, r, g, b, i + 1));
+      shadowColor(bd, result, 0, c, (rgb_t){ r, g, b }, i + 1);
+    }
+  }
+}
+
+static void *reconnectorMain(void *arg) {
+  blinker *bd = arg;
+  reconnector *rc = &bd->reconnect;
+  uint64_t delay = RECONNECT_MIN_MS * NSEC_PER_MSEC;
+
+  pthread_mutex_lock(&bd->io);
+  while (!rc->quit) {
+    if (bd->device != NULL) {
+      delay = RECONNECT_MIN_MS * NSEC_PER_MSEC;
+      pthread_cond_wait(&rc->wake, &bd->io);
+      continue;
+    }
+
+    // opening may rescan the bus, which is too slow to do holding the lock
+    pthread_mutex_unlock(&bd->io);
+    blink1_device *device = registryOpen(-1, bd->link.serial);
+    pthread_mutex_lock(&bd->io);
+
+    if (device != NULL && rc->quit) {
+      blink1_close(device);
+    } else if (device != NULL) {
+      bd->device = device;
+      rc->reconnects++;
+      replayState(bd);
+    } else {
+      condWaitUntil(&rc->wake, &bd->io, nowNanos() + delay);
+      delay = min(delay * 2, RECONNECT_MAX_MS * NSEC_PER_MSEC);
+    }
+  }
+  pthread_mutex_unlock(&bd->io);
+
+  return NULL;
+}
+
+static void initReconnector(reconnector *rc) {
+  initCond(&rc->wake);
+  rc->started = 0;
+  rc->quit = 0;
+  rc->failures = 0;
+  rc->reconnects = 0;
+  rc->colorsKnown = 0;
+  rc->playing = 0;
+}
+
+/*
+ * Counts a transfer towards the device being lost and, once it is, closes
+ * the handle and wakes (or starts) the reconnect thread. Called with the io
+ * lock held.
+ */
+static void checkTransport(blinker *bd, int result) {
+  reconnector *rc = &bd->reconnect;
+
+  if (bd->link.remote || bd->device == NULL) {
+    return;
+  }
+  if (result != BLINK1_ERR) {
+    rc->failures = 0;
+    return;
+  }
+  if (++rc->failures < RECONNECT_FAILURES || rc->quit || bd->link.serial[0] == '\0') {
+    return;
+  }
+
+  rc->failures = 0;
+  blink1_close(bd->device);
+  bd->device = NULL;
+  bd->ledsKnown = 0;
+
+  if (rc->started) {
+    pthread_cond_signal(&rc->wake);
+  } else {
+    rc->started = (pthread_create(&rc->thread, NULL, reconnectorMain, bd) == 0);
+  }
+}
+
+static void stopReconnector(blinker *bd) {
+  reconnector *rc = &bd->reconnect;
+
+  pthread_mutex_lock(&bd->io);
+  int started = rc->started;
+  rc->quit = 1;
+  rc->started = 0;
+  pthread_cond_signal(&rc->wake);
+  pthread_mutex_unlock(&bd->io);
+
+  if (started) {
+    pthread_join(rc->thread, NULL);
+  }
+}
+
+/*
+ * Records what is known of a freshly opened device.
+ */
+static void identifyDevice(blinker *bd) {
+  const char *serial = blink1_getSerialForDev(bd->device);
+
+  snprintf(bd->link.serial, sizeof(bd->link.serial), "%s", (serial != NULL) ? serial : "");
+  bd->link.type = blink1_deviceType(bd->device);
+  bd->link.mk2 = blink1_isMk2(bd->device);
+  bd->patternSlots = (bd->link.type == BLINK1_MK1) ? MK1_PATTERN_SLOTS : PATTERN_SLOTS;
+}
+
+/************************************************************************************
+ *
+ * Blinkers
+ *
+ ************************************************************************************/
+
+/*
+ * Sets up a blinker with no device yet.
+ */
+static void initBlinker(blinker *b) {
+  b->device = NULL;
+  b->events = NULL;
+  b->link.remote = 0;
+  b->link.fd = -1;
+  b->link.serial[0] = '\0';
+  initReconnector(&b->reconnect);
+  b->dedup.enabled = 0;
+  b->dedup.maxAge = 0;
+  pthread_mutex_init(&b->io, NULL);
+  b->color.calibrated = 0;
+  initAnimator(&b->anim);
+  initStreamer(&b->stream);
+  b->patternSlots = PATTERN_SLOTS;
+  b->firmware = 0;
+  b->patternKnown = 0;
+  b->patternLed = 0;
+  b->patternRepeats = 0;
+  b->ledsKnown = 0;
+  initQueue(&b->queue);
+  initWatchdog(&b->watchdog);
+  initCompositor(&b->layers);
+  initIoQueue(&b->requests);
+  resetCounters(b->stats);
+}
+
+/*
+ * Stops a blinker's threads, then turns its device off, points pattern
+ * writes back at LED 0 and closes it. A blinker connected to a daemon just hangs up, leaving the device as it is
+ * for the daemon's other clients.
+ */
+static void closeBlinker(blinker *bd) {
+  stopCompositor(bd);
+  stopAnimator(bd);
+  stopStreamer(bd);
+  stopIoQueue(bd);
+  stopQueue(bd);
+  stopWatchdog(bd);
+  stopReconnector(bd);
+
+  pthread_mutex_lock(&bd->io);
+  if (bd->link.remote) {
+    if (bd->link.fd >= 0) {
+      close(bd->link.fd);
+      bd->link.fd = -1;
+    }
+  } else if (bd->device != NULL) {
+    uint64_t start = nowNanos();
+    recordTransfer(bd, HID_SET, start, blink1_setRGB(bd->device, 0, 0, 0));
+    if (bd->patternLed != 0) {
+      start = nowNanos();
+      recordTransfer(bd, HID_SETLEDN, start, blink1_setLEDN(bd->device, 0));
+    }
+    blink1_close(bd->device);
+    bd->device = NULL;
+  }
+  pthread_mutex_unlock(&bd->io);
+
+  if (bd->events != NULL) {
+    dropEvents(bd->events, bd);
+    releaseNotifier(bd->events);
+    bd->events = NULL;
+  }
+}
+
+/************************************************************************************
+ *
+ * Daemon
+ *
+ ************************************************************************************/
+
+/*
+ * blink.serve runs a server on a thread of its own that keeps devices open
+ * and carries out the transfers its clients send (see Remote Transport).
+ * Each device is opened once, when a client first asks for it, and stays open
+ * until the server is closed, or until its slot is needed for another device
+ * while no client is using it; the server's blinkers do no color correction,
+ * since clients correct colors before sending them.
+ *
+ * The server waits for requests from all its clients at once and then takes
+ * up to SERVER_BATCH complete requests from each in turn, so a busy client
+ * can't shut the others out. A set or fade that a later one in the same batch
+ * replaces, on the same device and LED with nothing else for that device in
+ * between, is answered without being sent, and each client's replies go back
+ * in one write. Client sockets don't block: replies a client isn't reading
+ * wait in its output buffer, and its requests are left alone until they are
+ * all sent, so a stalled client holds up only itself.
+ */
+
+#define SERVER_BATCH 8
+
+typedef struct peer {
+  int fd;
+  int closing;
+  blinker *bd;
+  size_t nin, nout;
+  uint8_t in[SERVER_BATCH * (REMOTE_HEADER_LEN + REMOTE_PAYLOAD_MAX)];
+  uint8_t out[SERVER_BATCH * (REMOTE_REPLY_HEADER_LEN + REMOTE_PAYLOAD_MAX)];
+} peer;
+
+typedef struct queuedframe {
+  peer *from;
+  const uint8_t *frame;
+} queuedframe;
+
+typedef struct server {
+  pthread_t thread;
+  int listenfd;
+  int wakefd[2];
+  int running;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  peer **peers;
+  int npeers;
+  blinker *devices[MAX_DEVICES];
+  char serials[MAX_DEVICES][SERIAL_LEN + 1];
+  int ndevices;
+  atomic_int clients;
+  atomic_long accepted;
+  atomic_long requests;
+  atomic_long coalesced;
+} server;
+
+/*
+ * Closes a device no client is using, to make room for another. Returns 0, or
+ * -1 if every device is in use.
+ */
+static int evictDevice(server *sv) {
+  for (int i = 0; i < sv->ndevices; i++) {
+    int used = 0;
+    for (int j = 0; j < sv->npeers && !used; j++) {
+      used = sv->peers[j]->bd == sv->devices[i];
+    }
+    if (used) {
+      continue;
+    }
+
+    closeBlinker(sv->devices[i]);
+    free(sv->devices[i]);
+    sv->ndevices--;
+    sv->devices[i] = sv->devices[sv->ndevices];
+    memcpy(sv->serials[i], sv->serials[sv->ndevices], SERIAL_LEN + 1);
+    return 0;
+  }
+
+  return -1;
+}
+
+/*
+ * Returns the server's blinker for the device with registry index <devid>, or
+ * with <serial> if devid is -1, opening the device if no client has yet.
+ */
+static blinker *serverDevice(server *sv, int devid, const char *serial) {
+  char key[SERIAL_LEN + 1] = { '\0' };
+
+  if (devid > -1) {
+    pthread_mutex_lock(&attached.lock);
+    registryRefresh();
+    if (devid < attached.count) {
+      memcpy(key, attached.serials[devid], SERIAL_LEN);
+    }
+    pthread_mutex_unlock(&attached.lock);
+  } else {
+    memcpy(key, serial, SERIAL_LEN);
+  }
+  if (key[0] == '\0') {
+    return NULL;
+  }
+
+  for (int i = 0; i < sv->ndevices; i++) {
+    if (strcasecmp(sv->serials[i], key) == 0) {
+      return sv->devices[i];
+    }
+  }
+  if (sv->ndevices == MAX_DEVICES && evictDevice(sv) != 0) {
+    return NULL;
+  }
+
+  blinker *bd = malloc(sizeof(blinker));
+  if (bd == NULL) {
+    return NULL;
+  }
+  initBlinker(bd);
+  if ((bd->device = registryOpen(-1, key)) == NULL) {
+    free(bd);
+    return NULL;
+  }
+  identifyDevice(bd);
+  calibrate(&bd->color, 1.0, (double[]){ 1.0, 1.0, 1.0 });
+  // so pattern reads for clients pick the right request for the firmware
+  int version = blinker_getVersion(bd);
+  if (version > 0) {
+    bd->firmware = version;
+  }
+
+  memcpy(sv->serials[sv->ndevices], key, SERIAL_LEN + 1);
+  sv->devices[sv->ndevices++] = bd;
+
+  return bd;
+}
+
+static void queueReply(peer *p, int result, const uint8_t *data, size_t len) {
+  uint8_t *reply = p->out + p->nout;
+  uint32_t bits = (uint32_t)result;
+
+  reply[0] = bits >> 24;
+  reply[1] = bits >> 16;
+  reply[2] = bits >> 8;
+  reply[3] = bits;
+  reply[4] = len;
+  memcpy(reply + REMOTE_REPLY_HEADER_LEN, data, len);
+  p->nout += REMOTE_REPLY_HEADER_LEN + len;
+}
+
+/*
+ * Carries out one request and queues the reply.
+ */
+static void serveRequest(server *sv, peer *p, const uint8_t *frame) {
+  uint8_t op = frame[0];
+  size_t nargs = frame[1];
+  const uint8_t *a = frame + REMOTE_HEADER_LEN;
+  blinker *bd = p->bd;
+  uint8_t reply[REMOTE_PAYLOAD_MAX];
+  size_t nreply = 0;
+  int result = BLINK1_ERR;
+
+  atomic_fetch_add_explicit(&sv->requests, 1, memory_order_relaxed);
+
+  if (op == REMOTE_OPEN) {
+    char serial[SERIAL_LEN + 1] = { '\0' };
+    if (nargs == SERIAL_LEN) {
+      memcpy(serial, a, SERIAL_LEN);
+    }
+    p->bd = bd = (nargs == 1 || nargs == SERIAL_LEN) ? serverDevice(sv, (nargs == 1) ? a[0] : -1, serial) : NULL;
+    if (bd != NULL) {
+      reply[0] = bd->link.type;
+      reply[1] = bd->link.mk2;
+      memcpy(reply + 2, bd->link.serial, SERIAL_LEN);
+      nreply = 2 + SERIAL_LEN;
+      result = 0;
+    }
+    queueReply(p, result, reply, nreply);
+    return;
+  }
+
+  if (bd == NULL) {
+    queueReply(p, BLINK1_ERR, NULL, 0);
+    return;
+  }
+
+  uint16_t millis;
+  patternslot slot;
+  switch (op) {
+  case HID_SET:
+    if (nargs == 3) {
+      result = blinker_setRGB(bd, a[0], a[1], a[2]);
+    }
+    break;
+  case HID_FADE:
+    if (nargs == 6) {
+      result = blinker_fadeToRGBN(bd, a[0] << 8 | a[1], a[2], a[3], a[4], a[5]);
+    }
+    break;
+  case HID_READRGB:
+    if (nargs == 1 && (result = blinker_readRGB(bd, &millis, &reply[2], &reply[3], &reply[4], a[0])) != BLINK1_ERR) {
+      reply[0] = millis >> 8;
+      reply[1] = millis & 0xff;
+      nreply = 5;
+    }
+    break;
+  case HID_VERSION:
+    result = blinker_getVersion(bd);
+    break;
+  case HID_PLAYLOOP:
+    if (nargs == 4) {
+      result = blinker_playloop(bd, a[0], a[1], a[2], a[3]);
+    }
+    break;
+  case HID_READPLAY:
+    if ((result = blinker_readPlayState(bd, &reply[0], &reply[1], &reply[2], &reply[3], &reply[4])) != BLINK1_ERR) {
+      nreply = 5;
+    }
+    break;
+  case HID_WRITELINE:
+    if (nargs == 7 && a[5] <= LED_COUNT && a[6] < bd->patternSlots) {
+      slot = (patternslot){ (uint16_t)(a[0] << 8 | a[1]), a[2], a[3], a[4], a[5] };
+      result = blinker_writePatternLine(bd, &slot, a[6]);
+    }
+    break;
+  case HID_READLINE:
+    if (nargs == 1 && (result = blinker_readPatternLine(bd, &slot, a[0])) != BLINK1_ERR) {
+      reply[0] = slot.millis >> 8;
+      reply[1] = slot.millis & 0xff;
+      reply[2] = slot.r;
+      reply[3] = slot.g;
+      reply[4] = slot.b;
+      reply[5] = slot.led;
+      nreply = 6;
+    }
+    break;
+  case HID_SAVE:
+    result = blinker_savePattern(bd);
+    break;
+  case HID_SERVERDOWN:
+    if (nargs == 8) {
+      result = blinker_serverdown(bd, a[0], (uint32_t)a[1] << 24 | a[2] << 16 | a[3] << 8 | a[4], a[5], a[6], a[7]);
+    }
+    break;
+  }
+
+  queueReply(p, result, reply, nreply);
+}
+
+// the LEDs a set or fade changes, or 0 for any other request
+static int colorTarget(const uint8_t *frame) {
+  if (frame[0] == HID_SET && frame[1] == 3) {
+    return 3;
+  }
+  if (frame[0] == HID_FADE && frame[1] == 6) {
+    uint8_t n = frame[REMOTE_HEADER_LEN + 5];
+    return (n == 0) ? 3 : (1 << ledIndex(n));
+  }
+
+  return 0;
+}
+
+static int hasFrame(const uint8_t *in, size_t len) {
+  return len >= REMOTE_HEADER_LEN && len >= (size_t)REMOTE_HEADER_LEN + in[1];
+}
+
+/*
+ * True if request <i> of the batch is a set or fade that a later request
+ * replaces before anything else is done with the device.
+ */
+static int superseded(const queuedframe *batch, int n, int i) {
+  int leds = colorTarget(batch[i].frame);
+  blinker *bd = batch[i].from->bd;
+
+  if (leds == 0 || bd == NULL) {
+    return 0;
+  }
+
+  for (int j = i + 1; j < n; j++) {
+    if (batch[j].from->bd != bd) {
+      continue;
+    }
+
+    int later = colorTarget(batch[j].frame);
+    if (later == 0) {
+      return 0;
+    }
+    if ((later & leds) == leds) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Sends as much of <p>'s queued replies as its socket takes without blocking,
+ * keeping the rest for when it is writable again.
+ */
+static void flushPeer(peer *p) {
+  size_t sent = 0;
+
+  while (sent < p->nout) {
+    ssize_t n = send(p->fd, p->out + sent, p->nout - sent, SEND_FLAGS);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      p->closing = 1;
+      break;
+    }
+    sent += n;
+  }
+
+  memmove(p->out, p->out + sent, p->nout - sent);
+  p->nout -= sent;
+}
+
+// true if <p> has a request the server can take now
+static int peerReady(const peer *p) {
+  return !p->closing && p->nout == 0 && hasFrame(p->in, p->nin);
+}
+
+/*
+ * Takes the complete requests each client with no replies still to send has
+ * sent, in turns, and carries them out.
+ */
+static void serveBatch(server *sv) {
+  queuedframe batch[(sv->npeers + 1) * SERVER_BATCH];
+  size_t used[sv->npeers + 1];
+  int n = 0;
+
+  for (int i = 0; i < sv->npeers; i++) {
+    used[i] = 0;
+  }
+
+  for (int turn = 0; turn < SERVER_BATCH; turn++) {
+    for (int i = 0; i < sv->npeers; i++) {
+      peer *p = sv->peers[i];
+      size_t left = p->nin - used[i];
+      if (p->closing || p->nout > 0 || !hasFrame(p->in + used[i], left)) {
+        continue;
+      }
+      batch[n++] = (queuedframe){ p, p->in + used[i] };
+      used[i] += REMOTE_HEADER_LEN + p->in[used[i] + 1];
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (superseded(batch, n, i)) {
+      atomic_fetch_add_explicit(&sv->requests, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&sv->coalesced, 1, memory_order_relaxed);
+      queueReply(batch[i].from, 0, NULL, 0);
+    } else {
+      serveRequest(sv, batch[i].from, batch[i].frame);
+    }
+  }
+
+  for (int i = 0; i < sv->npeers; i++) {
+    peer *p = sv->peers[i];
+    memmove(p->in, p->in + used[i], p->nin - used[i]);
+    p->nin -= used[i];
+
+    if (used[i] > 0) {
+      flushPeer(p);
+    }
+  }
+}
+
+static void serverAccept(server *sv) {
+  int fd = accept(sv->listenfd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+
+  peer *p = malloc(sizeof(peer));
+  peer **peers = realloc(sv->peers, (sv->npeers + 1) * sizeof(peer *));
+  if (p == NULL || peers == NULL) {
+    free(p);
+    if (peers != NULL) {
+      sv->peers = peers;
+    }
+    close(fd);
+    return;
+  }
+
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){ 1 }, sizeof(int));
+#endif
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  p->fd = fd;
+  p->closing = 0;
+  p->bd = NULL;
+  p->nin = p->nout = 0;
+  sv->peers = peers;
+  sv->peers[sv->npeers++] = p;
+  atomic_fetch_add_explicit(&sv->clients, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&sv->accepted, 1, memory_order_relaxed);
+}
+
+static void serverReap(server *sv) {
+  int kept = 0;
+
+  for (int i = 0; i < sv->npeers; i++) {
+    peer *p = sv->peers[i];
+    if (p->closing) {
+      close(p->fd);
+      free(p);
+      atomic_fetch_sub_explicit(&sv->clients, 1, memory_order_relaxed);
+    } else {
+      sv->peers[kept++] = p;
+    }
+  }
+  sv->npeers = kept;
+}
+
+static void *serverMain(void *arg) {
+  server *sv = arg;
+
+  for (;;) {
+    // a client whose input buffer is full waits until what it has sent is
+    // served; one with replies left to send, until it takes them
+    struct pollfd fds[2 + sv->npeers];
+    int pending = 0;
+    fds[0] = (struct pollfd){ sv->wakefd[0], POLLIN, 0 };
+    fds[1] = (struct pollfd){ sv->listenfd, POLLIN, 0 };
+    for (int i = 0; i < sv->npeers; i++) {
+      peer *p = sv->peers[i];
+      short events = (p->nin < sizeof(p->in)) ? POLLIN : 0;
+      if (p->nout > 0) {
+        events |= POLLOUT;
+      }
+      fds[2 + i] = (struct pollfd){ p->fd, events, 0 };
+      pending = pending || peerReady(p);
+    }
+
+    if (poll(fds, 2 + sv->npeers, pending ? 0 : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[0].revents != 0) {
+      break;
+    }
+
+    int npeers = sv->npeers;
+    for (int i = 0; i < npeers; i++) {
+      peer *p = sv->peers[i];
+      if (fds[2 + i].revents == 0) {
+        continue;
+      }
+      if (fds[2 + i].revents & POLLOUT) {
+        flushPeer(p);
+      }
+      if (!(fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+
+      ssize_t got = recv(p->fd, p->in + p->nin, sizeof(p->in) - p->nin, 0);
+      if (got > 0) {
+        p->nin += got;
+      } else if (got == 0 || (errno != EINTR && errno != EAGAIN)) {
+        p->closing = 1;
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      serverAccept(sv);
+    }
+
+    serveBatch(sv);
+    serverReap(sv);
+  }
+
+  return NULL;
+}
+
+/*
+ * Starts serving on a Unix domain socket at <path>, with permissions <mode>.
+ * A socket file left behind by a server that is no longer running is
+ * replaced. Returns NULL, or a message saying why the server could not be
+ * started.
+ */
+static const char *startServer(server *sv, const char *path, mode_t mode) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return "socket path is too long";
+  }
+  strcpy(addr.sun_path, path);
+  strcpy(sv->path, path);
+
+  sv->peers = NULL;
+  sv->npeers = 0;
+  sv->ndevices = 0;
+  sv->running = 0;
+  atomic_init(&sv->clients, 0);
+  atomic_init(&sv->accepted, 0);
+  atomic_init(&sv->requests, 0);
+  atomic_init(&sv->coalesced, 0);
+
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe >= 0) {
+    int live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(probe);
+    if (live) {
+      return "a server is already listening on that socket";
+    }
+  }
+  unlink(path);
+
+  if ((sv->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    return strerror(errno);
+  }
+  // no one can connect before listen, so the mode is set in time
+  if (bind(sv->listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    const char *err = strerror(errno);
+    close(sv->listenfd);
+    return err;
+  }
+  if (chmod(path, mode) != 0 || listen(sv->listenfd, SOMAXCONN) != 0) {
+    const char *err = strerror(errno);
+    close(sv->listenfd);
+    unlink(path);
+    return err;
+  }
+  fcntl(sv->listenfd, F_SETFL, fcntl(sv->listenfd, F_GETFL) | O_NONBLOCK);
+
+  if (pipe(sv->wakefd) != 0) {
+    const char *err = strerror(errno);
+    close(sv->listenfd);
+    unlink(path);
+    return err;
+  }
+  if (pthread_create(&sv->thread, NULL, serverMain, sv) != 0) {
+    close(sv->listenfd);
+    close(sv->wakefd[0]);
+    close(sv->wakefd[1]);
+    unlink(path);
+    return "could not start server thread";
+  }
+  sv->running = 1;
+
+  return NULL;
+}
+
+/*
+ * Stops the server thread, hangs up on every client and closes the devices.
+ */
+static void stopServer(server *sv) {
+  if (!sv->running) {
+    return;
+  }
+
+  ssize_t ignored = write(sv->wakefd[1], "", 1);
+  (void)ignored;
+  pthread_join(sv->thread, NULL);
+  sv->running = 0;
+
+  for (int i = 0; i < sv->npeers; i++) {
+    sv->peers[i]->closing = 1;
+  }
+  serverReap(sv);
+  free(sv->peers);
+  sv->peers = NULL;
+
+  for (int i = 0; i < sv->ndevices; i++) {
+    closeBlinker(sv->devices[i]);
+    free(sv->devices[i]);
+  }
+  sv->ndevices = 0;
+
+  close(sv->listenfd);
+  close(sv->wakefd[0]);
+  close(sv->wakefd[1]);
+  unlink(sv->path);
+}
+
+/************************************************************************************
+ *
+ * Functions
+ *
+ ************************************************************************************/
+
+// /*** Class Methods.
+//  *
+//  * @section class
+//  *
+//  */
+
+/*** Returns the number of attached blink(1) devices.
+ *
+ * At most 32 devices can be used at once. If more are attached, the number
+ * found is returned as well.
+ *
+ * @function enumerate
+ * @treturn int number of attached devices that can be opened by ID
+ * @treturn[opt] int number of devices found, if more than that
+ *
+ */
+static int lfun_enumerate(lua_State *L) {
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  int count = attached.count;
+  int found = attached.found;
+  pthread_mutex_unlock(&attached.lock);
+
+  lua_pushinteger(L, count);
+  if (found > count) {
+    lua_pushinteger(L, found);
+    return 2;
+  }
+
+  return 1;
+}
+
+/*** Enables gamma correction.
+ *
+ * Gamma correction is enabled by default. See the source code
+ * for the <code>blink1-tool</code> for details on how gamma correction is
+ * implemented.
+ *
+ * This applies to devices whose correction hasn't been set with <code>calibrate</code>.
+ *
+ * @function gamma
+ * @see noGamma
+ *
+ */
+static int lfun_yesDegamma(lua_State *L) {
+  atomic_store(&gammaDefault, 1);
+
+  return 0;
+}
+
+/*** Returns a table with descriptions of all attached devices.
+ *
+ * Each entry is itself a table which describes a single device.
+ *
+ * The subtables have the following keys:
+ * <ul>
+ * <li>devid - an integer index for the device</li>
+ * <li>mark - an integer specifying the device version (mk1, mk2, mk3)</li>
+ * <li>serial - the device's serial number, a hexadecimal value</li>
+ * </ul>
+ *
+ * If more than 32 devices are attached, only the first 32 are listed and the
+ * number found is returned as well.
+ *
+ * @function list
+ * @treturn table each entry describes an attached device
+ * @treturn[opt] int number of devices found, if more were found than listed
+ *
+ */
+static int lfun_list(lua_State *L) {
+  char serials[MAX_DEVICES][SERIAL_LEN + 1];
+  int types[MAX_DEVICES];
+
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  int nDevices = attached.count;
+  int found = attached.found;
+  memcpy(serials, attached.serials, sizeof(serials));
+  memcpy(types, attached.types, sizeof(types));
+  pthread_mutex_unlock(&attached.lock);
+
+  lua_createtable(L, nDevices, 0);
+
+  for (int i = 0; i < nDevices; i++) {
+    // push (list) index for the row we're creating
+    lua_pushinteger(L, i + 1);
+
+    lua_createtable(L, 0, 3);
+
+    lua_pushstring(L, DEVID_KEY);
+    lua_pushinteger(L, i);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, SERIALNUM_KEY);
+    lua_pushstring(L, serials[i]);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, MARK_KEY);
+    lua_pushinteger(L, types[i]);
+    lua_settable(L, -3);
+
+    // now put row into list
+    lua_settable(L, -3);
+  }
+
+  if (found > nDevices) {
+    lua_pushinteger(L, found);
+    return 2;
+  }
+
+  return 1;
+}
+
+static int lfun_hsbToRgb(lua_State *L) {
+  uint8_t hsbbuf[3];
+  rgb_t rgb = {0, 0, 0};
+                 
+  hsbbuf[0] = (uint8_t)luaL_checkinteger(L, 1);
+  hsbbuf[1] = (uint8_t)luaL_checkinteger(L, 2);
+  hsbbuf[2] = (uint8_t)luaL_checkinteger(L, 3);
+
+  hsbtorgb(&rgb, hsbbuf);
+           
+  lua_pushinteger(L, rgb.r);
+  lua_pushinteger(L, rgb.g);
+  lua_pushinteger(L, rgb.b);
+
+  return 3;
+}
+
+static const char *const colorSpaces[] = { "rgb", "hsb", "hsv", "linear", NULL };
+static const colorspace colorSpaceIds[] = { SPACE_RGB, SPACE_HSB, SPACE_HSB, SPACE_LINEAR };
+
+/*
+ * Returns the packed colors at <idx> and sets *n to how many there are.
+ */
+static const uint8_t *checkColors(lua_State *L, int idx, size_t *n) {
+  size_t len;
+  const char *colors = luaL_checklstring(L, idx, &len);
+  luaL_argcheck(L, (len % PACKED_COLOR_LEN == 0), idx, BADPACKEDCOLORS_MSG);
+  *n = len / PACKED_COLOR_LEN;
+
+  return (const uint8_t *)colors;
+}
+
+/*** Blends two arrays of packed colors.
+ *
+ * Each color of the result is <code>a</code>'s color moved towards <code>b</code>'s
+ * by <code>alpha</code>/255: 0 gives <code>a</code>, 255 gives <code>b</code>.
+ * <code>b</code> may be a single color, which is blended into every color of
+ * <code>a</code>, and <code>alpha</code> may be a string with one weight byte per color.
+ *
+ * Colors are packed as for <code>@{convert}</code>.
+ *
+ * @function blend
+ * @tparam string a packed colors
+ * @tparam string b packed colors, as many as <code>a</code> or just one
+ * @tparam int|string alpha the weight of <code>b</code> in [0, 255], or one weight per color
+ * @treturn string the blended colors
+ *
+ */
+static int lfun_blend(lua_State *L) {
+  size_t n, nb;
+  const uint8_t *a = checkColors(L, 1, &n);
+  const uint8_t *b = checkColors(L, 2, &nb);
+  luaL_argcheck(L, (nb == n || nb == 1), 2, "must have as many colors as the first argument, or one");
+
+  luaL_Buffer buf;
+  uint8_t *out = (uint8_t *)luaL_buffinitsize(L, &buf, n * PACKED_COLOR_LEN);
+
+  if (lua_type(L, 3) == LUA_TSTRING) {
+    size_t nw;
+    const uint8_t *w = (const uint8_t *)lua_tolstring(L, 3, &nw);
+    luaL_argcheck(L, (nw == n), 3, "must have one weight per color");
+    blendColors(a, b, (nb == 1) ? 0 : PACKED_COLOR_LEN, w, 1, out, n);
+  } else {
+    lua_Integer w = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, (-1 < w && w < 256), 3, "alpha must be in range [0, 255]");
+
+    if (nb == n) {
+      blendBytes(a, b, out, n * PACKED_COLOR_LEN, w);
+    } else {
+      uint8_t weight = w;
+      blendColors(a, b, 0, &weight, 0, out, n);
+    }
+  }
+
+  luaL_pushresultsize(&buf, n * PACKED_COLOR_LEN);
+  return 1;
+}
+
+/*** Converts an array of packed colors between color spaces.
+ *
+ * Colors are packed 3 bytes each into a string, e.g. with
+ * <code>string.pack('BBB', r, g, b)</code>, so a whole palette is converted with
+ * one call. The color spaces are:
+ * <ul>
+ * <li>rgb - red, green and blue, as taken by <code>set</code></li>
+ * <li>hsb (or hsv) - hue, saturation and brightness, as taken by <code>hsbtorgb</code></li>
+ * <li>linear - red, green and blue as the LEDs are driven after gamma correction</li>
+ * </ul>
+ * Converting from rgb to hsb and back may be off by a few steps per component.
+ *
+ * @function convert
+ * @tparam string colors packed colors
+ * @tparam string from the color space of <code>colors</code>
+ * @tparam string to the color space to convert to
+ * @treturn string the converted colors
+ *
+ */
+static int lfun_convert(lua_State *L) {
+  size_t n;
+  const uint8_t *colors = checkColors(L, 1, &n);
+  colorspace from = colorSpaceIds[luaL_checkoption(L, 2, NULL, colorSpaces)];
+  colorspace to = colorSpaceIds[luaL_checkoption(L, 3, NULL, colorSpaces)];
+
+  luaL_Buffer buf;
+  uint8_t *out = (uint8_t *)luaL_buffinitsize(L, &buf, n * PACKED_COLOR_LEN);
+  convertColors(colors, out, n, from, to);
+  luaL_pushresultsize(&buf, n * PACKED_COLOR_LEN);
+
+  return 1;
+}
+
+/*** Returns an array of packed colors fading from one color to another.
+ *
+ * @function gradient
+ * @tparam string from the first color, packed
+ * @tparam string to the last color, packed
+ * @tparam int n the number of colors
+ * @treturn string <code>n</code> packed colors evenly spaced from <code>from</code> to <code>to</code>
+ *
+ */
+static int lfun_gradient(lua_State *L) {
+  size_t nfrom, nto;
+  const uint8_t *from = checkColors(L, 1, &nfrom);
+  const uint8_t *to = checkColors(L, 2, &nto);
+  lua_Integer n = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, (nfrom == 1), 1, BADPACKEDCOLOR_MSG);
+  luaL_argcheck(L, (nto == 1), 2, BADPACKEDCOLOR_MSG);
+  luaL_argcheck(L, (0 < n && n <= INT_MAX / PACKED_COLOR_LEN), 3, "n must be positive");
+
+  luaL_Buffer buf;
+  uint8_t *out = (uint8_t *)luaL_buffinitsize(L, &buf, n * PACKED_COLOR_LEN);
+  gradientColors(from, to, out, n);
+  luaL_pushresultsize(&buf, n * PACKED_COLOR_LEN);
+
+  return 1;
+}
+
+static lua_Integer getIntField(lua_State *L, int idx, const char *key, lua_Integer def, int *ok);
+static const char *readKeyframe(lua_State *L, int idx, keyframe *k);
+static double getLevelField(lua_State *L, int idx, const char *key, double dflt, double lo, double hi, int *ok);
+static notifier *stateNotifier(lua_State *L);
+static int lfun_requestResult(lua_State *L);
+
+/*
+ * Calls the function at <idx> for each of <n> frames, <fps> a second, and
+ * pushes a string of the colors it returns for <leds> LEDs: either a packed
+ * string, or red, green and blue for each LED.
+ */
+static const uint8_t *sampleFrames(lua_State *L, int idx, int n, double fps, int leds) {
+  size_t stride = leds * PACKED_COLOR_LEN;
+  luaL_Buffer buf;
+  uint8_t *out = (uint8_t *)luaL_buffinitsize(L, &buf, n * stride);
+
+  for (int k = 0; k < n; k++, out += stride) {
+    int top = lua_gettop(L);
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, frameMillis(k, fps));
+    lua_call(L, 1, LUA_MULTRET);
+
+    size_t len;
+    if (lua_type(L, top + 1) == LUA_TSTRING) {
+      const char *packed = lua_tolstring(L, top + 1, &len);
+      if (len != stride) {
+        luaL_error(L, "frame %d: expected %d packed bytes", k + 1, (int)stride);
+      }
+      memcpy(out, packed, stride);
+    } else {
+      for (size_t i = 0; i < stride; i++) {
+        int isint;
+        lua_Integer level = lua_tointegerx(L, top + 1 + i, &isint);
+        if (!isint || level < 0 || level > 255) {
+          luaL_error(L, "frame %d: expected %d levels in range [0, 255]", k + 1, (int)stride);
+        }
+        out[i] = level;
+      }
+    }
+    lua_settop(L, top);
+  }
+  luaL_pushresultsize(&buf, n * stride);
+
+  return (const uint8_t *)lua_tostring(L, -1);
+}
+
+/*** Compresses dense frames into the fewest fades that stay close to them.
+ *
+ * The frames are colors sampled <code>fps</code> times a second, either a
+ * string of packed colors, as for <code>@{stream}</code>, or a function called with
+ * the time in milliseconds of each frame from 0 to <code>duration</code>, which
+ * returns red, green and blue (for each LED) or a packed color. The result is a
+ * timeline for <code>@{animate}</code> whose fades, played by the device, pass within
+ * <code>tolerance</code> of every frame in each of red, green and blue, along with a
+ * report on how well it fits.
+ *
+ * The options are:
+ * <ul>
+ * <li>tolerance - the error allowed in each channel, in [0, 255]; defaults to 2</li>
+ * <li>leds - 1 for one color per frame, used for both LEDs (the default), or 2 for
+ *   one for each LED, compressed separately</li>
+ * <li>duration - how long to sample a function for, in milliseconds</li>
+ * </ul>
+ *
+ * The report has the number of <code>frames</code> in, the number of
+ * <code>keyframes</code> out and the largest and mean error in any channel
+ * (<code>max_error</code> and <code>mean_error</code>), measured in the levels
+ * asked for; the device fades between levels after color correction.
+ *
+ * For example, a second of breathing:
+ *
+ * <code>local t = blink.compress(function(ms) return 0, 0, math.floor(127.5 - 127.5 * math.cos(ms / 159.15)) end,
+ * 100, { duration = 1000 })</code>
+ *
+ * @function compress
+ * @tparam string|function frames packed colors, or a function returning them
+ * @number fps frames per second, in [1000/65535, 1000]: frames can be no further
+ *   apart than the longest fade
+ * @tparam[opt] table options
+ * @treturn table a timeline
+ * @treturn table the report
+ * @raise error if an argument is out of range
+ * @see animate
+ *
+ */
+static int lfun_compress(lua_State *L) {
+  lua_Number fps = luaL_checknumber(L, 2);
+  luaL_argcheck(L, (fps * MAX_FADE_MILLIS >= 1000 && fps <= 1000), 2, "fps must be in range [1000/65535, 1000]");
+
+  int ok = 1;
+  lua_Integer leds = 1, duration = -1;
+  double tol = 2.0;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    leds = getIntField(L, 3, "leds", 1, &ok);
+    duration = getIntField(L, 3, "duration", -1, &ok);
+    luaL_argcheck(L, ok, 3, "leds and duration must be integers");
+    tol = getLevelField(L, 3, "tolerance", 2.0, 0.0, 255.0, &ok);
+    luaL_argcheck(L, ok, 3, "tolerance must be a number in [0, 255]");
+  }
+  luaL_argcheck(L, (leds == 1 || leds == 2), 3, "leds must be 1 or 2");
+  lua_settop(L, 3);
+
+  size_t stride = leds * PACKED_COLOR_LEN;
+  const uint8_t *frames;
+  int n;
+  if (lua_isfunction(L, 1)) {
+    luaL_argcheck(L, (duration >= 0 && duration <= INT_MAX / 1000), 3, "duration must be given, in milliseconds");
+    double count = floor(duration * fps / 1000.0) + 1;
+    luaL_argcheck(L, (count * stride <= INT_MAX), 3, "too many frames");
+    n = count;
+    frames = sampleFrames(L, 1, n, fps, leds);
+  } else {
+    size_t len;
+    frames = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    luaL_argcheck(L, (len > 0 && len % stride == 0 && len <= INT_MAX), 1,
+                  "frames must be a non-empty string of 3 (or 6) byte frames");
+    n = len / stride;
+  }
+
+  // scratch space, collected with the rest of the stack
+  segment *segs = lua_newuserdatauv(L, n * sizeof(segment), 0);
+  timedframe *timed = lua_newuserdatauv(L, leds * (n + 1) * sizeof(timedframe), 0);
+
+  int nframes = 0;
+  double maxError = 0.0, totalError = 0.0;
+  for (int led = 0; led < leds; led++) {
+    const uint8_t *colors = frames + led * PACKED_COLOR_LEN;
+    int nsegs = fitSegments(colors, stride, n, fps, tol, segs);
+    measureFit(colors, stride, segs, nsegs, &maxError, &totalError);
+    nframes += segmentsToFrames(colors, segs, nsegs, (leds == 1) ? 0 : led + 1, fps, timed + nframes);
+  }
+  scheduleFrames(timed, nframes, frameMillis(n, fps));
+
+  lua_createtable(L, nframes, 0);
+  for (int i = 0; i < nframes; i++) {
+    const keyframe *k = &timed[i].k;
+    lua_createtable(L, 0, 6);
+    setIntegerField(L, MILLIS_KEY, k->millis);
+    setIntegerField(L, RED_KEY, k->r);
+    setIntegerField(L, GREEN_KEY, k->g);
+    setIntegerField(L, BLUE_KEY, k->b);
+    setIntegerField(L, LED_KEY, k->led);
+    setIntegerField(L, WAIT_KEY, k->wait);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  lua_createtable(L, 0, 4);
+  setIntegerField(L, "frames", n);
+  setIntegerField(L, "keyframes", nframes);
+  setNumberField(L, "max_error", maxError);
+  setNumberField(L, "mean_error", totalError / ((double)n * leds * 3));
+
+  return 2;
+}
+
+/*** Disables gamma correction.
+ *
+ * This applies to devices whose correction hasn't been set with <code>calibrate</code>.
+ *
+ * @function noGamma
+ * @see gamma
+ *
+ */
+static int lfun_noDegamma(lua_State *L) {
+  atomic_store(&gammaDefault, 0);
+
+  return 0;
+}
+
+/*
+ * Pushes a table describing one pattern line, with the millis, red, green,
+ * blue and led keys.
+ */
+static void pushPatternLine(lua_State *L, const patternslot *slot) {
+  lua_createtable(L, 0, 5);
+
+  lua_pushinteger(L, slot->millis);
+  lua_setfield(L, -2, MILLIS_KEY);
+  lua_pushinteger(L, slot->r);
+  lua_setfield(L, -2, RED_KEY);
+  lua_pushinteger(L, slot->g);
+  lua_setfield(L, -2, GREEN_KEY);
+  lua_pushinteger(L, slot->b);
+  lua_setfield(L, -2, BLUE_KEY);
+  lua_pushinteger(L, slot->led);
+  lua_setfield(L, -2, LED_KEY);
+}
+
+/*
+ * Pushes a table of <n> pattern lines, as pushed by pushPatternLine; position
+ * 0 is at index <base>.
+ */
+static void pushPattern(lua_State *L, const patternslot *slots, int n, int base) {
+  lua_createtable(L, n, 0);
+
+  for (int pos = 0; pos < n; pos++) {
+    pushPatternLine(L, &slots[pos]);
+    lua_rawseti(L, -2, pos + base);
+  }
+}
+
+/*
+ * Packs <n> pattern lines into <out>, PACKED_LINE_LEN bytes each: millis
+ * (big endian), red, green, blue and LED.
+ */
+static void packLines(const patternslot *slots, int n, uint8_t *out) {
+  for (int pos = 0; pos < n; pos++, out += PACKED_LINE_LEN) {
+    out[0] = slots[pos].millis >> 8;
+    out[1] = slots[pos].millis & 0xff;
+    out[2] = slots[pos].r;
+    out[3] = slots[pos].g;
+    out[4] = slots[pos].b;
+    out[5] = slots[pos].led;
+  }
+}
+
+/*
+ * Unpacks <n> lines packed as by packLines into <slots>. Returns -1, or the
+ * index of the first line whose LED is out of range.
+ */
+static int unpackLines(const uint8_t *line, int n, patternslot *slots) {
+  for (int i = 0; i < n; i++, line += PACKED_LINE_LEN) {
+    if (line[5] > LED_COUNT) {
+      return i;
+    }
+    slots[i] = (patternslot){ (uint16_t)(line[0] << 8 | line[1]), line[2], line[3], line[4], line[5] };
+  }
+
+  return -1;
+}
+
+/*
+ * Pushes <n> pattern lines packed into a string of 6 byte lines: millis
+ * (big-endian), red, green, blue and LED.
+ */
+static void pushPackedPattern(lua_State *L, const patternslot *slots, int n) {
+  uint8_t packed[PATTERN_SLOTS * PACKED_LINE_LEN];
+
+  packLines(slots, n, packed);
+  lua_pushlstring(L, (const char *)packed, n * PACKED_LINE_LEN);
+}
+
+/*
+ * Returns the compiled form of the pattern string at <idx>, parsing it only
+ * if it is not in the library's cache. The cache holds at most
+ * PATTERN_CACHE_SIZE patterns, counted at its index 0, and is emptied when
+ * full. The compiled pattern is left on the stack, which keeps it alive while
+ * it is in use.
+ */
+static const compiledpattern *checkPatternString(lua_State *L, int idx) {
+  luaL_checkstring(L, idx);
+
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &patternCache);
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+    lua_remove(L, -2);
+    return lua_touserdata(L, -1);
+  }
+  lua_pop(L, 1);
+
+  int line;
+  compiledpattern *cp = lua_newuserdatauv(L, sizeof(compiledpattern), 0);
+  const char *err = parsePatternString(lua_tostring(L, idx), cp, &line);
+  if (err != NULL) {
+    if (line < 0) {
+      luaL_argerror(L, idx, err);
+    }
+    luaL_error(L, BADPATTERNLINE_MSG, line, err);
+  }
+
+  lua_rawgeti(L, -2, 0);
+  lua_Integer cached = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (cached == PATTERN_CACHE_SIZE) {
+    lua_newtable(L);
+    lua_replace(L, -3);
+    lua_pushvalue(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &patternCache);
+    cached = 0;
+  }
+  lua_pushinteger(L, cached + 1);
+  lua_rawseti(L, -3, 0);
+
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  lua_remove(L, -2);
+
+  return cp;
+}
+
+/*** Parses a pattern string.
+ *
+ * Pattern strings have the format used by <code>blink1-tool</code>: a repeat
+ * count followed by a color, a time in seconds and an LED number (0 for both)
+ * for each pattern line, all separated by commas. For example
+ * <code>"3,#ff0000,0.5,0,#0000ff,0.5,0"</code> alternates red and blue,
+ * three times.
+ *
+ * @function parsepattern
+ * @string pattern the pattern string
+ * @treturn table the pattern, in the format accepted by <code>writepattern</code>
+ * @treturn int the repeat count
+ * @raise error if the pattern string is malformed
+ * @see setpatternstring
+ *
+ */
+static int lfun_parsePattern(lua_State *L) {
+  const compiledpattern *cp = checkPatternString(L, 1);
+
+  pushPattern(L, cp->slots, cp->n, 1);
+  lua_pushinteger(L, cp->repeats);
+
+  return 2;
+}
+
+/*
+ * Compiles the timeline at <idx>, played <count> times, into <p> with at most
+ * <budget> lines. The keyframes and lines are kept in userdata left on the
+ * stack. Throws an error if the timeline is malformed or doesn't fit.
+ */
+static void checkTimelinePlan(lua_State *L, int idx, int count, int budget, patternplan *p) {
+  luaL_checktype(L, idx, LUA_TTABLE);
+  int n = luaL_len(L, idx);
+  luaL_argcheck(L, (n > 0), idx, EMPTYTIMELINE_MSG);
+
+  keyframe *frames = lua_newuserdatauv(L, n * sizeof(keyframe), 0);
+  size_t nlines = 0;
+  for (int i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    const char *problem = readKeyframe(L, -1, &frames[i]);
+    lua_pop(L, 1);
+
+    if (problem != NULL) {
+      luaL_error(L, BADTIMELINE_MSG, i + 1, problem);
+    }
+    nlines += linesFor(&frames[i]);
+  }
+
+  p->lines = lua_newuserdatauv(L, nlines * sizeof(plannedline), 0);
+  if (compileTimeline(p, frames, n, count, budget) != 0) {
+    luaL_error(L, "timeline does not fit in %d pattern lines", budget);
+  }
+}
+
+/*** Compiles a timeline into a pattern the device can play by itself.
+ *
+ * Each keyframe becomes a pattern line that fades until the next keyframe
+ * starts, plus a line holding the color if the fade should end sooner. Times
+ * are rounded to the device's 10 ms resolution, a timeline made of repeats of
+ * the same lines is kept once and played more times, and if the lines still
+ * don't fit in <code>slots</code>, holds are folded into the fades before them
+ * and then the lines that change the color least are dropped.
+ *
+ * The report has the number of <code>lines</code>, the <code>count</code> to play
+ * them, how many times they were <code>folded</code>, the number of <code>holds</code>
+ * and <code>dropped</code> keyframes, the <code>max_timing_error</code> of any fade in
+ * milliseconds, and the <code>period</code> of one play through the lines.
+ *
+ * @function compiletimeline
+ * @tparam table timeline array of keyframes, as for <code>@{animate}</code>
+ * @tparam[opt] int count the number of times to play the timeline; 0 = loop forever; defaults to 1
+ * @tparam[opt] int slots the number of pattern lines available; defaults to 32
+ * @treturn table the pattern, as for <code>@{writepattern}</code>
+ * @treturn table the report
+ * @raise error if the timeline is malformed or can't be made to fit
+ * @see playtimeline
+ *
+ */
+static int lfun_compileTimeline(lua_State *L) {
+  int count = luaL_optinteger(L, 2, 1);
+  int slots = luaL_optinteger(L, 3, PATTERN_SLOTS);
+  luaL_argcheck(L, (count > -1 && count <= MAX_PLAY_COUNT), 2, "count must be in range [0, 255]");
+  luaL_argcheck(L, (slots > 0 && slots <= PATTERN_SLOTS), 3, "slots must be in range [1, 32]");
+
+  patternplan p;
+  checkTimelinePlan(L, 1, count, slots, &p);
+
+  lua_createtable(L, p.n, 0);
+  for (int i = 0; i < p.n; i++) {
+    pushPatternLine(L, &p.lines[i].slot);
+    lua_rawseti(L, -2, i + 1);
+  }
+  pushCompileReport(L, &p);
+
+  return 2;
+}
+
+/*** Opens a blink(1) device.
+ *
+ * This function creates a userdata bound to a specified blink(1). If called without a parameter,
+ * it returns a userdata bound to the blink(1) device with ID 0. Otherwise it attempts to bind to the specified device.
+ *
+ * A particular device is specified
+ * either by an integer ID or a string of 8 hexadecimal characters. Integer IDs must be between
+ * <code>0</code> and <code>n-1</code> (<em>where n is the number of attached devices</em>).
+ *
+ * Hex strings are used to specify the serial number of a particular device. Serial numbers of all plugged in devices
+ * can be found using the <code>@{list}</code> function.
+ *
+ * <code>Open</code> will throw an error on invalid arguments or issues opening the device. This error can be caught by
+ * wrapping the call in <code>@{pcall}</code>.
+ *
+ * @function open
+ * @tparam[opt] ?string|int devspec device ID or serial number
+ * @treturn userdata object bound to the specified device
+ * @raise error on invalid arguments or error opening device
+ *
+ */
+static int lfun_open(lua_State *L) {
+  int devid = -1;
+  char serial[SERIAL_LEN + 1] = {'\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0'};
+
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  int nDevices = attached.count;
+  pthread_mutex_unlock(&attached.lock);
+
+  if (0 == nDevices) {
+    return luaL_error(L, NODEV_MSG);
+  }
+
+  // @fixme - not happy with this; clean it up and rethink
+  if (0 == lua_gettop(L)) {
+    devid = 0;
+  } else if (lua_isinteger(L, 1)) {
+    int argval = lua_tointeger(L, 1);
+    if ( (-1 < argval) && (argval < nDevices) ) {
+      devid = argval;
+    } else {
+      sprintf(serial, "%X", argval);
+    }
+  } else if (lua_isstring(L, 1)) {
+    size_t len;
+    const char *spec = lua_tolstring(L, 1, &len);
+    if (len == SERIAL_LEN && strspn(spec, "0123456789abcdefABCDEF") == SERIAL_LEN) {
+      memcpy(serial, spec, SERIAL_LEN);
+    } else {
+      int isint;
+      devid = lua_tointegerx(L, 1, &isint);
+      if (!isint) {
+        return luaL_error(L, BADDEVSPEC_MSG);
+      }
+    }
+  } else {
+    return luaL_error(L, BADDEVSPEC_MSG);
+  }
+
+  blinker *b = (blinker *)lua_newuserdatauv(L, sizeof(blinker), 1);
+  // No need to check that b is not null: if memory allocation failed,
+  // we'd never return to here because the allocator throws an error.
+  initBlinker(b);
+
+  b->device = registryOpen(devid, serial);
+
+  // I _think_ the userdata will be garbage collected since it doesn't get assigned.
+  if (b->device == NULL) {
+    char msg[100];
+    if (devid > -1) {
+      sprintf(msg, IDOPENERR_MSG, devid);
+    } else {
+      sprintf(msg, SERIALOPENERR_MSG, serial);
+    }
+
+    return luaL_error(L, msg);
+  }
+
+  identifyDevice(b);
+  b->events = retainNotifier(stateNotifier(L));
+
+  luaL_getmetatable(L, BLINK_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+/*** Connects to a blink(1) through a server.
+ *
+ * The server, started by <code>@{serve}</code> in this or another process,
+ * keeps the device open and carries out the calls made by each of its clients.
+ * The object returned has every method of one returned by <code>@{open}</code>;
+ * its colors are corrected here, by its own <code>calibrate</code>
+ * settings. Closing it leaves the device as it is.
+ *
+ * @function connect
+ * @tparam string path the server's socket
+ * @tparam[opt] ?string|int devspec device ID or serial number; defaults to 0
+ * @treturn userdata object bound to the specified device, or nil and an error message
+ * @raise error on invalid arguments
+ *
+ */
+static int lfun_connect(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  uint8_t spec[SERIAL_LEN] = { 0 };
+  size_t nspec = 1;
+
+  if (lua_isinteger(L, 2)) {
+    lua_Integer devid = lua_tointeger(L, 2);
+    luaL_argcheck(L, (0 <= devid && devid < MAX_DEVICES), 2, BADDEVID_MSG);
+    spec[0] = devid;
+  } else if (!lua_isnoneornil(L, 2)) {
+    size_t len;
+    const char *serial = luaL_checklstring(L, 2, &len);
+    luaL_argcheck(L, (len == SERIAL_LEN && strspn(serial, "0123456789abcdefABCDEF") == SERIAL_LEN), 2, BADDEVSPEC_MSG);
+    memcpy(spec, serial, SERIAL_LEN);
+    nspec = SERIAL_LEN;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  luaL_argcheck(L, strlen(path) < sizeof(addr.sun_path), 1, "socket path is too long");
+  strcpy(addr.sun_path, path);
+
+  // set up as a closed remote blinker first, so the collector closes the socket on failure
+  blinker *b = (blinker *)lua_newuserdatauv(L, sizeof(blinker), 1);
+  initBlinker(b);
+  b->link.remote = 1;
+  b->events = retainNotifier(stateNotifier(L));
+  luaL_getmetatable(L, BLINK_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  if ((b->link.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(b->link.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, CONNECTERR_MSG, path, strerror(errno));
+    return 2;
+  }
+#ifdef SO_NOSIGPIPE
+  setsockopt(b->link.fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){ 1 }, sizeof(int));
+#endif
+
+  uint8_t reply[2 + SERIAL_LEN];
+  if (remoteRequest(b->link.fd, REMOTE_OPEN, spec, nspec, reply, sizeof(reply)) == BLINK1_ERR) {
+    lua_pushnil(L);
+    lua_pushfstring(L, REMOTEOPENERR_MSG, path);
+    return 2;
+  }
+
+  b->link.type = reply[0];
+  b->link.mk2 = reply[1];
+  memcpy(b->link.serial, reply + 2, SERIAL_LEN);
+  b->link.serial[SERIAL_LEN] = '\0';
+  b->patternSlots = (b->link.type == BLINK1_MK1) ? MK1_PATTERN_SLOTS : PATTERN_SLOTS;
+
+  return 1;
+}
+
+/*** Serves the attached blink(1)s to other processes.
+ *
+ * Starts a server, on a thread of its own, that clients reach with
+ * <code>@{connect}</code> through a Unix domain socket at <code>path</code>.
+ * Devices are opened as clients ask for them and stay open until the server
+ * is closed, unless there are more than 32 and one no client is using is
+ * closed to make room. Requests from all clients are taken in turns; a color
+ * change that another one to the same LED replaces before the device could
+ * show it is not sent.
+ *
+ * The socket can only be used by its owner unless <code>mode</code> says
+ * otherwise, e.g. <code>tonumber('660', 8)</code> to let the owner's group in as well.
+ *
+ * The server stops when the object returned is closed or collected.
+ *
+ * @function serve
+ * @tparam string path socket to listen on
+ * @tparam[opt] int mode permissions of the socket file; defaults to
+ *   <code>tonumber('600', 8)</code>
+ * @treturn userdata the server, or nil and an error message
+ * @raise error if <code>mode</code> is not a valid file mode
+ *
+ */
+static int lfun_serve(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lua_Integer mode = luaL_optinteger(L, 2, 0600);
+  luaL_argcheck(L, (mode >= 0 && mode <= 0777), 2, "mode must be in range [0, 0777] (octal)");
+
+  server *sv = (server *)lua_newuserdatauv(L, sizeof(server), 0);
+  sv->running = 0;
+  luaL_getmetatable(L, SERVER_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  const char *err = startServer(sv, path, (mode_t)mode);
+  if (err != NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, SERVEERR_MSG, path, err);
+    return 2;
+  }
+
+  return 1;
+}
+
+/*** Returns the USB Product ID for the blink(1).
+ *
+ * USB devices have an assigned product ID (PID) and
+ * vendor ID (VID); these are both 16-bit numbers are are used to
+ * indentify the device to the hosting computer. The VID is assigned by the USB
+ * Implementers Forum and the PID is assigned by the manufacturer of the device.
+ *
+ * @function pid
+ * @treturn int Product ID.
+ * @see vid
+ *
+ */
+static int lfun_pid(lua_State *L) {
+  lua_pushinteger(L, blink1_pid());
+  
+  return 1;
+}
+
+/*** Platform-independent, millisecond-resolution sleep.
+ *
+ * This function is blocking.
+ *
+ * @function sleep
+ * @tparam[opt] int millis milliseconds to pause; defaults to 100
+ * @raise error if <code>millis</code> &lt; 0
+ *
+ */
+static int lfun_sleep(lua_State *L) {
+  int millis = luaL_optinteger(L, 1, DEFAULT_PAUSE);
+  luaL_argcheck(L, (millis >= 0), 1, BADSLEEPTIME_MSG);
+  blink1_sleep(millis);
+  
+  return 0;
+}
+
+/*** Returns counters for the calls made to every device.
+ *
+ * The counters cover all devices opened by the process, including those
+ * since closed, and have the same format as those returned by the
+ * <code>stats</code> method.
+ *
+ * @function stats
+ * @tparam[opt] boolean reset zero the counters after reading them
+ * @treturn table the counters
+ *
+ */
+static int lfun_processStats(lua_State *L) {
+  int reset = lua_toboolean(L, 1);
+
+  pushCounters(L, processStats);
+  if (reset) {
+    resetCounters(processStats);
+  }
+
+  return 1;
+}
+
+/*** Returns the USB vendor ID for ThingM.
+ *
+ * USB devices have an assigned product ID (PID) and
+ * vendor ID (VID); these are both 16-bit numbers are are used to
+ * indentify the device to the hosting computer. The VID is assigned by the USB
+ * Implementers Forum and the PID is assigned by the manufacturer of the device.
+ *
+ * @function vid
+ * @treturn int Vendor ID.
+ * @see pid
+ *
+ */
+static int lfun_vid(lua_State *L) {
+  lua_pushinteger(L, blink1_vid());
+  
+  return 1;
+}
+
+/*
+ * The state's hotplug object, holding the registry generation last reported
+ * to Lua and the state's notifier. Its user values are the hotplug
+ * callbacks, the set of serial numbers last reported, the watched requests
+ * keyed by their request and the devices with an onanimationend callback
+ * keyed by their blinker (weakly, so they can still be collected).
+ */
+typedef struct hotplug {
+  unsigned long generation;
+  notifier *events;
+} hotplug;
+
+static int lfun_hotplugGc(lua_State *L) {
+  hotplug *h = luaL_checkudata(L, 1, HOTPLUG_TYPENAME);
+  registryRelease(h->events);
+  releaseNotifier(h->events);
+  h->events = NULL;
+
+  return 0;
+}
+
+static hotplug *getHotplug(lua_State *L) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &attached);
+  hotplug *h = luaL_checkudata(L, -1, HOTPLUG_TYPENAME);
+
+  return h;
+}
+
+/*
+ * Returns the state's notifier, which may be NULL if it could not be
+ * created.
+ */
+static notifier *stateNotifier(lua_State *L) {
+  notifier *n = getHotplug(L)->events;
+  lua_pop(L, 1);
+
+  return n;
+}
+
+/*** Registers a function to be called when a blink(1) is plugged in or unplugged.
+ *
+ * The function is called with two arguments: <code>"add"</code> or <code>"remove"</code>,
+ * and the serial number of the device. Notifications are delivered by
+ * <code>@{dispatch}</code>; the first call to <code>dispatch</code> reports every device
+ * that is already attached as an arrival, and <code>@{fd}</code> becomes readable when
+ * a device may have come or gone.
+ *
+ * Devices are enumerated once and the result is kept up to date by a background
+ * watcher, so <code>@{enumerate}</code>, <code>@{list}</code> and <code>@{open}</code> don't
+ * rescan the USB bus each time they are called.
+ *
+ * @function onhotplug
+ * @tparam function fn the function to call
+ * @see dispatch
+ *
+ */
+static int lfun_onHotplug(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  getHotplug(L);
+
+  lua_getiuservalue(L, -1, 1);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+
+  return 0;
+}
+
+/*** Returns a file descriptor for external event loops.
+ *
+ * The descriptor becomes readable when <code>@{dispatch}</code> has something
+ * to deliver: a blink(1) was plugged in or unplugged, a request with an
+ * <code>ondone</code> callback finished, or an animation with an
+ * <code>@{onanimationend}</code> callback ran to its end. Watch it for reading
+ * with your event loop (epoll, luv, cqueues...) and call <code>dispatch</code>
+ * when it is; <code>dispatch</code> empties it. Don't read from or close it. It
+ * may now and then be readable with nothing to deliver, in which case
+ * <code>dispatch</code> just returns 0.
+ *
+ * There is one descriptor for each Lua state that loads the library.
+ *
+ * @function fd
+ * @treturn int the descriptor | nil and an error description if it could not be created
+ * @see dispatch
+ *
+ */
+static int lfun_fd(lua_State *L) {
+  notifier *n = stateNotifier(L);
+  if (n == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not create notification pipe");
+    return 2;
+  }
+
+  // start the hotplug watcher, so that arrivals signal too
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  pthread_mutex_unlock(&attached.lock);
+
+  lua_pushinteger(L, n->fds[0]);
+  return 1;
+}
+
+/*
+ * Calls the hotplug callbacks for each device that has come or gone since
+ * the last call. The hotplug object is at index 1. Returns the number of
+ * notifications delivered, or -1 with the first error a callback raised on
+ * top of the stack.
+ */
+static int dispatchHotplug(lua_State *L, hotplug *h) {
+  char serials[MAX_DEVICES][SERIAL_LEN + 1];
+  int delivered = 0;
+
+  lua_settop(L, 1);
+  lua_getiuservalue(L, 1, 1);
+  lua_getiuservalue(L, 1, 2);
+
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  unsigned long generation = attached.generation;
+  int count = attached.count;
+  memcpy(serials, attached.serials, sizeof(serials));
+  pthread_mutex_unlock(&attached.lock);
+
+  if (generation == h->generation) {
+    return 0;
+  }
+
+  // build the new set, then report removals (in old, not new) and arrivals (in new, not old)
+  lua_createtable(L, 0, count);
+  for (int i = 0; i < count; i++) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, 4, serials[i]);
+  }
+
+  // Every callback is called for every change, even if one raises an error;
+  // the first error is kept at index 5 and raised once all are delivered.
+  lua_pushnil(L);
+  const char *events[] = {"remove", "add"};
+  int sets[][2] = { {3, 4}, {4, 3} };
+  for (int e = 0; e < 2; e++) {
+    lua_pushnil(L);
+    while (lua_next(L, sets[e][0]) != 0) {
+      lua_pop(L, 1);
+      if (lua_getfield(L, sets[e][1], lua_tostring(L, -1)) == LUA_TNIL) {
+        for (int i = 1; i <= luaL_len(L, 2); i++) {
+          lua_rawgeti(L, 2, i);
+          lua_pushstring(L, events[e]);
+          lua_pushvalue(L, -4);
+          if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+            if (lua_isnil(L, 5)) {
+              lua_replace(L, 5);
+            } else {
+              lua_pop(L, 1);
+            }
+          }
+        }
+        delivered++;
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  h->generation = generation;
+  lua_pushvalue(L, 4);
+  lua_setiuservalue(L, 1, 2);
+
+  if (!lua_isnil(L, 5)) {
+    lua_pushvalue(L, 5);
+    return -1;
+  }
+
+  return delivered;
+}
+
+/*
+ * Calls the callback for one event, if it still has one. The watched
+ * requests are at index 2 and the watched devices at index 3. Returns 1 if
+ * a callback was called.
+ */
+static int dispatchEvent(lua_State *L, eventkind kind, void *source) {
+  int base = lua_gettop(L);
+
+  if (kind == EVENT_REQUEST) {
+    if (lua_rawgetp(L, 2, source) == LUA_TNIL) {
+      lua_settop(L, base);
+      return 0;
+    }
+    lua_pushnil(L);
+    lua_rawsetp(L, 2, source);
+
+    // call the callback with what the request's result method returns
+    lua_getiuservalue(L, base + 1, 2);
+    lua_pushcfunction(L, lfun_requestResult);
+    lua_pushvalue(L, base + 1);
+    lua_call(L, 1, LUA_MULTRET);
+    lua_call(L, lua_gettop(L) - base - 2, 0);
+  } else {
+    if (lua_rawgetp(L, 3, source) == LUA_TNIL) {
+      lua_settop(L, base);
+      return 0;
+    }
+    lua_getiuservalue(L, base + 1, 1);
+    lua_pushvalue(L, base + 1);
+    lua_call(L, 1, 0);
+  }
+  lua_settop(L, base);
+
+  return 1;
+}
+
+/*** Delivers pending notifications to Lua callbacks.
+ *
+ * This function never blocks. Callbacks registered with <code>@{onhotplug}</code>
+ * are called for every device that has been plugged in or unplugged since the
+ * last call, then the <code>ondone</code> callbacks of requests that have finished
+ * and the <code>@{onanimationend}</code> callbacks of animations that have ended,
+ * in the order they did. Call it when the descriptor from <code>@{fd}</code> is
+ * readable, or simply every so often. If a hotplug callback raises an error,
+ * the other callbacks still see every change and the first error is raised
+ * once they have.
+ *
+ * @function dispatch
+ * @treturn int the number of notifications delivered
+ * @see onhotplug
+ * @see fd
+ *
+ */
+static int lfun_dispatch(lua_State *L) {
+  lua_settop(L, 0);
+  hotplug *h = getHotplug(L);
+  notifier *n = h->events;
+
+  if (n != NULL) {
+    atomic_store(&n->hotplug, 0);
+  }
+  int delivered = dispatchHotplug(L, h);
+  if (delivered < 0) {
+    // the events are still pending; leave the descriptor readable for them
+    if (n != NULL) {
+      signalNotifier(n);
+    }
+    return lua_error(L);
+  }
+
+  lua_settop(L, 1);
+  lua_getiuservalue(L, 1, 3);
+  lua_getiuservalue(L, 1, 4);
+
+  if (n != NULL) {
+    event *e;
+    int more;
+    while ((e = takeEvent(n, &more)) != NULL) {
+      eventkind kind = e->kind;
+      void *source = e->source;
+      free(e);
+
+      // if the callback raises an error, the rest is still signalled
+      if (more) {
+        signalNotifier(n);
+      }
+      delivered += dispatchEvent(L, kind, source);
+    }
+    settleNotifier(n);
+  }
+
+  lua_pushinteger(L, delivered);
+
+  return 1;
+}
+
+// blink1_enable_degamma is static so can't access ...
+// need to think of another approach...
+
+/****************************************************************************/
+
+/*** Lifecycle Methods
+ *
+ * @section Lifecycle
+ *
+ */
+
+/*** Turns the device off, then detaches it.
+ *
+ * Calling <code>close</code> does not delete the userdata, but any subsequent
+ * calls to this object will return <code>nil</code> and an error message.
+ *
+ * @function close
+ *
+ */
+static int lfun_close(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  closeBlinker(bd);
+
+  return 0;
+}
+
+static const char *getSerial(blinker *bd) {
+  const char *serial = bd->link.serial;
+  if (serial[0] == '\0') {
+    serial = "N/A";
+  }
+
+  return serial;
+}
+
+// TODO: can we document this?
+static int lfun_tostring(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  
+  if (bd->device == NULL && bd->link.fd < 0) {
+    lua_pushstring(L, DISCONNECTED_BLINK_MSG);
+  } else {
+    lua_pushfstring(L, BLINK_STRING_FMT,
+                    blink1_deviceTypeToStr(bd->link.type),
+                    getSerial(bd));
+  }
+
+  return 1;
+}
+
+/*** Informational Methods
+ *
+ * @section informational
+ *
+ */
+
+/*** Returns the firmware version of the device.
+ *
+ * @function version
+ * @treturn string firmware version number
+ *
+ */
+static int lfun_firmwareVersion(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  // According to comments in C code, it seems that blink1_getVersion
+  // _can_ return an error code, but what those error codes are is not
+  // documented.
+  int scaledVersion = blinker_getVersion(bd);
+  int major = scaledVersion / 100;
+  int minor = scaledVersion % 100;
+
+  char buf[20];
+  sprintf(buf, "%d.%02d", major, minor);
+  lua_pushstring(L, buf);
+
+  return 1;
+}
+
+/*** Returns the serial number of the device.
+ *
+ * @function serial
+ * @treturn string serial number
+ *
+ */
+static int lfun_serialNumber(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  lua_pushstring(L, getSerial(bd));
+
+  return 1;
+}
+
+/*** Returns true/false if the device is/isn't a Mark 2.
+ *
+ * @function isMk2
+ * @treturn boolean true if device is Mark 2, false otherwise
+ *
+ */
+static int lfun_isMk2(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  lua_pushboolean(L, bd->link.mk2);
+
+  return 1;
+}
+
+/*** Returns an integer indicating the version of the blink(1).
+ *
+ * This function returns 1 for a Mark 1 device 2 for Mark 2, etc.
+ *
+ * @function type
+ * @treturn int the version of the device
+ *
+ */
+static int lfun_type(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  lua_pushinteger(L, bd->link.type);
+
+  return 1;
+}
+
+/*** Returns the version of the blink(1) as a string.
+ *
+ * This will be <code>mk1</code>, <code>mk2</code>, <code>mk3</code>.
+ *
+ * @function typestring
+ * @treturn string the version of the device
+ *
+ */
+static int lfun_typestring(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  lua_pushstring(L, blink1_deviceTypeToStr(bd->link.type));
+  
+  return 1;
+}
+
+/*** Returns whether the device can be reached, and how often it was reopened.
+ *
+ * When several calls in a row fail, the device is taken to have been unplugged
+ * or reset, and is reopened by its serial number in the background, retrying
+ * at growing intervals. Once it is back, the pattern lines it held are written
+ * again and the pattern last played, or the colors last commanded, restored.
+ * Calls made in the meantime fail.
+ *
+ * @function connected
+ * @treturn boolean true if the device is open, false while it is being reopened or once closed
+ * @treturn int the number of times the device has been reopened
+ *
+ */
+static int lfun_connected(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  pthread_mutex_lock(&bd->io);
+  lua_pushboolean(L, bd->link.remote ? bd->link.fd >= 0 : bd->device != NULL);
+  lua_pushinteger(L, bd->reconnect.reconnects);
+  pthread_mutex_unlock(&bd->io);
+
+  return 2;
+}
+
+// /*** Color Methods.
+//  *
+//  * The <code>set</code> method will display the specified
+//  * RGB color on the device. This will set both of a Mark 2's LEDs
+//  * to the same color. If you only want to set one of the LEDs,
+//  * you need to use <code>fade</code>. The API does not have
+//  * a method to set just one of the LEDs on a Mark 2; you can fake it by using <code>fade</code>
+//  * with a very short duration.
+//  *
+//  * The color-specific methods, <code>black</code>,
+//  * <code>cyan</code>, <code>red</code>, etc. are implemented by
+//  * passing appropriate RGB values to <code>set</code>.
+//  *
+//  * <code>Get</code> method retrieves color information. Specifically, ...
+//  *
+//  * Dim and brighten...
+//  *
+//  * @section color
+//  *
+//  */
+
+/*
+ * Reads a color given either as three integers starting at <arg> or as a
+ * packed 3 byte string at <arg> into <cmd>. A string that converts to a
+ * number, like "100", is taken as the red value. Returns the index of the
+ * argument after the color.
+ */
+static int checkColor(lua_State *L, int arg, command *cmd) {
+  if (lua_type(L, arg) == LUA_TSTRING && !lua_isnumber(L, arg)) {
+    size_t len;
+    const uint8_t *rgb = (const uint8_t *)lua_tolstring(L, arg, &len);
+    luaL_argcheck(L, (len == PACKED_COLOR_LEN), arg, BADPACKEDCOLOR_MSG);
+
+    cmd->r = rgb[0];
+    cmd->g = rgb[1];
+    cmd->b = rgb[2];
+    return arg + 1;
+  }
+
+  int r = luaL_checkinteger(L, arg);
+  int g = luaL_checkinteger(L, arg + 1);
+  int b = luaL_checkinteger(L, arg + 2);
+
+  luaL_argcheck(L, ( -1 < r && r < 256), arg, BADRED_MSG);
+  luaL_argcheck(L, ( -1 < g && g < 256), arg + 1, BADGREEN_MSG);
+  luaL_argcheck(L, ( -1 < b && b < 256), arg + 2, BADBLUE_MSG);
+
+  cmd->r = r;
+  cmd->g = g;
+  cmd->b = b;
+  return arg + 3;
+}
+
+/*** Color Methods.
+ *
+ * @section color
+ *
+ */
+ 
+/*** Sets the device to the given RGB value.
+ *
+ * Wherever a method takes r, g and b, the color may instead be given as a
+ * single 3 byte string of the red, green and blue values, e.g.
+ * <code>d:set('\255\0\0')</code>.
+ *
+ * @function set
+ * @tparam int r red value in range [0-255]
+ * @tparam int g green value in range [0-255]
+ * @tparam int b blue value in range [0-255]
+ * @treturn bool true if the color is set
+ * @raise error if either r, g, or b not in the correct range
+ *
+ */
+static int lfun_setRGB(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd;
+  checkColor(L, 2, &cmd);
+
+  int result = submitColor(bd, 1, 0, cmd.r, cmd.g, cmd.b, 0);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not set RGB");
+    return 2;
+  }
+}
+
+static int lfun_groupSetRGB(lua_State *L);
+
+#define SET(Color, r, g, b) \
+  static int lfun_set##Color(lua_State *L) { \
+    lua_settop(L, 1);        \
+    lua_pushinteger(L, (r)); \
+    lua_pushinteger(L, (g)); \
+    lua_pushinteger(L, (b)); \
+    return lfun_setRGB(L);   \
+  }                          \
+  static int lfun_groupSet##Color(lua_State *L) { \
+    lua_settop(L, 1);        \
+    lua_pushinteger(L, (r)); \
+    lua_pushinteger(L, (g)); \
+    lua_pushinteger(L, (b)); \
+    return lfun_groupSetRGB(L); \
+  }
+
+/// Turns the device off. Equivalent to <code>set(0, 0, 0)</code>
+// @function black
+SET(Black, 0, 0, 0)
+
+/// Turns the device blue. Equivalent to <code>set(0, 0, 255)</code>
+// @function blue
+SET(Blue, 0, 0, 255)
+
+/// Turns the device cyan. Equivalent to <code>set(0, 255, 255)</code>
+// @function cyan
+SET(Cyan, 0, 255, 255)
+
+/// Turns the device green. Equivalent to <code>set(0, 255, 0)</code>
+// @function green
+SET(Green, 0, 255, 0)
+
+/// Turns the device magenta. Equivalent to <code>set(255, 0, 255)</code>
+// @function magenta
+SET(Magenta, 255, 0, 255)
+
+/// Turns the device off. Equivalent to <code>set(0, 0, 0)</code>
+// @function off
+SET(Off, 0, 0, 0)
+
+/// Turns the device on. Equivalent to <code>set(255, 255, 255)</code>
+// @function on
+SET(On, 255, 255, 255)
+
+/// Turns the device orange. Equivalent to <code>set(255, 165, 0)</code>
+// @function orange
+SET(Orange, 255, 165, 0)
+
+/// Turns the device red. Equivalent to <code>set(255, 0, 0)</code>
+// @function red
+SET(Red, 255, 0, 0)
+
+/// Turns the device on. Equivalent to <code>set(255, 255, 255)</code>
+// @function white
+SET(White, 255, 255, 255)
+
+/// Turns the device yellow. Equivalent to <code>set(255, 255, 0)</code>
+// @function yellow
+SET(Yellow, 255, 255, 0)
+
+/*** Dims the color displayed by the device.
+ *
+ * The brightest of red, green and blue is lowered by an eighth of the range and
+ * the others in proportion, so the hue doesn't change.
+ *
+ * @function dim
+ * @see brighten
+ * @treturn boolean true if successful | false and an error description if not
+ *
+ */
+static int lfun_dim(lua_State *L) { 
+  // TODO: need to specify which LED?
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  if (blinker_dim(bd) != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not dim");
+    return 2;
+  }
+}
+
+/*** Brightens the color displayed by the device.
+ *
+ * The opposite of <code>dim</code>; a device that is off stays off.
+ *
+ * @function brighten
+ * @see dim
+ * @treturn boolean true if successful | false and an error description if not
+ *
+ */
+static int lfun_brighten(lua_State *L) {
+  // TODO: need to specify which LED?
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  if (blinker_brighten(bd) != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not brighten");
+    return 2;
+  }
+}
+
+/*
+ * Returns the number at <key> in the options table at <idx>, or <dflt> if it
+ * is absent. Clears *ok if the value is not a number in [<lo>, <hi>].
+ */
+static double getLevelField(lua_State *L, int idx, const char *key, double dflt, double lo, double hi, int *ok) {
+  int isnum = 1;
+  double value = dflt;
+
+  if (lua_getfield(L, idx, key) != LUA_TNIL) {
+    value = lua_tonumberx(L, -1, &isnum);
+  }
+  lua_pop(L, 1);
+
+  if (!isnum || value < lo || value > hi) {
+    *ok = 0;
+  }
+
+  return value;
+}
+
+/*** Sets how the colors sent to this device are corrected.
+ *
+ * Every color set, faded to or written to the pattern is looked up in tables
+ * built by this call before it is sent: the level goes through a gamma curve
+ * and is then scaled by a factor for its channel, to even out the white
+ * balance of the LEDs. Other devices aren't affected. Without options, the
+ * device goes back to following <code>gamma</code> and <code>noGamma</code>.
+ *
+ * The options are:
+ * <ul>
+ * <li>gamma - true for blink1-lib's curve (the default), false for none, or an exponent in (0, 8]</li>
+ * <li>red, green, blue - the factor for each channel, in [0, 1]; 1 by default</li>
+ * </ul>
+ *
+ * Pattern lines read back from the device are as it holds them, that is after correction.
+ *
+ * @function calibrate
+ * @tparam[opt] table options
+ * @raise error if an option is out of range
+ * @treturn boolean true
+ *
+ */
+static int lfun_calibrate(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  if (lua_isnoneornil(L, 2)) {
+    pthread_mutex_lock(&bd->io);
+    bd->color.calibrated = 0;
+    pthread_mutex_unlock(&bd->io);
+
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  // 0 stands for blink1-lib's curve
+  int ok = 1;
+  double gamma = 0.0;
+  int type = lua_getfield(L, 2, "gamma");
+  if (type == LUA_TBOOLEAN) {
+    gamma = lua_toboolean(L, -1) ? 0.0 : 1.0;
+  } else if (type != LUA_TNIL) {
+    gamma = lua_tonumberx(L, -1, &ok);
+    ok = ok && gamma > 0.0 && gamma <= GAMMA_MAX;
+  }
+  lua_pop(L, 1);
+  luaL_argcheck(L, ok, 2, "gamma must be a boolean or a number in (0, 8]");
+
+  double scale[3];
+  scale[0] = getLevelField(L, 2, RED_KEY, 1.0, 0.0, 1.0, &ok);
+  scale[1] = getLevelField(L, 2, GREEN_KEY, 1.0, 0.0, 1.0, &ok);
+  scale[2] = getLevelField(L, 2, BLUE_KEY, 1.0, 0.0, 1.0, &ok);
+  luaL_argcheck(L, ok, 2, "red, green and blue must be numbers in [0, 1]");
+
+  // built outside the lock so writes aren't held up
+  correction cc;
+  calibrate(&cc, gamma, scale);
+
+  pthread_mutex_lock(&bd->io);
+  bd->color = cc;
+  pthread_mutex_unlock(&bd->io);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*** Fades device to given RGB over given number of milliseconds.
+ *
+ * You can specify either the top, bottom, or both LEDs to fade.
+ *
+ * @function fade
+ * @int millis the fade duration
+ * @int red the red component [0-255]
+ * @int green the green component [0-255]
+ * @int blue the blue component [0-255]
+ * @int n which LED to adjust; 0 - both; 1 - top; 2 - bottom
+ * @raise error if a value is out of range
+ */
+static int lfun_fadeToRGB(lua_State *L) {
+  // TODO: consider re-arranging paramaeter order to make it more sensible
+  // and to allow for default params
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd;
+  int millis = luaL_checkinteger(L, 2);
+  int ledArg = checkColor(L, 3, &cmd);
+  int nLed = luaL_optinteger(L, ledArg, 0);
+  int r = cmd.r, g = cmd.g, b = cmd.b;
+
+  luaL_argcheck(L, ( -1 < millis && millis < 65536), 2, "millis must be in range [0, 65535]");
+  luaL_argcheck(L, ( -1 < nLed && nLed <= LED_COUNT), ledArg, "led must be 0, 1 or 2");
+
+  int result = submitColor(bd, 0, millis, r, g, b, nLed);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+
+    return 1;
+  } else {
+    char msg[256];
+    sprintf(msg, "Could not fade to (%d, %d, %d)", r, g, b);
+
+    lua_pushnil(L);
+    lua_pushstring(L, msg);
+
+    return 2;
+  }
+}
+
+/*
+ * Reads integer field <key> from the table at <idx>, returning <def> if the field is absent.
+ * Sets *ok to 0 if the field is present but is not an integer.
+ */
+static lua_Integer getIntField(lua_State *L, int idx, const char *key, lua_Integer def, int *ok) {
+  lua_Integer value = def;
+
+  if (lua_getfield(L, idx, key) != LUA_TNIL) {
+    int isint;
+    value = lua_tointegerx(L, -1, &isint);
+    if (!isint) {
+      *ok = 0;
+    }
+  }
+  lua_pop(L, 1);
+
+  return value;
+}
+
+/*
+ * Reads the argument to get: either an optional LED number or a table with
+ * optional led, refresh and packed fields. <packed> may be NULL.
+ */
+static int checkLedSpec(lua_State *L, int idx, int *refresh, int *packed) {
+  int nLed = 0;
+  *refresh = 0;
+
+  if (lua_istable(L, idx)) {
+    int ok = 1;
+    nLed = getIntField(L, idx, LED_KEY, 0, &ok);
+    luaL_argcheck(L, ok, idx, "led must be an integer");
+    lua_getfield(L, idx, REFRESH_KEY);
+    *refresh = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (packed != NULL) {
+      lua_getfield(L, idx, PACKED_KEY);
+      *packed = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+  } else {
+    nLed = luaL_optinteger(L, idx, 0);
+  }
+  luaL_argcheck(L, (-1 < nLed && nLed <= LED_COUNT), idx, "led must be 0, 1 or 2");
+
+  return nLed;
+}
+
+/*** Returns the current RGB value for the given device.
+ *
+ * If you specify 0, 1 or no LED, it retrieves the first LED.
+ * If you specify 2, it returns the second LED.
+ *
+ * The library remembers the last color it commanded for each LED (including
+ * any fade in progress), so normally this does not talk to the device at all.
+ * The remembered value is the color as requested, before gamma correction.
+ * Pass a table with <code>refresh = true</code> to read the color back from the
+ * device instead. If the device still shows what was sent, that is the color
+ * requested; otherwise it is the device's color with the correction undone, as
+ * closely as it can be.
+ * With <code>packed = true</code> in the table, the color is returned as a 3 byte
+ * string, followed by the fade millis.
+ * The device is also read whenever the color is unknown, e.g. just after
+ * the device was opened or while a pattern is playing.
+ *
+ * @function get
+ * @tparam[opt] ?int|table n the LED to retrieve, or a table with optional
+ *   <code>led</code>, <code>refresh</code> and <code>packed</code> fields
+ * @treturn int red value [0, 255]
+ * @treturn int green value [0, 255]
+ * @treturn int blue value [0, 255]
+ * @treturn int last fade millis value
+ *
+ */
+static int lfun_readRGB(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int refresh, packed = 0;
+  int nLed = checkLedSpec(L, 2, &refresh, &packed);
+  
+  uint16_t millis;
+  uint8_t r, g, b;
+
+  int result = blinker_currentRGB(bd, &millis, &r, &g, &b, nLed, refresh);
+
+  if (result != BLINK1_ERR && packed) {
+    lua_pushlstring(L, (const char *)(uint8_t[]){ r, g, b }, PACKED_COLOR_LEN);
+    lua_pushinteger(L, millis);
+    return 2;
+  } else if (result != BLINK1_ERR) {
+    lua_pushinteger(L, r);
+    lua_pushinteger(L, g);
+    lua_pushinteger(L, b);
+    lua_pushinteger(L, millis);
+    return 4;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, BAD_RETRIEVAL_MSG);
+    return 2;
+  }
+}
+
+/*** Pattern Methods
+ *
+ * @section pattern
+ *
+ */
+ 
+/*** Plays the current pattern.
+ *
+ * Optionally specify a sub-range to play, as
+ * well as an optional count (0 = loop forever).
+ *
+ * @function play
+ * @tparam[opt] int count the number of times to play
+ * @tparam[opt] int start the starting position
+ * @tparam[opt] int stop the end position
+ *
+ */
+static int lfun_play(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  int count = luaL_optinteger(L, 2, 0);
+  int startpos = luaL_optinteger(L, 3, 0);
+  int endpos = luaL_optinteger(L, 4, 0);
+
+  // TODO: adjust upper bound based on whether mk1, mk2, etc.
+  luaL_argcheck(L, ( -1 < startpos && startpos < 32), 3, "starting position must be in range [0, 32)");
+  luaL_argcheck(L, ( -1 < endpos && endpos < 32), 4, "ending position must be in range [0, 32)");
+  luaL_argcheck(L, ( startpos <= endpos ), 3, "start position must be before end position");
+  luaL_argcheck(L, ( count > -1), 2, "count must be non-negative");
+  
+  int result = blinker_playloop(bd, PATTERNPLAY_START, startpos, endpos, count);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "error starting play.");
+    return 2;
+  }
+}
+
+/*** Stops playing the current pattern.
+ *
+ * @function stop
+ *
+ */
+static int lfun_stop(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  int result = blinker_playloop(bd, PATTERNPLAY_STOP, 0, 0, 0);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "Error stopping play.");
+    return 2;
+  }
+}
+
+/*** Retrieves information on current play state.
+ *
+ * Displays information about the pattern loaded into the device.
+ * The <code>count</code> value decreases by one each time the pattern
+ * repeats and is 0 when the pattern has played the specified number
+ * of times &mdash; unless the count was 0 when the play command was issued;
+ * in which case, the pattern repeats indefinitely and count is always 0.
+ *
+ * @function readplay
+ * @treturn bool true if pattern is playing
+ * @treturn int start position
+ * @treturn int end position
+ * @treturn int count
+ * @treturn int current position
+ *
+*/
+static int lfun_readplay(lua_State *L) {
+  // NOTE: playcount counts down to 0 -- unless it started at 0
+  // TODO: document the return value(s).
+  // TODO: maybe return as a table instead ?
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  uint8_t playing;
+  uint8_t playstart;
+  uint8_t playend;
+  uint8_t playcount;
+  uint8_t playpos;
+
+  int result = blinker_readPlayState(bd, &playing, &playstart,
+                                    &playend, &playcount, &playpos);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, playing);
+    lua_pushinteger(L, playstart);
+    lua_pushinteger(L, playend);
+    lua_pushinteger(L, playcount);
+    lua_pushinteger(L, playpos);
+    return 5;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not retrieve playstate");
+    return 2;
+  }
+}
+
+/*** Write pattern description for specified position.
+ *
+ * @function setpattpos
+ * @tparam int millis the length of time to display
+ * @tparam int r the red value to display
+ * @tparam int g the green value to display
+ * @tparam int b the blue value to display
+ * @tparam int pos the position to set
+ *
+ */
+static int lfun_setPatternPosition(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd;
+
+  int millis = luaL_checkinteger(L, 2);
+  int posArg = checkColor(L, 3, &cmd);
+  int pos = luaL_checkinteger(L, posArg);
+
+  luaL_argcheck(L, ( -1 < millis && millis < 32768), 2, "milliseconds must be in range [0, 32768]");
+  // TODO: make upper bound dependent on whether it's a mk2, etc
+  luaL_argcheck(L, ( -1 < pos && pos < 32 ), posArg, "position must be in range [0, 32)");
+
+
+  int result = blinker_writePatternLine(bd, &(patternslot){ millis, cmd.r, cmd.g, cmd.b, 0 }, pos);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    // TODO: add pos to error message
+    lua_pushstring(L, "Could not write pattern line");
+    return 2;
+  }
+}
+
+/*** Read pattern description at specified position.
+ *
+ * @function getpattpos
+ * @tparam int pos the position to read
+ * @treturn int millis the length of time to display
+ * @treturn int r the red value displayed
+ * @treturn int g the green value displayed
+ * @treturn int b the blue value displayed
+ *
+ */
+static int lfun_getPatternPosition(lua_State *L) {
+  // TODO: return value as table?
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  
+  int pos = luaL_checkinteger(L, 2);
+  // TODO: make upper bound dependent on whether it's a mk2, etc
+  luaL_argcheck(L, ( -1 < pos && pos < 32), 2, "position must be in range [0, 32)");
+
+  patternslot slot;
+
+  int result = blinker_readPatternLine(bd, &slot, pos);
+
+  if (result != BLINK1_ERR) {
+    lua_pushinteger(L, pos);
+    lua_pushinteger(L, slot.millis);
+    lua_pushinteger(L, slot.r);
+    lua_pushinteger(L, slot.g);
+    lua_pushinteger(L, slot.b);
+    return 5;
+  } else {
+    lua_pushnil(L);
+    // TODO: add pos to error message
+    lua_pushstring(L, "Could not read pattern line");
+    return 2;
+  }
+}
+
+/*
+ * Pushes nil, an error message made from <fmt> and the slots in <failed>, and a
+ * table of those slot positions.
+ */
+static int pushPatternFailures(lua_State *L, const char *fmt, uint32_t failed) {
+  char positions[PATTERN_SLOTS * 4 + 1] = "";
+  int n = 0;
+
+  lua_pushnil(L);
+  lua_createtable(L, PATTERN_SLOTS, 0);
+  for (int pos = 0; pos < PATTERN_SLOTS; pos++) {
+    if (failed & (1u << pos)) {
+      lua_pushinteger(L, pos);
+      lua_rawseti(L, -2, ++n);
+      sprintf(positions + strlen(positions), " %d", pos);
+    }
+  }
+  lua_pushfstring(L, fmt, positions);
+  lua_insert(L, -2);
+
+  return 3;
+}
+
+/*
+ * Reads the pattern table at <idx> into <slots>, returning the number of entries.
+ * Throws an error if the pattern is malformed.
+ */
+static int checkPattern(lua_State *L, int idx, patternslot *slots) {
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    size_t len;
+    const uint8_t *line = (const uint8_t *)lua_tolstring(L, idx, &len);
+    luaL_argcheck(L, (len % PACKED_LINE_LEN == 0 && len <= PATTERN_SLOTS * PACKED_LINE_LEN), idx, BADPACKEDPATTERN_MSG);
+
+    int n = len / PACKED_LINE_LEN;
+    int bad = unpackLines(line, n, slots);
+    if (bad > -1) {
+      return luaL_error(L, BADPATTERNLINE_MSG, bad, "led must be 0, 1 or 2");
+    }
+
+    return n;
+  }
+
+  luaL_checktype(L, idx, LUA_TTABLE);
+  int n = luaL_len(L, idx);
+  luaL_argcheck(L, (n <= PATTERN_SLOTS), idx, "pattern must have at most 32 entries");
+
+  for (int i = 0; i < n; i++) {
+    int ok = 1;
+    lua_rawgeti(L, idx, i + 1);
+    if (!lua_istable(L, -1)) {
+      return luaL_error(L, BADPATTERNLINE_MSG, i, "entry must be a table");
+    }
+
+    lua_Integer millis = getIntField(L, -1, MILLIS_KEY, 0, &ok);
+    lua_Integer r = getIntField(L, -1, RED_KEY, 0, &ok);
+    lua_Integer g = getIntField(L, -1, GREEN_KEY, 0, &ok);
+    lua_Integer b = getIntField(L, -1, BLUE_KEY, 0, &ok);
+    lua_Integer led = getIntField(L, -1, LED_KEY, 0, &ok);
+    lua_pop(L, 1);
+
+    if (!ok) { return luaL_error(L, BADPATTERNLINE_MSG, i, "fields must be integers"); }
+    if (millis < 0 || millis > 65535) { return luaL_error(L, BADPATTERNLINE_MSG, i, "millis must be in range [0, 65535]"); }
+    if (r < 0 || r > 255) { return luaL_error(L, BADPATTERNLINE_MSG, i, BADRED_MSG); }
+    if (g < 0 || g > 255) { return luaL_error(L, BADPATTERNLINE_MSG, i, BADGREEN_MSG); }
+    if (b < 0 || b > 255) { return luaL_error(L, BADPATTERNLINE_MSG, i, BADBLUE_MSG); }
+    if (led < 0 || led > LED_COUNT) { return luaL_error(L, BADPATTERNLINE_MSG, i, "led must be 0, 1 or 2"); }
+
+    slots[i] = (patternslot){ (uint16_t)millis, (uint8_t)r, (uint8_t)g, (uint8_t)b, (uint8_t)led };
+  }
+
+  return n;
+}
+
+/*
+ * Reads the options table of readpattern at <idx>, if present, into <cmd>.
+ * An expected pattern is stored in cmd->slots.
+ */
+static void checkReadOptions(lua_State *L, int idx, command *cmd) {
+  if (lua_isnoneornil(L, idx)) {
+    return;
+  }
+
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, PACKED_KEY);
+  cmd->packed = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, idx, EXPECTED_KEY) != LUA_TNIL) {
+    cmd->nslots = checkPattern(L, lua_gettop(L), cmd->slots);
+    cmd->diff = 1;
+  }
+  lua_pop(L, 1);
+}
+
+/*
+ * Pushes the pattern read by <t>: a table, or a string if packed was asked
+ * for. When diffing, pushes instead a table of just the positions whose lines
+ * differ from the expected pattern, each mapped to the line read, or to false
+ * if the line could not be read.
+ */
+static void pushPatternRead(lua_State *L, const task *t) {
+  const command *c = t->cmd;
+
+  if (!c->diff) {
+    if (c->packed) {
+      pushPackedPattern(L, t->slots, t->nslots);
+    } else {
+      pushPattern(L, t->slots, t->nslots, 0);
+    }
+    return;
+  }
+
+  lua_createtable(L, 0, 0);
+  for (int pos = 0; pos < t->nslots; pos++) {
+    if (t->failed & (1u << pos)) {
+      lua_pushboolean(L, 0);
+    } else if (t->differs & (1u << pos)) {
+      pushPatternLine(L, &t->slots[pos]);
+    } else {
+      continue;
+    }
+    lua_rawseti(L, -2, pos);
+  }
+}
+
+/*** Clears the entire pattern.
+ *
+ * @function clearpattern
+ * @treturn int the number of pattern lines sent to the device | nil, an error message,
+ *   and a table of the positions that could not be cleared
+ *
+ */
+static int lfun_clearPattern(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  patternslot blank[PATTERN_SLOTS];
+  uint32_t failed;
+
+  memset(blank, 0, sizeof(blank));
+  int sent = blinker_uploadPattern(bd, blank, 0, bd->patternSlots, 0, &failed);
+
+  if (failed != 0) {
+    return pushPatternFailures(L, PATTERNWRITEERR_MSG, failed);
+  }
+
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
+/*** Returns the devices pattern in a Lua table.
+ *
+ * This function returns a description of the current pattern in the
+ * device's RAM. The description is formatted as a Lua table with each
+ * table entry itself a sub-table describing the color details at a particular position.
+ * This sub-table has entries for the red, green and blue components, the time
+ * (in milliseconds) to display the color, and the LED the line applies to (0 for both).
+ * Position 0 is at index 0, position 1 at index 1, etc. There is one entry
+ * per line of the device's pattern RAM: 32 on a mk2 or mk3, 12 on a mk1.
+ * All lines are read back to back, without other commands to the device in between.
+ *
+ * Pass a table with <code>packed = true</code> to get the pattern as a string
+ * of 6 byte lines instead, one per position, each as packed by
+ * <code>string.pack('>I2BBBB', millis, red, green, blue, led)</code>.
+ * <code>@{writepattern}</code> accepts the same format.
+ *
+ * To check a device's pattern, pass the pattern it should hold as
+ * <code>expected</code>, in any format <code>@{writepattern}</code> accepts. Only
+ * the positions in the expected pattern are read, and the result is a table with
+ * an entry only for each position whose line differs, mapped to the line read, or
+ * to <code>false</code> if the line could not be read. An empty table means the
+ * device holds the expected pattern.
+ *
+ * @function readpattern
+ * @tparam[opt] table options a table with optional <code>packed</code> and
+ *   <code>expected</code> fields
+ * @treturn table|string the current pattern, or the differences from the expected
+ *   pattern | nil, an error message, and a table of the positions that could not be read
+ * @see writepattern
+ *
+ */
+static int lfun_readPattern(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd = { .op = OP_READPATTERN };
+  checkReadOptions(L, 2, &cmd);
+
+  task t = { .bd = bd, .cmd = &cmd };
+  runTask(&t);
+
+  if (t.result == BLINK1_ERR) {
+    return pushPatternFailures(L, PATTERNREADERR_MSG, t.failed);
+  }
+
+  pushPatternRead(L, &t);
+  return 1;
+}
+
+/*** Writes a pattern into the device's RAM.
+ *
+ * The pattern is a table in the format returned by <code>@{readpattern}</code>,
+ * except that Lua table indices are 1-based: <code>t[1]</code> is written to pattern
+ * position 0, etc. Missing fields default to 0; in particular a line without an
+ * <code>led</code> field applies to both LEDs. The pattern may also be a string
+ * of packed lines, as returned by <code>readpattern{packed = true}</code>.
+ *
+ * The library remembers what it last wrote to (or read from) each pattern position,
+ * and only sends positions whose contents have changed. Pass <code>true</code> as
+ * the second argument to rewrite every position regardless.
+ *
+ * @function writepattern
+ * @tparam table|string pattern the pattern to write; at most 32 entries
+ * @tparam[opt] boolean force rewrite positions even if they appear unchanged
+ * @treturn int the number of pattern lines sent to the device | nil, an error message,
+ *   and a table of the positions that could not be written
+ * @raise error if the pattern is malformed
+ * @see readpattern
+ *
+ */
+static int lfun_writePattern(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  patternslot slots[PATTERN_SLOTS];
+  int n = checkPattern(L, 2, slots);
+  int force = lua_toboolean(L, 3);
+
+  uint32_t failed;
+  int sent = blinker_uploadPattern(bd, slots, 0, n, force, &failed);
+
+  if (failed != 0) {
+    return pushPatternFailures(L, PATTERNWRITEERR_MSG, failed);
+  }
+
+  lua_pushinteger(L, sent);
+  return 1;
+}
+ 
+/*** Saves pattern from RAM into flash.
+ *
+ * @function savepattern
+ * @treturn boolean returns true if the pattern saved or nil and an error message otherwise
+ *
+ */
+static int lfun_savePattern(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  
+  int result = blinker_savePattern(bd);
+
+  if (result != BLINK1_ERR) {
+    lua_pushboolean(L, 1);
+    return 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "Error saving pattern.");
+    return 2;
+  }
+}
+
+/*** Writes a pattern string into the device's RAM.
+ *
+ * The pattern string is in the format accepted by <code>@{parsepattern}</code>. It
+ * replaces the entire pattern: positions after the last line of the string are cleared.
+ * Parsed pattern strings are cached, so setting the same string again costs only
+ * the upload of whichever positions have changed on the device. The repeat count is
+ * kept for <code>@{getpatternstring}</code> to return; pass it to <code>@{play}</code>
+ * to play the pattern that many times.
+ *
+ * @function setpatternstring
+ * @string pattern the pattern string
+ * @tparam[opt] boolean force rewrite positions even if they appear unchanged
+ * @treturn int the number of pattern lines sent to the device | nil, an error message,
+ *   and a table of the positions that could not be written
+ * @raise error if the pattern string is malformed
+ * @see getpatternstring
+ *
+ */
+static int lfun_setPatternString(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int force = lua_toboolean(L, 3);
+  const compiledpattern *cp = checkPatternString(L, 2);
+  patternslot slots[PATTERN_SLOTS];
+
+  memcpy(slots, cp->slots, cp->n * sizeof(patternslot));
+  memset(slots + cp->n, 0, (PATTERN_SLOTS - cp->n) * sizeof(patternslot));
+
+  uint32_t failed;
+  int sent = blinker_uploadPattern(bd, slots, 0, bd->patternSlots, force, &failed);
+
+  pthread_mutex_lock(&bd->io);
+  bd->patternRepeats = cp->repeats;
+  pthread_mutex_unlock(&bd->io);
+
+  if (failed != 0) {
+    return pushPatternFailures(L, PATTERNWRITEERR_MSG, failed);
+  }
+
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
+/*** Returns the device's pattern as a pattern string.
+ *
+ * Trailing cleared positions are left out. The repeat count is the one given to
+ * the last <code>@{setpatternstring}</code>, or 0; the device itself doesn't keep one.
+ * Positions whose contents the library already knows (because it wrote or read them)
+ * are not read from the device unless <code>refresh</code> is true.
+ *
+ * @function getpatternstring
+ * @tparam[opt] boolean refresh read every position from the device
+ * @treturn string the pattern string | nil and an error message
+ * @see setpatternstring
+ *
+ */
+static int lfun_getPatternString(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int refresh = lua_toboolean(L, 2);
+  patternslot slots[PATTERN_SLOTS];
+  int n = 0;
+
+  pthread_mutex_lock(&bd->io);
+  int repeats = bd->patternRepeats;
+  pthread_mutex_unlock(&bd->io);
+
+  for (int pos = 0; pos < bd->patternSlots; pos++) {
+    patternslot *slot = &slots[pos];
+
+    pthread_mutex_lock(&bd->io);
+    int known = !refresh && (bd->patternKnown & (1u << pos));
+    if (known) {
+      *slot = bd->pattern[pos];
+    }
+    pthread_mutex_unlock(&bd->io);
+
+    if (!known && blinker_readPatternLine(bd, slot, pos) == BLINK1_ERR) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "could not read pattern line %d", pos);
+      return 2;
+    }
+    if (slot->millis != 0 || slot->r != 0 || slot->g != 0 || slot->b != 0 || slot->led != 0) {
+      n = pos + 1;
+    }
+  }
+
+  luaL_Buffer buf;
+  luaL_buffinit(L, &buf);
+  lua_pushinteger(L, repeats);
+  luaL_addvalue(&buf);
+  for (int pos = 0; pos < n; pos++) {
+    char line[32];
+    snprintf(line, sizeof(line), ",#%02x%02x%02x,%g,%d", slots[pos].r, slots[pos].g, slots[pos].b,
+             slots[pos].millis / 1000.0, slots[pos].led);
+    luaL_addstring(&buf, line);
+  }
+  luaL_pushresult(&buf);
+
+  return 1;
+}
+
+/*** Animation Methods
+ *
+ * @section animation
+ *
+ */
 
 /*
- * NOTE: Most of the Blink1 library functions _claim_ to return -1 on error, and 0 on
- *       success. This doesn't seem to be true. As best I can tell, they do all return -1
- *       on error; but testing (on OS X 10.9.4) shows most (I didn't test all) of the functions
- *       return 9 on success.
+ * Fills in <k> from the keyframe table at <idx>. Returns NULL on success or
+ * a description of what is wrong with the keyframe.
+ */
+static const char *readKeyframe(lua_State *L, int idx, keyframe *k) {
+  int ok = 1;
+
+  if (!lua_istable(L, idx)) {
+    return "keyframe must be a table";
+  }
+
+  lua_Integer millis = getIntField(L, idx, MILLIS_KEY, 0, &ok);
+  lua_Integer r = getIntField(L, idx, RED_KEY, 0, &ok);
+  lua_Integer g = getIntField(L, idx, GREEN_KEY, 0, &ok);
+  lua_Integer b = getIntField(L, idx, BLUE_KEY, 0, &ok);
+  lua_Integer led = getIntField(L, idx, LED_KEY, 0, &ok);
+  lua_Integer wait = getIntField(L, idx, WAIT_KEY, 0, &ok);
+
+  if (!ok) { return "fields must be integers"; }
+  if (millis < 0 || millis > 65535) { return "millis must be in range [0, 65535]"; }
+  if (r < 0 || r > 255) { return BADRED_MSG; }
+  if (g < 0 || g > 255) { return BADGREEN_MSG; }
+  if (b < 0 || b > 255) { return BADBLUE_MSG; }
+  if (led < 0 || led > 2) { return "led must be 0, 1 or 2"; }
+  if (wait < 0 || wait > UINT32_MAX) { return "wait must be >= 0"; }
+
+  k->millis = (uint16_t)millis;
+  k->r = (uint8_t)r;
+  k->g = (uint8_t)g;
+  k->b = (uint8_t)b;
+  k->led = (uint8_t)led;
+  k->wait = (uint32_t)wait;
+
+  return NULL;
+}
+
+/*
+ * Reads the timeline at <idx>, to be played <count> times, into a new array
+ * of keyframes, storing their number in <nframes>. Raises an error, blaming
+ * argument <arg>, if the timeline is malformed.
+ */
+static keyframe *checkTimeline(lua_State *L, int idx, int arg, int count, int *nframes) {
+  int n = luaL_len(L, idx);
+  luaL_argcheck(L, (n > 0), arg, EMPTYTIMELINE_MSG);
+
+  keyframe *frames = malloc(n * sizeof(keyframe));
+  if (frames == NULL) {
+    luaL_error(L, "out of memory");
+    return NULL;
+  }
+
+  uint64_t period = 0;
+  for (int i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    const char *problem = readKeyframe(L, -1, &frames[i]);
+    lua_pop(L, 1);
+
+    if (problem != NULL) {
+      free(frames);
+      luaL_error(L, BADTIMELINE_MSG, i + 1, problem);
+      return NULL;
+    }
+    period += frames[i].wait;
+  }
+
+  if (count == 0 && period == 0) {
+    free(frames);
+    luaL_argerror(L, arg, ENDLESSTIMELINE_MSG);
+    return NULL;
+  }
+
+  *nframes = n;
+  return frames;
+}
+
+/*** Plays a timeline of keyframes in the background.
  *
- *       On a related note, given the way the blink1 and hid code is written, it is not currently
- *       possible to retrieve meaningful error codes/messages on error. So we are left knowing
- *       only that an error occured. It's not clear to me that knowing more specifics would be
- *       useful, however.
+ * The timeline is an array of keyframes, each a table with the same
+ * <code>millis</code>, <code>red</code>, <code>green</code> and <code>blue</code>
+ * fields used by <code>@{readpattern}</code>, plus an optional <code>led</code>
+ * (0 - both, 1 - top, 2 - bottom) and an optional <code>wait</code>: the number of
+ * milliseconds to pause after starting this keyframe before starting the next one.
+ * A keyframe with <code>millis</code> of 0 simply sets the color.
+ *
+ * The timeline is played by a thread owned by the device, on deadlines measured from
+ * the start of the animation, so this method returns immediately and the calling Lua
+ * code keeps running. Calling <code>animate</code> again replaces the current animation,
+ * and starting an animation stops any <code>@{stream}</code>.
+ *
+ * For example, this is the glimmer effect from the blink1-tool:
+ *
+ * <code>d:animate({ {millis=300, red=120, led=1}, {millis=300, red=60, led=2, wait=250},
+ * {millis=300, red=60, led=1}, {millis=300, red=120, led=2, wait=250} }, 5)</code>
+ *
+ * @function animate
+ * @tparam table timeline array of keyframes
+ * @tparam[opt] int count the number of times to play the timeline; 0 = loop forever; defaults to 1
+ * @treturn boolean true if the animation was started | nil and an error description if not
+ * @raise error if the timeline is malformed
+ * @see stopanimation
  *
  */
+static int lfun_animate(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int count = luaL_optinteger(L, 3, 1);
+  luaL_argcheck(L, (count > -1), 3, "count must be non-negative");
 
-/************************************************************************************
+  int nframes;
+  keyframe *frames = checkTimeline(L, 2, 2, count, &nframes);
+
+  setStream(bd, NULL, 0, 0, 0, 0, 0);
+  if (setTimeline(bd, frames, nframes, count) != 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, NOTHREAD_MSG);
+    return 2;
+  }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*** Plays a timeline from the device's pattern RAM.
  *
- * Functions
+ * The timeline is compiled as by <code>compiletimeline</code>, written to the pattern
+ * lines starting at <code>start</code> (skipping lines the device already holds) and
+ * played there, so it keeps playing with no help from the host. Any animation,
+ * stream or pattern already playing is stopped first.
  *
- ************************************************************************************/
+ * @function playtimeline
+ * @tparam table timeline array of keyframes, as for <code>@{animate}</code>
+ * @tparam[opt] int count the number of times to play the timeline; 0 = loop forever; defaults to 1
+ * @tparam[opt] int start the first pattern line to use; defaults to 0
+ * @treturn table the report from <code>compiletimeline</code>, with the <code>start</code>
+ *   and <code>end</code> lines played and the number of lines <code>sent</code> | nil, an
+ *   error message and a table of the positions that could not be written
+ * @raise error if the timeline is malformed or can't be made to fit
+ * @see compiletimeline
+ *
+ */
+static int lfun_playTimeline(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int count = luaL_optinteger(L, 3, 1);
+  int start = luaL_optinteger(L, 4, 0);
+  luaL_argcheck(L, (count > -1 && count <= MAX_PLAY_COUNT), 3, "count must be in range [0, 255]");
+  luaL_argcheck(L, (start > -1 && start < bd->patternSlots), 4, "start must be a pattern line of the device");
 
-// /*** Class Methods.
-//  *
-//  * @section class
-//  *
-//  */
+  patternplan p;
+  checkTimelinePlan(L, 2, count, bd->patternSlots - start, &p);
 
-/*** Returns the number of attached blink(1) devices.
+  patternslot slots[PATTERN_SLOTS];
+  for (int i = 0; i < p.n; i++) {
+    slots[i] = p.lines[i].slot;
+  }
+
+  setTimeline(bd, NULL, 0, 0);
+  setStream(bd, NULL, 0, 0, 0, 0, 0);
+  blinker_playloop(bd, PATTERNPLAY_STOP, 0, 0, 0);
+
+  uint32_t failed;
+  int sent = blinker_uploadPattern(bd, slots, start, p.n, 0, &failed);
+  if (failed != 0) {
+    return pushPatternFailures(L, PATTERNWRITEERR_MSG, failed);
+  }
+
+  if (blinker_playloop(bd, PATTERNPLAY_START, start, start + p.n - 1, p.count) == BLINK1_ERR) {
+    lua_pushnil(L);
+    lua_pushstring(L, "error starting play.");
+    return 2;
+  }
+
+  pushCompileReport(L, &p);
+  setIntegerField(L, "start", start);
+  setIntegerField(L, "end", start + p.n - 1);
+  setIntegerField(L, "sent", sent);
+
+  return 1;
+}
+
+/*** Returns true if an animation is playing.
  *
- * @function enumerate
- * @treturn int number of attached devices
+ * @function animating
+ * @treturn boolean true if a timeline started by <code>@{animate}</code> is still playing
  *
  */
-static int lfun_enumerate(lua_State *L) {
-  lua_pushinteger(L, blink1_enumerate());
+static int lfun_animating(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+
+  pthread_mutex_lock(&bd->anim.lock);
+  lua_pushboolean(L, bd->anim.frames != NULL);
+  pthread_mutex_unlock(&bd->anim.lock);
 
   return 1;
 }
 
-/*** Enables gamma correction.
+/*** Stops the current animation.
  *
- * Gamma correction is enabled by default. See the source code
- * for the <code>blink1-tool</code> for details on how gamma correction is
- * implemented.
+ * The device keeps displaying whatever color the last keyframe left it at.
  *
- * @function gamma
- * @see noGamma
+ * @function stopanimation
+ * @see animate
  *
  */
-static int lfun_yesDegamma(lua_State *L) {
-  blink1_enableDegamma();
+static int lfun_stopAnimation(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  setTimeline(bd, NULL, 0, 0);
 
   return 0;
 }
 
-/*** Returns a table with descriptions of all attached devices.
+/*** Registers a function to be called when an animation ends.
  *
- * Each entry is itself a table which describes a single device.
- *
- * The subtables have the following keys:
- * <ul>
- * <li>devid - an integer index for the device</li>
- * <li>mark - an integer specifying the device version (mk1, mk2, mk3)</li>
- * <li>serial - the device's serial number, a hexadecimal value</li>
- * </ul>
+ * The function is called, with the device, by <code>@{dispatch}</code> each time a
+ * timeline played a limited number of times runs to its end; not when it is replaced
+ * or stopped. Pass nil to stop being called.
  *
- * @function list
- * @treturn table each entry describes an attached device
+ * @function onanimationend
+ * @tparam ?function fn the function to call
+ * @see fd
  *
  */
-static int lfun_list(lua_State *L) {
-  int nDevices = blink1_enumerate();
-  lua_createtable(L, nDevices, 0);
+static int lfun_onAnimationEnd(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int watch = !lua_isnoneornil(L, 2);
+  if (watch) {
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  }
+  lua_settop(L, 2);
 
-  for (int i = 0; i < nDevices; i++) {
-    // push (list) index for the row we're creating
-    lua_pushinteger(L, i + 1);
+  lua_pushvalue(L, 2);
+  lua_setiuservalue(L, 1, 1);
+  getHotplug(L);
+  lua_getiuservalue(L, -1, 4);
+  lua_pushvalue(L, watch ? 1 : 2);
+  lua_rawsetp(L, -2, bd);
 
-    lua_createtable(L, 0, 3);
+  pthread_mutex_lock(&bd->anim.lock);
+  bd->anim.notify = watch;
+  pthread_mutex_unlock(&bd->anim.lock);
 
-    lua_pushstring(L, DEVID_KEY);
-    lua_pushinteger(L, i);
-    lua_settable(L, -3);
+  return 0;
+}
 
-    lua_pushstring(L, SERIALNUM_KEY);
-    lua_pushstring(L, blink1_getCachedSerial(i));
-    lua_settable(L, -3);
+/*** Plays packed frames at a fixed rate in the background.
+ *
+ * <code>frames</code> is a string of frames packed one after another: three bytes
+ * (red, green, blue) per frame to set both LEDs, or, with <code>leds = 2</code>, six
+ * bytes per frame, the color of LED 1 followed by the color of LED 2. For example,
+ * <code>string.pack('BBB', 255, 0, 0)</code> is one red frame.
+ *
+ * Frames are sent by a thread owned by the device, frame i at i / fps seconds after
+ * the start of the stream, so the rate doesn't drift with the time each transfer
+ * takes and the calling Lua code keeps running. If the device falls behind, frames
+ * that are overdue are dropped so the stream stays in time, unless
+ * <code>drop = false</code> is given, in which case every frame is sent, late if
+ * need be. Use <code>@{streamstats}</code> to see how the stream kept up.
+ *
+ * Starting a stream stops any animation, and vice versa; calling <code>stream</code>
+ * again replaces the current stream.
+ *
+ * The options table may contain:
+ * <ul>
+ * <li>leds - 1 (the default) for 3 byte frames, 2 for 6 byte frames</li>
+ * <li>count - the number of times to play the frames; 0 = loop forever; defaults to 1</li>
+ * <li>drop - whether to drop frames to catch up; defaults to true</li>
+ * </ul>
+ *
+ * @function stream
+ * @tparam string frames the packed frames
+ * @tparam number fps frames per second, in (0, 1000]
+ * @tparam[opt] table options
+ * @treturn boolean true if the stream was started | nil and an error description if not
+ * @see stopstream
+ *
+ */
+static int lfun_stream(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  size_t len;
+  const char *frames = luaL_checklstring(L, 2, &len);
+  lua_Number fps = luaL_checknumber(L, 3);
+  luaL_argcheck(L, (fps > 0 && fps <= 1000), 3, "fps must be in range (0, 1000]");
+
+  int ok = 1;
+  lua_Integer leds = 1, count = 1;
+  int drop = 1;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    leds = getIntField(L, 4, "leds", 1, &ok);
+    count = getIntField(L, 4, "count", 1, &ok);
+    lua_getfield(L, 4, "drop");
+    drop = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, ok, 4, "leds and count must be integers");
+  luaL_argcheck(L, (leds == 1 || leds == 2), 4, "leds must be 1 or 2");
+  luaL_argcheck(L, (count > -1 && count <= INT_MAX), 4, "count must be non-negative");
 
-    lua_pushstring(L, MARK_KEY);
-    lua_pushinteger(L, blink1_deviceTypeById(i));
-    lua_settable(L, -3);
+  int stride = (leds == 1) ? STREAM_RGB : STREAM_RGB2;
+  luaL_argcheck(L, (len > 0 && len % stride == 0), 2, "frames must be a non-empty string of 3 (or 6) byte frames");
 
-    // now put row into list
-    lua_settable(L, -3);
+  uint8_t *copy = malloc(len);
+  if (copy == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  memcpy(copy, frames, len);
+
+  setTimeline(bd, NULL, 0, 0);
+  if (setStream(bd, copy, len / stride, stride, (uint64_t)(NSEC_PER_SEC / fps), count, drop) != 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, NOTHREAD_MSG);
+    return 2;
   }
 
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int lfun_hsbToRgb(lua_State *L) {
-  uint8_t hsbbuf[3];
-  rgb_t rgb = {0, 0, 0};
-                 
-  hsbbuf[0] = (uint8_t)luaL_checkinteger(L, 1);
-  hsbbuf[1] = (uint8_t)luaL_checkinteger(L, 2);
-  hsbbuf[2] = (uint8_t)luaL_checkinteger(L, 3);
+/*** Returns true if a stream is playing.
+ *
+ * @function streaming
+ * @treturn boolean true if frames started by <code>@{stream}</code> are still playing
+ *
+ */
+static int lfun_streaming(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
 
-  hsbtorgb(&rgb, hsbbuf);
-           
-  lua_pushinteger(L, rgb.r);
-  lua_pushinteger(L, rgb.g);
-  lua_pushinteger(L, rgb.b);
+  pthread_mutex_lock(&bd->stream.lock);
+  lua_pushboolean(L, bd->stream.frames != NULL);
+  pthread_mutex_unlock(&bd->stream.lock);
 
-  return 3;
+  return 1;
 }
 
-/*** Disables gamma correction.
+/*** Stops the current stream.
  *
- * @function noGamma
- * @see gamma
+ * The device keeps displaying the last frame sent.
+ *
+ * @function stopstream
+ * @see stream
  *
  */
-static int lfun_noDegamma(lua_State *L) {
-  blink1_disableDegamma();
+static int lfun_stopStream(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  setStream(bd, NULL, 0, 0, 0, 0, 0);
 
   return 0;
 }
 
-/*** Opens a blink(1) device.
- *
- * This function creates a userdata bound to a specified blink(1). If called without a parameter,
- * it returns a userdata bound to the blink(1) device with ID 0. Otherwise it attempts to bind to the specified device.
- *
- * A particular device is specified
- * either by an integer ID or a string of 8 hexadecimal characters. Integer IDs must be between
- * <code>0</code> and <code>n-1</code> (<em>where n is the number of attached devices</em>).
- *
- * Hex strings are used to specify the serial number of a particular device. Serial numbers of all plugged in devices
- * can be found using the <code>@{list}</code> function.
+/*** Reports how the current or most recent stream is keeping up.
  *
- * <code>Open</code> will throw an error on invalid arguments or issues opening the device. This error can be caught by
- * wrapping the call in <code>@{pcall}</code>.
+ * The table has the following keys:
+ * <ul>
+ * <li>sent - frames sent to the device</li>
+ * <li>dropped - frames skipped to catch up</li>
+ * <li>failed - sent frames the device rejected</li>
+ * <li>elapsed - seconds since the stream started, or that it ran for</li>
+ * <li>fps - frames sent per second</li>
+ * <li>jitter_us - standard deviation of the time between frames, in microseconds</li>
+ * <li>late_mean_us, late_max_us - how long after their deadlines frames were sent</li>
+ * </ul>
  *
- * @function open
- * @tparam[opt] ?string|int devspec device ID or serial number
- * @treturn userdata object bound to the specified device
- * @raise error on invalid arguments or error opening device
+ * @function streamstats
+ * @treturn table the report, or nil if no stream has been started
+ * @see stream
  *
  */
-static int lfun_open(lua_State *L) {
-  int devid = -1;
-  char serial[9] = {'\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0'};
+static int lfun_streamStats(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  streamer *s = &bd->stream;
 
-  int nDevices = blink1_enumerate();
-  if (0 == nDevices) {
-    return luaL_error(L, NODEV_MSG);
+  pthread_mutex_lock(&s->lock);
+  streamreport r = s->report;
+  int playing = (s->frames != NULL);
+  pthread_mutex_unlock(&s->lock);
+
+  if (r.start == 0) {
+    lua_pushnil(L);
+    return 1;
   }
 
-  // @fixme - not happy with this; clean it up and rethink
-  if (0 == lua_gettop(L)) {
-    devid = 0;
-  } else if (lua_isinteger(L, 1)) {
-    int argval = lua_tointeger(L, 1);
-    if ( (-1 < argval) && (argval < nDevices) ) {
-      devid = argval;
-    } else {
-      sprintf(serial, "%X", argval);
-    }
-  } else if (lua_isstring(L, 1)) {
-    int isint;
-    devid = lua_tointegerx(L, 1, &isint);
-    if (!isint) {
-      return luaL_error(L, BADDEVSPEC_MSG);
-    }
-  } else {
-    return luaL_error(L, BADDEVSPEC_MSG);
+  double elapsed = ((playing ? nowNanos() : r.stop) - r.start) / (double)NSEC_PER_SEC;
+  double jitter = 0;
+  if (r.sent > 2) {
+    double n = r.sent - 1;
+    double mean = r.intervals / n;
+    jitter = sqrt(fmax(r.intervalSquares / n - mean * mean, 0)) / 1000;
   }
 
-  blinker *b = (blinker *)lua_newuserdatauv(L, sizeof(blinker), 0);
-  // No need to check that b is not null: if memory allocation failed,
-  // we'd never return to here because the allocator throws an error.
-  b->device = NULL;
+  lua_createtable(L, 0, 8);
+  setIntegerField(L, "sent", r.sent);
+  setIntegerField(L, "dropped", r.dropped);
+  setIntegerField(L, "failed", r.failed);
+  setNumberField(L, "elapsed", elapsed);
+  setNumberField(L, "fps", (elapsed > 0) ? r.sent / elapsed : 0);
+  setNumberField(L, "jitter_us", jitter);
+  setNumberField(L, "late_mean_us", (r.sent > 0) ? r.lateNanos / (r.sent * 1000.0) : 0);
+  setNumberField(L, "late_max_us", r.maxLateNanos / 1000.0);
 
-  if (devid > -1) {
-    b->device = blink1_openById(devid);
-  } else {
-    b->device = blink1_openBySerial(serial);
-  }
+  return 1;
+}
 
-  // I _think_ the userdata will be garbage collected since it doesn't get assigned.
-  if (b->device == NULL) {
-    char msg[100];
-    if (devid > -1) {
-      sprintf(msg, IDOPENERR_MSG, devid);
-    } else {
-      sprintf(msg, SERIALOPENERR_MSG, serial);
-    }
+/*** Metrics Methods
+ *
+ * @section metrics
+ *
+ */
+
+/*** Returns counters for the calls made to this device.
+ *
+ * The result is keyed by the kind of call made to the blink1 library:
+ * <code>set</code>, <code>fade</code>, <code>readrgb</code>, <code>version</code>,
+ * <code>playloop</code>, <code>readplay</code>, <code>setledn</code>,
+ * <code>writeline</code>, <code>readline</code> and <code>save</code>; kinds
+ * that were never called or suppressed are missing. Each entry is a table with the following keys:
+ * <ul>
+ * <li>calls - the number of calls made</li>
+ * <li>failures - calls that returned an error</li>
+ * <li>suppressed - sets and fades not sent because they would not have changed anything (see <code>@{dedup}</code>)</li>
+ * <li>reports - USB reports exchanged; a read takes two reports</li>
+ * <li>bytes - an estimate of the bytes exchanged, counting a full report buffer for each report</li>
+ * <li>total_us, mean_us, max_us - time spent in the calls, in microseconds</li>
+ * <li>p50_us, p99_us - estimated median and 99th percentile call times</li>
+ * <li>histogram - call counts keyed by the bucket's upper bound in microseconds;
+ *     a call taking t microseconds is counted under the smallest power of two
+ *     greater than t, or under <code>math.huge</code> if it took over 4 seconds</li>
+ * </ul>
+ *
+ * Calls made from the animation, writer and I/O threads are counted too.
+ *
+ * @function stats
+ * @tparam[opt] boolean reset zero the counters after reading them
+ * @treturn table the counters
+ *
+ */
+static int lfun_stats(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int reset = lua_toboolean(L, 2);
 
-    return luaL_error(L, msg);
+  pushCounters(L, bd->stats);
+  if (reset) {
+    resetCounters(bd->stats);
   }
 
-  luaL_getmetatable(L, BLINK_TYPENAME);
-  lua_setmetatable(L, -2);
-
   return 1;
 }
 
-/*** Returns the USB Product ID for the blink(1).
+/*** Write-behind Methods
  *
- * USB devices have an assigned product ID (PID) and
- * vendor ID (VID); these are both 16-bit numbers are are used to
- * indentify the device to the hosting computer. The VID is assigned by the USB
- * Implementers Forum and the PID is assigned by the manufacturer of the device.
+ * @section writebehind
  *
- * @function pid
- * @treturn int Product ID.
- * @see vid
+ */
+
+/*** Turns write-behind mode on or off.
+ *
+ * In write-behind mode, <code>set</code>, <code>fade</code> and the other color
+ * methods return immediately and a per-device writer thread sends the commands to
+ * the device. If commands arrive faster than the device can accept them, only the
+ * most recent color for each LED is sent and the intermediate ones are discarded.
+ * Because commands are sent later, color methods always return true in this mode;
+ * use <code>@{writestats}</code> to see how many failed.
+ *
+ * Turning write-behind off sends anything still queued before returning.
+ *
+ * @function writebehind
+ * @tparam boolean enable true to queue color commands, false to send them immediately
+ * @treturn boolean true if the mode was changed | nil and an error description if not
+ * @see flush
+ * @see writestats
  *
  */
-static int lfun_pid(lua_State *L) {
-  lua_pushinteger(L, blink1_pid());
-  
+static int lfun_writeBehind(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  luaL_checkany(L, 2);
+
+  if (lua_toboolean(L, 2)) {
+    if (startQueue(bd) != 0) {
+      lua_pushnil(L);
+      lua_pushstring(L, NOWRITER_MSG);
+      return 2;
+    }
+  } else {
+    stopQueue(bd);
+  }
+
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-/*** Platform-independent, millisecond-resolution sleep.
+/*** Turns suppression of redundant color commands on or off.
  *
- * This function is blocking.
+ * With suppression on, a <code>set</code> or <code>fade</code> (including those
+ * made by the other color methods, animations, streams and write-behind) is not
+ * sent if every LED it changes has finished fading to the same color, as last
+ * sent to the device, and returns true at once. Such calls are counted as
+ * <code>suppressed</code> by <code>@{stats}</code>.
  *
- * @function sleep
- * @tparam[opt] int millis milliseconds to pause; defaults to 100
- * @raise error if <code>millis</code> &lt; 0
+ * Suppression relies on the device showing what it was last sent, so a color
+ * changed by another program or by a playing pattern isn't restored unless
+ * <code>maxage</code> is given: a color is then sent again if it was last sent
+ * at least that many milliseconds ago. A device reached through
+ * <code>@{connect}</code> is shared with the server's other clients, so nothing
+ * is suppressed for it.
+ *
+ * @function dedup
+ * @tparam boolean enable true to suppress redundant commands
+ * @tparam[opt] int maxage milliseconds after which a color is sent again anyway; never if omitted or 0
+ * @treturn boolean true
+ * @raise error if <code>maxage</code> &lt; 0
  *
  */
-static int lfun_sleep(lua_State *L) {
-  int millis = luaL_optinteger(L, 1, DEFAULT_PAUSE);
-  luaL_argcheck(L, (millis >= 0), 1, BADSLEEPTIME_MSG);
-  blink1_sleep(millis);
-  
-  return 0;
+static int lfun_dedup(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  luaL_checkany(L, 2);
+  int enabled = lua_toboolean(L, 2);
+  lua_Integer maxAge = luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, maxAge >= 0, 3, "maxage must be >= 0");
+
+  pthread_mutex_lock(&bd->io);
+  bd->dedup.enabled = enabled;
+  bd->dedup.maxAge = (uint64_t)maxAge * NSEC_PER_MSEC;
+  pthread_mutex_unlock(&bd->io);
+
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
-/*** Returns the USB vendor ID for ThingM.
- *
- * USB devices have an assigned product ID (PID) and
- * vendor ID (VID); these are both 16-bit numbers are are used to
- * indentify the device to the hosting computer. The VID is assigned by the USB
- * Implementers Forum and the PID is assigned by the manufacturer of the device.
+/*** Waits until all queued color commands have been sent.
  *
- * @function vid
- * @treturn int Vendor ID.
- * @see pid
+ * @function flush
+ * @tparam[opt] int millis the longest time to wait; waits indefinitely if omitted
+ * @treturn boolean true if the queue drained, false if the wait timed out
+ * @see writebehind
  *
  */
-static int lfun_vid(lua_State *L) {
-  lua_pushinteger(L, blink1_vid());
-  
+static int lfun_flush(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int millis = luaL_optinteger(L, 2, -1);
+  uint64_t deadline = (millis < 0) ? 0 : nowNanos() + (uint64_t)millis * NSEC_PER_MSEC;
+
+  lua_pushboolean(L, flushQueue(bd, deadline));
+
   return 1;
 }
 
-// blink1_enable_degamma is static so can't access ...
-// need to think of another approach...
+/*** Returns write-behind counters.
+ *
+ * The table has the following keys:
+ * <ul>
+ * <li>submitted - color commands queued</li>
+ * <li>transmitted - commands sent to the device</li>
+ * <li>coalesced - commands discarded because a newer one replaced them</li>
+ * <li>failed - transmitted commands the device rejected</li>
+ * </ul>
+ *
+ * @function writestats
+ * @treturn table the counters
+ * @see writebehind
+ *
+ */
+static int lfun_writeStats(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  writebehind *q = &bd->queue;
 
-/****************************************************************************/
+  lua_createtable(L, 0, 4);
 
-/*** Lifecycle Methods
+  lua_pushinteger(L, atomic_load(&q->submitted));
+  lua_setfield(L, -2, "submitted");
+  lua_pushinteger(L, atomic_load(&q->transmitted));
+  lua_setfield(L, -2, "transmitted");
+  lua_pushinteger(L, atomic_load(&q->coalesced));
+  lua_setfield(L, -2, "coalesced");
+  lua_pushinteger(L, atomic_load(&q->failed));
+  lua_setfield(L, -2, "failed");
+
+  return 1;
+}
+
+/*** Watchdog Methods
  *
- * @section Lifecycle
+ * @section watchdog
  *
  */
 
-/*** Turns the device off, then detaches it.
+/*** Arms or disarms the device's watchdog.
  *
- * Calling <code>close</code> does not delete the userdata, but any subsequent
- * calls to this object will return <code>nil</code> and an error message.
+ * Armed, the device plays its pattern lines <code>startpos</code> to
+ * <code>endpos</code> (see <code>@{play}</code>) if it hears nothing for
+ * <code>timeout</code> milliseconds. A thread of the device's own tickles it
+ * every <code>interval</code> milliseconds as long as <code>@{heartbeat}</code>
+ * has been called since the last tickle, so the pattern plays if the
+ * application stops calling <code>heartbeat</code> or the process dies.
+ * Options:
+ * <ul>
+ * <li>timeout - milliseconds, from 10 to 655350</li>
+ * <li>interval - milliseconds between tickles, less than timeout; a quarter of timeout by default</li>
+ * <li>startpos, endpos - the pattern lines to play; 0 by default</li>
+ * <li>stay - true to leave the LEDs lit when the watchdog is disarmed; false by default</li>
+ * </ul>
  *
- * @function close
+ * Pass <code>false</code> to disarm the watchdog. Closing the device disarms it too.
+ *
+ * @function watchdog
+ * @tparam table|boolean options the settings, or false
+ * @treturn boolean true | nil and an error description
+ * @raise error if an option is out of range
+ * @see heartbeat
  *
  */
-static int lfun_close(lua_State *L) {
+static int lfun_watchdog(lua_State *L) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  blink1_setRGB(bd->device, 0, 0, 0);
-  blink1_close(bd->device);
-  bd->device = NULL;
 
-  return 0;
-}
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    if (disarmWatchdog(bd) == BLINK1_ERR) {
+      lua_pushnil(L);
+      lua_pushstring(L, "could not disarm watchdog");
+      return 2;
+    }
 
-static const char *getSerial(lua_State *L,blink1_device *device) {
-  const char *serial = blink1_getSerialForDev(device);
-  if (serial == NULL) {
-    serial = "N/A";
+    lua_pushboolean(L, 1);
+    return 1;
   }
-  lua_pushfstring(L, BLINK_STRING_FMT, serial);
-
-  return serial;
-}
-
-// TODO: can we document this?
-static int lfun_tostring(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  
-  if (bd->device == NULL) {
-    lua_pushstring(L, DISCONNECTED_BLINK_MSG);
-  } else {
-    lua_pushfstring(L, BLINK_STRING_FMT,
-                    blink1_deviceTypeToStr(blink1_deviceType(bd->device)),
-                    getSerial(L, bd->device));
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  int ok = 1;
+  lua_Integer timeout = getIntField(L, 2, "timeout", 0, &ok);
+  luaL_argcheck(L, ok && WATCHDOG_MIN_MILLIS <= timeout && timeout <= WATCHDOG_MAX_MILLIS, 2,
+                "timeout must be in [10, 655350]");
+  lua_Integer interval = getIntField(L, 2, "interval", (timeout + 3) / 4, &ok);
+  luaL_argcheck(L, ok && 0 < interval && interval < timeout, 2, "interval must be less than timeout");
+  lua_Integer startpos = getIntField(L, 2, "startpos", 0, &ok);
+  lua_Integer endpos = getIntField(L, 2, "endpos", 0, &ok);
+  luaL_argcheck(L, ok && 0 <= startpos && startpos < bd->patternSlots && 0 <= endpos && endpos < bd->patternSlots,
+                2, "startpos and endpos must be pattern positions");
+  lua_getfield(L, 2, "stay");
+  int stay = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  watchdog settings = {
+    .timeout = timeout,
+    .interval = interval * NSEC_PER_MSEC,
+    .stay = stay,
+    .startpos = startpos,
+    .endpos = endpos
+  };
+  if (armWatchdog(bd, &settings) == BLINK1_ERR) {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not arm watchdog");
+    return 2;
   }
 
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-/*** Informational Methods
+/*** Tells the watchdog the application is alive.
  *
- * @section informational
+ * This only sets a flag, so it is cheap enough to call from every turn of
+ * an event loop.
+ *
+ * @function heartbeat
+ * @see watchdog
  *
  */
+static int lfun_heartbeat(lua_State *L) {
+  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+  atomic_store_explicit(&bd->watchdog.beat, 1, memory_order_relaxed);
 
-/*** Returns the firmware version of the device.
+  return 0;
+}
+
+/*** Returns watchdog counters.
  *
- * @function version
- * @treturn string firmware version number
+ * The table has the following keys:
+ * <ul>
+ * <li>armed - true if the watchdog is armed</li>
+ * <li>tickles - tickles sent to the device</li>
+ * <li>missed - intervals that passed without a heartbeat, so without a tickle</li>
+ * </ul>
+ *
+ * @function watchdogstats
+ * @treturn table the counters
+ * @see watchdog
  *
  */
-static int lfun_firmwareVersion(lua_State *L) {
+static int lfun_watchdogStats(lua_State *L) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  // According to comments in C code, it seems that blink1_getVersion
-  // _can_ return an error code, but what those error codes are is not
-  // documented.
-  int scaledVersion = blink1_getVersion(bd->device);
-  int major = scaledVersion / 100;
-  int minor = scaledVersion % 100;
+  watchdog *w = &bd->watchdog;
 
-  char buf[20];
-  sprintf(buf, "%d.%02d", major, minor);
-  lua_pushstring(L, buf);
+  pthread_mutex_lock(&w->lock);
+  int armed = w->armed;
+  pthread_mutex_unlock(&w->lock);
+
+  lua_createtable(L, 0, 3);
+
+  lua_pushboolean(L, armed);
+  lua_setfield(L, -2, "armed");
+  lua_pushinteger(L, atomic_load(&w->tickles));
+  lua_setfield(L, -2, "tickles");
+  lua_pushinteger(L, atomic_load(&w->missed));
+  lua_setfield(L, -2, "missed");
 
   return 1;
 }
 
-/*** Returns the serial number of the device.
+/*** Layer Methods
  *
- * @function serial
- * @treturn string serial number
+ * Layers let several parts of a program share a device without overwriting
+ * each other. Each posts its own named layer, and what the device shows is
+ * computed from all of them: the layers are stacked by priority, and each
+ * LED shows the topmost layer that covers it, with any blended layers above
+ * that one applied on top. A timeline layer can't be blended: it plays when
+ * it is the topmost layer and is hidden by any color layer above it. A layer
+ * can be given a time to live, after which it is withdrawn by a thread of
+ * the device's own. With no layers left, the device is turned off.
+ *
+ * The device is only written to when what it should show changes, so
+ * reposting a layer as it is, or changing one hidden by another, costs
+ * nothing. Setting colors by other means while layers are posted works, but
+ * is overwritten by the next change to the layers.
+ *
+ * @section layers
  *
  */
-static int lfun_serialNumber(lua_State *L) {
+
+static const char *const blendModes[] = { "replace", "add", "multiply", "max", NULL };
+
+/*** Posts a layer, replacing any layer with the same name.
+ *
+ * Options:
+ * <ul>
+ * <li>red, green, blue - the layer's color; 0 by default</li>
+ * <li>led - 0 (both, the default), 1 (top) or 2 (bottom)</li>
+ * <li>millis - the time to fade to the new output over, when this is the top layer; 0 by default</li>
+ * <li>timeline, count - a timeline to play instead of a color, and how many times to play
+ *   it, as for <code>@{animate}</code></li>
+ * <li>priority - an integer; higher priority layers stack above lower ones, and of layers with
+ *   the same priority the one posted last is on top. 0 by default</li>
+ * <li>ttl - milliseconds until the layer is withdrawn; by default it stays until withdrawn</li>
+ * <li>blend - how a color combines with the layers below: "replace" (the default), "add",
+ *   "multiply" or "max"</li>
+ * </ul>
+ *
+ * @function post
+ * @string name the layer's name
+ * @tparam table layer the layer
+ * @treturn boolean true | nil and an error description if the layer was posted but the device
+ *   could not be updated, or it could not be posted
+ * @raise error if an option is out of range or the timeline is malformed
+ * @see withdraw
+ *
+ */
+static int lfun_post(lua_State *L) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  lua_pushstring(L, getSerial(L, bd->device));
+  const char *name = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  int ok = 1;
+  lua_Integer r = getIntField(L, 3, RED_KEY, 0, &ok);
+  lua_Integer g = getIntField(L, 3, GREEN_KEY, 0, &ok);
+  lua_Integer b = getIntField(L, 3, BLUE_KEY, 0, &ok);
+  lua_Integer led = getIntField(L, 3, LED_KEY, 0, &ok);
+  lua_Integer millis = getIntField(L, 3, MILLIS_KEY, 0, &ok);
+  lua_Integer count = getIntField(L, 3, "count", 1, &ok);
+  lua_Integer priority = getIntField(L, 3, "priority", 0, &ok);
+  lua_Integer ttl = getIntField(L, 3, "ttl", 0, &ok);
+  luaL_argcheck(L, ok, 3, "fields must be integers");
+  luaL_argcheck(L, (r > -1 && r < 256), 3, BADRED_MSG);
+  luaL_argcheck(L, (g > -1 && g < 256), 3, BADGREEN_MSG);
+  luaL_argcheck(L, (b > -1 && b < 256), 3, BADBLUE_MSG);
+  luaL_argcheck(L, (led > -1 && led < 3), 3, "led must be 0, 1 or 2");
+  luaL_argcheck(L, (millis > -1 && millis <= 65535), 3, "millis must be in range [0, 65535]");
+  luaL_argcheck(L, (count > -1), 3, "count must be non-negative");
+  luaL_argcheck(L, (priority >= INT_MIN && priority <= INT_MAX), 3, "priority is out of range");
+  luaL_argcheck(L, (ttl > -1 && ttl <= UINT32_MAX), 3, "ttl must be >= 0");
+
+  int blend = BLEND_REPLACE;
+  if (lua_getfield(L, 3, "blend") != LUA_TNIL) {
+    const char *mode = lua_tostring(L, -1);
+    for (blend = 0; blendModes[blend] != NULL; blend++) {
+      if (mode != NULL && strcmp(mode, blendModes[blend]) == 0) {
+        break;
+      }
+    }
+    luaL_argcheck(L, blendModes[blend] != NULL, 3, "blend must be replace, add, multiply or max");
+  }
+  lua_pop(L, 1);
+
+  keyframe *frames = NULL;
+  int nframes = 0;
+  if (lua_getfield(L, 3, "timeline") != LUA_TNIL) {
+    luaL_argcheck(L, lua_istable(L, -1), 3, "timeline must be a table");
+    frames = checkTimeline(L, lua_gettop(L), 3, count, &nframes);
+  }
+  lua_pop(L, 1);
+
+  if (ttl > 0 && startCompositor(bd) != 0) {
+    free(frames);
+    lua_pushnil(L);
+    lua_pushstring(L, "could not start compositor thread");
+    return 2;
+  }
+
+  layer l = {
+    .name = strdup(name),
+    .priority = priority,
+    .blend = blend,
+    .expires = (ttl > 0) ? nowNanos() + ttl * NSEC_PER_MSEC : 0,
+    .millis = millis,
+    .color = { r, g, b },
+    .led = led,
+    .frames = frames,
+    .nframes = nframes,
+    .count = count
+  };
+  if (l.name == NULL) {
+    free(frames);
+    return luaL_error(L, "out of memory");
+  }
+
+  if (postLayer(bd, &l) == BLINK1_ERR) {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not update the device");
+    return 2;
+  }
 
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-/*** Returns true/false if the device is/isn't a Mark 2.
+/*** Withdraws a layer.
  *
- * @function isMk2
- * @treturn boolean true if device is Mark 2, false otherwise
+ * @function withdraw
+ * @string name the layer's name
+ * @treturn boolean true if the layer was withdrawn, false if there was no such layer | nil
+ *   and an error description if the device could not be updated
+ * @see post
  *
  */
-static int lfun_isMk2(lua_State *L) {
+static int lfun_withdraw(lua_State *L) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  lua_pushboolean(L, blink1_isMk2(bd->device));
+  const char *name = luaL_checkstring(L, 2);
+
+  int result = withdrawLayer(bd, name);
+  if (result == BLINK1_ERR) {
+    lua_pushnil(L);
+    lua_pushstring(L, "could not update the device");
+    return 2;
+  }
 
+  lua_pushboolean(L, result);
   return 1;
 }
 
-/*** Returns an integer indicating the version of the blink(1).
+/*** Returns the posted layers.
  *
- * This function returns 1 for a Mark 1 device 2 for Mark 2, etc.
+ * The layers are listed from the top of the stack down, each a table with
+ * its <code>name</code>, <code>priority</code> and <code>blend</code> mode,
+ * the milliseconds left to live as <code>ttl</code> if it has a TTL, and
+ * either its <code>red</code>, <code>green</code>, <code>blue</code>,
+ * <code>led</code> and <code>millis</code>, or <code>timeline</code> set to
+ * true.
  *
- * @function type
- * @treturn int the version of the device
+ * @function layers
+ * @treturn table an array of layers
+ * @see post
  *
  */
-static int lfun_type(lua_State *L) {
+static int lfun_layers(lua_State *L) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  lua_pushinteger(L, blink1_deviceType(bd->device));
+  compositor *c = &bd->layers;
+
+  pthread_mutex_lock(&c->lock);
+  int n = c->nlayers;
+  layer *layers = malloc((n + 1) * sizeof(layer));
+  if (layers != NULL) {
+    memcpy(layers, c->layers, n * sizeof(layer));
+    for (int i = 0; i < n; i++) {
+      layers[i].name = strdup(c->layers[i].name);
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  if (layers == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+
+  uint64_t now = nowNanos();
+  lua_createtable(L, n, 0);
+  for (int i = 0; i < n; i++) {
+    const layer *l = &layers[i];
+
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, l->name != NULL ? l->name : "");
+    lua_setfield(L, -2, "name");
+    setIntegerField(L, "priority", l->priority);
+    lua_pushstring(L, blendModes[l->blend]);
+    lua_setfield(L, -2, "blend");
+    if (l->expires != 0) {
+      setIntegerField(L, "ttl", (l->expires > now) ? (l->expires - now) / NSEC_PER_MSEC : 0);
+    }
+    if (l->frames != NULL) {
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "timeline");
+    } else {
+      setIntegerField(L, RED_KEY, l->color.r);
+      setIntegerField(L, GREEN_KEY, l->color.g);
+      setIntegerField(L, BLUE_KEY, l->color.b);
+      setIntegerField(L, LED_KEY, l->led);
+      setIntegerField(L, MILLIS_KEY, l->millis);
+    }
+    lua_rawseti(L, -2, i + 1);
+    free(layers[i].name);
+  }
+  free(layers);
 
   return 1;
 }
 
-/*** Returns the version of the blink(1) as a string.
+/*** Asynchronous Methods
  *
- * This will be <code>mk1</code>, <code>mk2</code>, <code>mk3</code>.
+ * These methods queue an operation and return at once with a request object.
+ * Each device has its own I/O thread which runs that device's requests one at
+ * a time, in the order they were made; requests for different devices run in
+ * parallel. The request object has the following methods:
+ * <ul>
+ * <li><code>done()</code> - returns true if the operation has finished</li>
+ * <li><code>wait([millis])</code> - waits for the operation to finish, at most
+ *   <code>millis</code> milliseconds if given; returns true if it finished</li>
+ * <li><code>result()</code> - waits for the operation to finish and returns
+ *   what the corresponding blocking method would have returned</li>
+ * <li><code>ondone(fn)</code> - has <code>@{dispatch}</code> call <code>fn</code> with
+ *   what <code>result()</code> returns once the operation has finished, so that an event
+ *   loop watching <code>@{fd}</code> never waits; returns the request</li>
+ * </ul>
  *
- * @function typestring
- * @treturn string the version of the device
+ * Closing a device finishes its outstanding requests first.
+ *
+ * @section async
  *
  */
-static int lfun_typestring(lua_State *L) {
+
+typedef struct requesthandle {
+  request *req;
+} requesthandle;
+
+/*
+ * Queues <req> on the device at index 1 and pushes a request object for it,
+ * or nil and an error message. The request object's uservalue keeps the
+ * device alive until the request object is collected.
+ */
+static int pushRequest(lua_State *L, request *req) {
   blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  lua_pushstring(L, blink1_deviceTypeToStr(blink1_deviceType(bd->device)));
-  
+
+  requesthandle *h = lua_newuserdatauv(L, sizeof(requesthandle), 2);
+  h->req = NULL;
+  luaL_setmetatable(L, REQUEST_TYPENAME);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+
+  if (submitRequest(bd, req) != 0) {
+    // drop both the I/O thread's reference and the request object's
+    releaseRequest(req);
+    releaseRequest(req);
+    lua_pushnil(L);
+    lua_pushstring(L, bd->requests.closed ? CLOSEDREQUEST_MSG : NOREQUEST_MSG);
+    return 2;
+  }
+  h->req = req;
+
   return 1;
 }
 
-// /*** Color Methods.
-//  *
-//  * The <code>set</code> method will display the specified
-//  * RGB color on the device. This will set both of a Mark 2's LEDs
-//  * to the same color. If you only want to set one of the LEDs,
-//  * you need to use <code>fade</code>. The API does not have
-//  * a method to set just one of the LEDs on a Mark 2; you can fake it by using <code>fade</code>
-//  * with a very short duration.
-//  *
-//  * The color-specific methods, <code>black</code>,
-//  * <code>cyan</code>, <code>red</code>, etc. are implemented by
-//  * passing appropriate RGB values to <code>set</code>.
-//  *
-//  * <code>Get</code> method retrieves color information. Specifically, ...
-//  *
-//  * Dim and brighten...
-//  *
-//  * @section color
-//  *
-//  */
-
-/*** Color Methods.
- *
- * @section color
- *
+/*
+ * Allocates a request for <op>, throwing an error if memory is exhausted.
  */
- 
-/*** Sets the device to the given RGB value.
+static request *checkRequest(lua_State *L, cmdop op, const char *errmsg) {
+  request *req = newRequest();
+  if (req == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  req->cmd.op = op;
+  req->cmd.errmsg = errmsg;
+
+  return req;
+}
+
+/*** Sets the device to the given RGB value without waiting.
  *
- * @function set
+ * @function setasync
  * @tparam int r red value in range [0-255]
  * @tparam int g green value in range [0-255]
  * @tparam int b blue value in range [0-255]
- * @treturn bool true if the color is set
+ * @treturn userdata a request; its result is the same as <code>@{set}</code>'s
  * @raise error if either r, g, or b not in the correct range
  *
  */
-static int lfun_setRGB(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-
-  int r = luaL_checkinteger(L, 2);
-  int g = luaL_checkinteger(L, 3);
-  int b = luaL_checkinteger(L, 4);
-  
-  luaL_argcheck(L, ( -1 < r && r < 256), 2, BADRED_MSG);
-  luaL_argcheck(L, ( -1 < g && g < 256), 3, BADGREEN_MSG);
-  luaL_argcheck(L, ( -1 < b && b < 256), 4, BADBLUE_MSG);
+static int lfun_setAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd = { .op = OP_SET, .errmsg = "could not set RGB" };
+  checkColor(L, 2, &cmd);
 
-  int result = blink1_setRGB(bd->device, r, g, b);
+  request *req = checkRequest(L, cmd.op, cmd.errmsg);
+  req->cmd = cmd;
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "could not set RGB");
-    return 2;
-  }
+  return pushRequest(L, req);
 }
 
-#define SET(Color, r, g, b) \
-  static int lfun_set##Color(lua_State *L) { \
-    lua_settop(L, 1);        \
-    lua_pushinteger(L, (r)); \
-    lua_pushinteger(L, (g)); \
-    lua_pushinteger(L, (b)); \
-    return lfun_setRGB(L);   \
-  }
+/*** Fades to the given RGB value without waiting.
+ *
+ * @function fadeasync
+ * @int millis the fade duration
+ * @int red the red component [0-255]
+ * @int green the green component [0-255]
+ * @int blue the blue component [0-255]
+ * @int[opt] n which LED to adjust; 0 - both; 1 - top; 2 - bottom
+ * @treturn userdata a request; its result is the same as <code>@{fade}</code>'s
+ *
+ */
+static int lfun_fadeAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd = { .op = OP_FADE, .errmsg = "could not fade" };
+  int millis = luaL_checkinteger(L, 2);
+  int ledArg = checkColor(L, 3, &cmd);
+  int nLed = luaL_optinteger(L, ledArg, 0);
 
-/// Turns the device off. Equivalent to <code>set(0, 0, 0)</code>
-// @function black
-SET(Black, 0, 0, 0)
+  luaL_argcheck(L, ( -1 < millis && millis < 65536), 2, "millis must be in range [0, 65535]");
+  luaL_argcheck(L, ( -1 < nLed && nLed <= LED_COUNT), ledArg, "led must be 0, 1 or 2");
+  cmd.millis = millis;
+  cmd.n = nLed;
 
-/// Turns the device blue. Equivalent to <code>set(0, 0, 255)</code>
-// @function blue
-SET(Blue, 0, 0, 255)
+  request *req = checkRequest(L, cmd.op, cmd.errmsg);
+  req->cmd = cmd;
 
-/// Turns the device cyan. Equivalent to <code>set(0, 255, 255)</code>
-// @function cyan
-SET(Cyan, 0, 255, 255)
+  return pushRequest(L, req);
+}
 
-/// Turns the device green. Equivalent to <code>set(0, 255, 0)</code>
-// @function green
-SET(Green, 0, 255, 0)
+/*** Retrieves the current RGB value without waiting.
+ *
+ * @function getasync
+ * @tparam[opt] ?int|table n the LED to retrieve, as for <code>@{get}</code>
+ * @treturn userdata a request; its result is the same as <code>@{get}</code>'s
+ *
+ */
+static int lfun_getAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
+  int refresh;
+  int nLed = checkLedSpec(L, 2, &refresh, NULL);
 
-/// Turns the device magenta. Equivalent to <code>set(255, 0, 255)</code>
-// @function magenta
-SET(Magenta, 255, 0, 255)
+  request *req = checkRequest(L, OP_GET, BAD_RETRIEVAL_MSG);
+  req->cmd.n = nLed;
+  req->cmd.refresh = refresh;
 
-/// Turns the device off. Equivalent to <code>set(0, 0, 0)</code>
-// @function off
-SET(Off, 0, 0, 0)
+  return pushRequest(L, req);
+}
 
-/// Turns the device on. Equivalent to <code>set(255, 255, 255)</code>
-// @function on
-SET(On, 255, 255, 255)
+/*** Writes a pattern into the device's RAM without waiting.
+ *
+ * @function writepatternasync
+ * @tparam table pattern the pattern to write, as for <code>@{writepattern}</code>
+ * @tparam[opt] boolean force rewrite positions even if they appear unchanged
+ * @treturn userdata a request; its result is the same as <code>@{writepattern}</code>'s
+ * @raise error if the pattern is malformed
+ *
+ */
+static int lfun_writePatternAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd = { .op = OP_WRITEPATTERN, .errmsg = "could not write pattern" };
+  cmd.nslots = checkPattern(L, 2, cmd.slots);
+  cmd.force = lua_toboolean(L, 3);
 
-/// Turns the device orange. Equivalent to <code>set(255, 165, 0)</code>
-// @function orange
-SET(Orange, 255, 165, 0)
+  request *req = checkRequest(L, cmd.op, cmd.errmsg);
+  req->cmd = cmd;
 
-/// Turns the device red. Equivalent to <code>set(255, 0, 0)</code>
-// @function red
-SET(Red, 255, 0, 0)
+  return pushRequest(L, req);
+}
 
-/// Turns the device on. Equivalent to <code>set(255, 255, 255)</code>
-// @function white
-SET(White, 255, 255, 255)
+/*** Reads the device's pattern without waiting.
+ *
+ * @function readpatternasync
+ * @tparam[opt] table options as for <code>@{readpattern}</code>
+ * @treturn userdata a request; its result is the same as <code>@{readpattern}</code>'s
+ *
+ */
+static int lfun_readPatternAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
+  command cmd = { .op = OP_READPATTERN, .errmsg = "could not read pattern" };
+  checkReadOptions(L, 2, &cmd);
 
-/// Turns the device yellow. Equivalent to <code>set(255, 255, 0)</code>
-// @function yellow
-SET(Yellow, 255, 255, 0)
+  request *req = checkRequest(L, cmd.op, cmd.errmsg);
+  req->cmd = cmd;
 
-#define max(x, y) ( ((x) < (y)) ? (y) : (x) )
+  return pushRequest(L, req);
+}
 
-/*** Dims the color displayed by the device. Note: calling this function
- * forces Gamma correction off. You will need to explicitly turn it back on if
- * you want it afterwards.
+/*** Saves the pattern from RAM into flash without waiting.
  *
- * @function dim
- * @see brighten
- * @treturn boolean true if successful | false and an error description if not
+ * @function savepatternasync
+ * @treturn userdata a request; its result is the same as <code>@{savepattern}</code>'s
  *
  */
-static int lfun_dim(lua_State *L) { 
-  // TODO: need to specify which LED?
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  uint16_t millis;
-  uint8_t r, g, b;
+static int lfun_savePatternAsync(lua_State *L) {
+  luaL_checkudata(L, 1, BLINK_TYPENAME);
 
-  int result = blink1_readRGB(bd->device, &millis, &r, &g, &b, 0);
-  
-  if (result == BLINK1_ERR) {
+  return pushRequest(L, checkRequest(L, OP_SAVEPATTERN, "Error saving pattern."));
+}
+
+static int lfun_requestDone(lua_State *L) {
+  requesthandle *h = luaL_checkudata(L, 1, REQUEST_TYPENAME);
+
+  pthread_mutex_lock(&h->req->lock);
+  lua_pushboolean(L, h->req->done);
+  pthread_mutex_unlock(&h->req->lock);
+
+  return 1;
+}
+
+static int lfun_requestWait(lua_State *L) {
+  requesthandle *h = luaL_checkudata(L, 1, REQUEST_TYPENAME);
+  int millis = luaL_optinteger(L, 2, -1);
+  uint64_t deadline = (millis < 0) ? 0 : nowNanos() + (uint64_t)millis * NSEC_PER_MSEC;
+
+  lua_pushboolean(L, waitRequest(h->req, deadline));
+
+  return 1;
+}
+
+static int lfun_requestResult(lua_State *L) {
+  requesthandle *h = luaL_checkudata(L, 1, REQUEST_TYPENAME);
+  request *req = h->req;
+  const task *t = &req->t;
+
+  waitRequest(req, 0);
+
+  if (t->result == BLINK1_ERR) {
+    if (req->cmd.op == OP_WRITEPATTERN) {
+      return pushPatternFailures(L, PATTERNWRITEERR_MSG, t->failed);
+    } else if (req->cmd.op == OP_READPATTERN) {
+      return pushPatternFailures(L, PATTERNREADERR_MSG, t->failed);
+    }
     lua_pushnil(L);
-    lua_pushstring(L, "could not dim");
+    lua_pushstring(L, req->cmd.errmsg);
     return 2;
   }
 
-  // We're going to force gamma correction off (and leave it off
-  // since we can't (yet) check to see if it was on
-  // Then we consider the range 0-255 broken up into 8 buckets,
-  // and move to the next lower bucket (i.e. subtract 256/8)/
-
-  blink1_disableDegamma();
-  
-  r = max(0, r - 32);
-  g = max(0, g - 32);
-  b = max(0, b - 32);
-  result = blink1_setRGB(bd->device, r, g, b);
-  
-  if (result != BLINK1_ERR) {
+  switch (req->cmd.op) {
+  case OP_GET:
+    lua_pushinteger(L, t->r);
+    lua_pushinteger(L, t->g);
+    lua_pushinteger(L, t->b);
+    lua_pushinteger(L, t->millis);
+    return 4;
+  case OP_WRITEPATTERN:
+    lua_pushinteger(L, t->sent);
+    return 1;
+  case OP_READPATTERN:
+    pushPatternRead(L, t);
+    return 1;
+  default:
     lua_pushboolean(L, 1);
     return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "could not dim");
-    return 2;
   }
 }
 
-#define min(x, y) ( ((x) < (y)) ? (x) : (y) )
+static int lfun_requestOnDone(lua_State *L) {
+  requesthandle *h = luaL_checkudata(L, 1, REQUEST_TYPENAME);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  request *req = h->req;
+
+  lua_settop(L, 2);
+  lua_setiuservalue(L, 1, 2);
+  hotplug *hp = getHotplug(L);
+  lua_getiuservalue(L, -1, 3);
+  lua_pushvalue(L, 1);
+  lua_rawsetp(L, -2, req);
+
+  pthread_mutex_lock(&req->lock);
+  int first = !req->watched;
+  req->watched = 1;
+  int done = req->done;
+  pthread_mutex_unlock(&req->lock);
+
+  // one that already finished won't post itself
+  if (first && done) {
+    postEvent(hp->events, EVENT_REQUEST, req);
+  }
+
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int lfun_requestGc(lua_State *L) {
+  requesthandle *h = luaL_checkudata(L, 1, REQUEST_TYPENAME);
+
+  if (h->req != NULL) {
+    releaseRequest(h->req);
+    h->req = NULL;
+  }
 
-/*** Brightens the color displayed by the device. Note: calling this function
- * forces Gamma correction off. You will need to explicitly turn it back on if
- * you want it afterwards.
+  return 0;
+}
+
+/*** Group Methods
  *
- * @function brighten
- * @see dim
- * @treturn boolean true if successful | false and an error description if not
+ * A group bundles several blink(1) objects so they can be controlled with
+ * one call. Groups have the same color and pattern methods as a single device;
+ * each call is sent to every member at the same time from a small pool of
+ * threads, so turning every light red takes about as long as turning one light red.
+ *
+ * Group methods return true if the call succeeded on every member (false otherwise),
+ * and a table with one entry per member, in the same order as <code>@{devices}</code>.
+ * An entry is true (<em>or the requested value</em>) if the call succeeded on that member,
+ * otherwise it's an error message.
+ *
+ * @section group
  *
  */
-static int lfun_brighten(lua_State *L) {
-  // TODO: need to specify which LED?
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  uint16_t millis;
-  uint8_t r, g, b;
 
-  int result = blink1_readRGB(bd->device, &millis, &r, &g, &b, 0);
+typedef struct blinkgroup {
+  int n;
+  blinker *members[];
+} blinkgroup;
 
-  if (result == BLINK1_ERR) {
-    lua_pushnil(L);
-    lua_pushstring(L, "could not read RGB values");
-    return 2;
-  }
+/*
+ * Sends <cmd> to every member of the group at index 1 and pushes the aggregated results.
+ */
+static int dispatchGroup(lua_State *L, command *cmd) {
+  blinkgroup *group = luaL_checkudata(L, 1, GROUP_TYPENAME);
+  workpool *pool = lua_touserdata(L, lua_upvalueindex(1));
+  task *tasks = lua_newuserdatauv(L, group->n * sizeof(task), 0);
 
-  // Do the opposite of dim...
-  blink1_disableDegamma();
+  for (int i = 0; i < group->n; i++) {
+    tasks[i] = (task){ .bd = group->members[i], .cmd = cmd, .result = BLINK1_ERR };
+  }
 
-  if (r != 0) { r = min(255, r + 32); }
-  if (g != 0) { g = min(255, g + 32); }
-  if (b != 0) { b = min(255, b + 32); }
-  result = blink1_setRGB(bd->device, r, g, b);
+  if (group->n > 0) {
+    runTasks(pool, tasks, group->n);
+  }
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "could not brighten");
-    return 2;
+  int allok = 1;
+  lua_pushnil(L);
+  lua_createtable(L, group->n, 0);
+  for (int i = 0; i < group->n; i++) {
+    task *t = &tasks[i];
+
+    if (t->result == BLINK1_ERR) {
+      allok = 0;
+      lua_pushstring(L, cmd->errmsg);
+    } else if (cmd->op == OP_GET) {
+      lua_createtable(L, 0, 4);
+      lua_pushinteger(L, t->r);
+      lua_setfield(L, -2, RED_KEY);
+      lua_pushinteger(L, t->g);
+      lua_setfield(L, -2, GREEN_KEY);
+      lua_pushinteger(L, t->b);
+      lua_setfield(L, -2, BLUE_KEY);
+      lua_pushinteger(L, t->millis);
+      lua_setfield(L, -2, MILLIS_KEY);
+    } else if (cmd->op == OP_WRITEPATTERN) {
+      lua_pushinteger(L, t->sent);
+    } else if (cmd->op == OP_READPATTERN) {
+      pushPatternRead(L, t);
+    } else {
+      lua_pushboolean(L, 1);
+    }
+    lua_rawseti(L, -2, i + 1);
   }
+
+  lua_pushboolean(L, allok);
+  lua_replace(L, -3);
+
+  return 2;
 }
 
-/*** Fades device to given RGB over given number of milliseconds.
+/*** Creates a group of devices.
  *
- * You can specify either the top, bottom, or both LEDs to fade.
+ * Each member is either an object returned by <code>@{open}</code> or a device
+ * ID or serial number, in which case the device is opened. Opening a member can
+ * throw an error, just like <code>@{open}</code>.
+ *
+ * @function group
+ * @tparam table members the devices to include
+ * @treturn userdata a group object
+ * @raise error on invalid arguments or error opening a device
+ * @see all
  *
- * @function fade
- * @int millis the fade duration
- * @int red the red component [0-255]
- * @int green the green component [0-255]
- * @int blue the blue component [0-255]
- * @int n which LED to adjust; 0 - both; 1 - top; 2 - bottom
  */
-static int lfun_fadeToRGB(lua_State *L) {
-  // TODO: consider re-arranging paramaeter order to make it more sensible
-  // and to allow for default params
-  // TODO: default n to 0
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  int millis = luaL_checkinteger(L, 2);
-  int r = luaL_checkinteger(L, 3);
-  int g = luaL_checkinteger(L, 4);
-  int b = luaL_checkinteger(L, 5);
-  int nLed = luaL_optinteger(L, 6, 0);
-
-  int result = blink1_fadeToRGBN(bd->device, millis, r, g, b, nLed);
+static int lfun_group(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int n = luaL_len(L, 1);
+
+  lua_createtable(L, n, 0);
+  for (int i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (luaL_testudata(L, -1, BLINK_TYPENAME) == NULL) {
+      lua_pushcfunction(L, lfun_open);
+      lua_insert(L, -2);
+      lua_call(L, 1, 1);
+    }
+    lua_rawseti(L, -2, i);
+  }
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
+  blinkgroup *group = lua_newuserdatauv(L, sizeof(blinkgroup) + n * sizeof(blinker *), 1);
+  group->n = n;
+  for (int i = 0; i < n; i++) {
+    lua_rawgeti(L, -2, i + 1);
+    group->members[i] = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
 
-    return 1;
-  } else {
-    char msg[256];
-    sprintf(msg, "Could not fade to (%d, %d, %d)", r, g, b);
+  // Members are kept alive by the group's user value.
+  lua_insert(L, -2);
+  lua_setiuservalue(L, -2, 1);
 
-    lua_pushnil(L);
-    lua_pushstring(L, msg);
+  luaL_getmetatable(L, GROUP_TYPENAME);
+  lua_setmetatable(L, -2);
 
-    return 2;
-  }
+  return 1;
 }
 
-/*** Returns the last RGB value for the given device.
+/*** Creates a group of all attached devices.
  *
- * If you specify 0, 1 or no parameter, it retrieves the bottom LED.
- * If you specify 2, it returns the top LED. The retrieved value is
- * after gamma correction (<em>if enabled</em>).
- *
- * @function get
- * @tparam[opt] int n the LED to retrieve
- * @treturn int last set red value [0, 255]
- * @treturn int last set green value [0, 255]
- * @treturn int last set blue value [0, 255]
- * @treturn int last set millis value
+ * @function all
+ * @treturn userdata a group object
+ * @raise error if a device can't be opened
+ * @see group
  *
  */
-static int lfun_readRGB(lua_State *L) {
-  // TODO: deal with specifying which LED
-  // TODO: do we really need millis?
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  int nLed = luaL_optinteger(L, 2, 0);
-  // TODO: is it 0|1 or 1|2 ?
-  // luaL_argcheck(L, (nLed == 0 || nLed == 1), 1, "Led # must be 0 or 1.");
-  
-  uint16_t millis;
-  uint8_t r, g, b;
-
-  int result = blink1_readRGB(bd->device, &millis, &r, &g, &b, nLed);
+static int lfun_all(lua_State *L) {
+  pthread_mutex_lock(&attached.lock);
+  registryRefresh();
+  int nDevices = attached.count;
+  pthread_mutex_unlock(&attached.lock);
 
-  if (result != BLINK1_ERR) {
-    lua_pushinteger(L, r);
-    lua_pushinteger(L, g);
-    lua_pushinteger(L, b);
-    lua_pushinteger(L, millis);
-    return 4;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, BAD_RETRIEVAL_MSG);
-    return 2;
+  lua_settop(L, 0);
+  lua_createtable(L, nDevices, 0);
+  for (int i = 0; i < nDevices; i++) {
+    lua_pushinteger(L, i);
+    lua_rawseti(L, 1, i + 1);
   }
+
+  return lfun_group(L);
 }
 
-/*** Pattern Methods
+/*** Returns the members of the group.
  *
- * @section pattern
+ * @function devices
+ * @treturn table the blink(1) objects in the group
  *
  */
- 
-/*** Plays the current pattern.
- *
- * Optionally specify a sub-range to play, as
- * well as an optional count (0 = loop forever).
+static int lfun_groupDevices(lua_State *L) {
+  blinkgroup *group = luaL_checkudata(L, 1, GROUP_TYPENAME);
+
+  lua_getiuservalue(L, 1, 1);
+  lua_createtable(L, group->n, 0);
+  for (int i = 1; i <= group->n; i++) {
+    lua_rawgeti(L, -2, i);
+    lua_rawseti(L, -2, i);
+  }
+
+  return 1;
+}
+
+static int lfun_groupLen(lua_State *L) {
+  blinkgroup *group = luaL_checkudata(L, 1, GROUP_TYPENAME);
+  lua_pushinteger(L, group->n);
+
+  return 1;
+}
+
+static int lfun_groupTostring(lua_State *L) {
+  blinkgroup *group = luaL_checkudata(L, 1, GROUP_TYPENAME);
+  lua_pushfstring(L, GROUP_STRING_FMT, group->n);
+
+  return 1;
+}
+
+/*** Closes every member of the group.
  *
- * @function play
- * @tparam[opt] int count the number of times to play
- * @tparam[opt] int start the starting position
- * @tparam[opt] int stop the end position
+ * @function close
+ * @see close
  *
  */
-static int lfun_play(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+static int lfun_groupClose(lua_State *L) {
+  blinkgroup *group = luaL_checkudata(L, 1, GROUP_TYPENAME);
+
+  lua_getiuservalue(L, 1, 1);
+  for (int i = 1; i <= group->n; i++) {
+    lua_pushcfunction(L, lfun_close);
+    lua_rawgeti(L, -2, i);
+    lua_call(L, 1, 0);
+  }
+
+  return 0;
+}
+
+static int lfun_groupSetRGB(lua_State *L) {
+  command cmd = { .op = OP_SET, .errmsg = "could not set RGB" };
+  checkColor(L, 2, &cmd);
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupFade(lua_State *L) {
+  command cmd = { .op = OP_FADE, .errmsg = "could not fade" };
+  int millis = luaL_checkinteger(L, 2);
+  int ledArg = checkColor(L, 3, &cmd);
+  int nLed = luaL_optinteger(L, ledArg, 0);
+
+  luaL_argcheck(L, ( -1 < millis && millis < 65536), 2, "millis must be in range [0, 65535]");
+  luaL_argcheck(L, ( -1 < nLed && nLed <= LED_COUNT), ledArg, "led must be 0, 1 or 2");
+  cmd.millis = millis;
+  cmd.n = nLed;
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupDim(lua_State *L) {
+  command cmd = { .op = OP_DIM, .errmsg = "could not dim" };
+
+  return dispatchGroup(L, &cmd);
+}
 
+static int lfun_groupBrighten(lua_State *L) {
+  command cmd = { .op = OP_BRIGHTEN, .errmsg = "could not brighten" };
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupGet(lua_State *L) {
+  command cmd = { .op = OP_GET, .errmsg = BAD_RETRIEVAL_MSG };
+  cmd.n = checkLedSpec(L, 2, &cmd.refresh, NULL);
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupPlay(lua_State *L) {
+  command cmd = { .op = OP_PLAY, .errmsg = "error starting play." };
   int count = luaL_optinteger(L, 2, 0);
   int startpos = luaL_optinteger(L, 3, 0);
   int endpos = luaL_optinteger(L, 4, 0);
 
-  // TODO: adjust upper bound based on whether mk1, mk2, etc.
   luaL_argcheck(L, ( -1 < startpos && startpos < 32), 3, "starting position must be in range [0, 32)");
   luaL_argcheck(L, ( -1 < endpos && endpos < 32), 4, "ending position must be in range [0, 32)");
   luaL_argcheck(L, ( startpos <= endpos ), 3, "start position must be before end position");
-  luaL_argcheck(L, ( count > -1), 2, "count must be non-negative");
-  
-  int result = blink1_playloop(bd->device, PATTERNPLAY_START, startpos, endpos, count);
+  luaL_argcheck(L, ( -1 < count && count < 256), 2, "count must be in range [0, 255]");
+  cmd.count = count;
+  cmd.startpos = startpos;
+  cmd.endpos = endpos;
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "error starting play.");
-    return 2;
-  }
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupStop(lua_State *L) {
+  command cmd = { .op = OP_STOP, .errmsg = "Error stopping play." };
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupSetPatternPosition(lua_State *L) {
+  command cmd = { .op = OP_SETPATTPOS, .errmsg = "Could not write pattern line" };
+  int millis = luaL_checkinteger(L, 2);
+  int posArg = checkColor(L, 3, &cmd);
+  int pos = luaL_checkinteger(L, posArg);
+
+  luaL_argcheck(L, ( -1 < millis && millis < 32768), 2, "milliseconds must be in range [0, 32768]");
+  luaL_argcheck(L, ( -1 < pos && pos < 32 ), posArg, "position must be in range [0, 32)");
+  cmd.millis = millis;
+  cmd.pos = pos;
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupClearPattern(lua_State *L) {
+  command cmd = { .op = OP_WRITEPATTERN, .errmsg = "could not clear pattern" };
+  cmd.fill = 1;
+
+  return dispatchGroup(L, &cmd);
+}
+
+static int lfun_groupWritePattern(lua_State *L) {
+  command cmd = { .op = OP_WRITEPATTERN, .errmsg = "could not write pattern" };
+  cmd.nslots = checkPattern(L, 2, cmd.slots);
+  cmd.force = lua_toboolean(L, 3);
+
+  return dispatchGroup(L, &cmd);
 }
 
-/*** Stops playing the current pattern.
- *
- * @function stop
- *
- */
-static int lfun_stop(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+static int lfun_groupSetPatternString(lua_State *L) {
+  command cmd = { .op = OP_WRITEPATTERN, .errmsg = "could not write pattern" };
+  cmd.force = lua_toboolean(L, 3);
+  const compiledpattern *cp = checkPatternString(L, 2);
 
-  int result = blink1_playloop(bd->device, PATTERNPLAY_STOP, 0, 0, 0);
+  memcpy(cmd.slots, cp->slots, cp->n * sizeof(patternslot));
+  cmd.nslots = cp->n;
+  cmd.fill = 1;
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "Error stopping play.");
-    return 2;
-  }
+  return dispatchGroup(L, &cmd);
 }
 
-/*** Retrieves information on current play state.
- *
- * Displays information about the pattern loaded into the device.
- * The <code>count</code> value decreases by one each time the pattern
- * repeats and is 0 when the pattern has played the specified number
- * of times &mdash; unless the count was 0 when the play command was issued;
- * in which case, the pattern repeats indefinitely and count is always 0.
- *
- * @function readplay
- * @treturn bool true if pattern is playing
- * @treturn int start position
- * @treturn int end position
- * @treturn int count
- * @treturn int current position
- *
-*/
-static int lfun_readplay(lua_State *L) {
-  // NOTE: playcount counts down to 0 -- unless it started at 0
-  // TODO: document the return value(s).
-  // TODO: maybe return as a table instead ?
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+static int lfun_groupReadPattern(lua_State *L) {
+  command cmd = { .op = OP_READPATTERN, .errmsg = "could not read pattern" };
+  checkReadOptions(L, 2, &cmd);
 
-  uint8_t playing;
-  uint8_t playstart;
-  uint8_t playend;
-  uint8_t playcount;
-  uint8_t playpos;
+  return dispatchGroup(L, &cmd);
+}
 
-  int result = blink1_readPlayState(bd->device, &playing, &playstart,
-                                    &playend, &playcount, &playpos);
+static int lfun_groupSavePattern(lua_State *L) {
+  command cmd = { .op = OP_SAVEPATTERN, .errmsg = "Error saving pattern." };
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, playing);
-    lua_pushinteger(L, playstart);
-    lua_pushinteger(L, playend);
-    lua_pushinteger(L, playcount);
-    lua_pushinteger(L, playpos);
-    return 5;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "could not retrieve playstate");
-    return 2;
-  }
+  return dispatchGroup(L, &cmd);
 }
 
-/*** Write pattern description for specified position.
+/*** Server Methods
  *
- * @function setpattpos
- * @tparam int millis the length of time to display
- * @tparam int r the red value to display
- * @tparam int g the green value to display
- * @tparam int b the blue value to display
- * @tparam int pos the position to set
+ * @section server
  *
  */
-static int lfun_setPatternPosition(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
 
-  int millis = luaL_checkinteger(L, 2);
-  int r = luaL_checkinteger(L, 3);
-  int g = luaL_checkinteger(L, 4);
-  int b = luaL_checkinteger(L, 5);
-  int pos = luaL_checkinteger(L, 6);
-
-  luaL_argcheck(L, ( -1 < millis && millis < 32768), 2, "milliseconds must be in range [0, 32768]");
-  luaL_argcheck(L, ( -1 < r && r < 256), 3, BADRED_MSG);
-  luaL_argcheck(L, ( -1 < g && g < 256), 4, BADGREEN_MSG);
-  luaL_argcheck(L, ( -1 < b && b < 256), 5, BADBLUE_MSG);
-  // TODO: make upper bound dependent on whether it's a mk2, etc
-  luaL_argcheck(L, ( -1 < pos && pos < 32 ), 6, "position must be in range [0, 32)");
-
-
-  int result = blink1_writePatternLine(bd->device, millis, r, g, b, pos);
+/*** Stops the server.
+ *
+ * Clients are disconnected and the devices turned off and closed.
+ *
+ * @function close
+ *
+ */
+static int lfun_serverClose(lua_State *L) {
+  server *sv = luaL_checkudata(L, 1, SERVER_TYPENAME);
+  stopServer(sv);
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    // TODO: add pos to error message
-    lua_pushstring(L, "Could not write pattern line");
-    return 2;
-  }
+  return 0;
 }
 
-/*** Read pattern description at specified position.
+/*** Returns counters for the server.
  *
- * @function getpattpos
- * @tparam int pos the position to read
- * @treturn int millis the length of time to display
- * @treturn int r the red value displayed
- * @treturn int g the green value displayed
- * @treturn int b the blue value displayed
+ * The table has fields <code>clients</code>, the number connected now,
+ * <code>accepted</code>, the number of connections ever made,
+ * <code>requests</code> and <code>coalesced</code>, the number of requests
+ * answered without being sent because a later one replaced them.
+ *
+ * @function stats
+ * @treturn table the counters
  *
  */
-static int lfun_getPatternPosition(lua_State *L) {
-  // TODO: return value as table?
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  
-  int pos = luaL_checkinteger(L, 2);
-  // TODO: make upper bound dependent on whether it's a mk2, etc
-  luaL_argcheck(L, ( -1 < pos && pos < 32), 2, "position must be in range [0, 32)");
+static int lfun_serverStats(lua_State *L) {
+  server *sv = luaL_checkudata(L, 1, SERVER_TYPENAME);
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, atomic_load(&sv->clients));
+  lua_setfield(L, -2, "clients");
+  lua_pushinteger(L, atomic_load(&sv->accepted));
+  lua_setfield(L, -2, "accepted");
+  lua_pushinteger(L, atomic_load(&sv->requests));
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, atomic_load(&sv->coalesced));
+  lua_setfield(L, -2, "coalesced");
 
-  uint16_t millis;
-  uint8_t r;
-  uint8_t g;
-  uint8_t b;
+  return 1;
+}
 
-  int result = blink1_readPatternLine(bd->device, &millis, &r, &g, &b, pos);
+static int lfun_serverTostring(lua_State *L) {
+  server *sv = luaL_checkudata(L, 1, SERVER_TYPENAME);
 
-  if (result != BLINK1_ERR) {
-    lua_pushinteger(L, pos);
-    lua_pushinteger(L, millis);
-    lua_pushinteger(L, r);
-    lua_pushinteger(L, g);
-    lua_pushinteger(L, b);
-    return 5;
+  if (sv->running) {
+    lua_pushfstring(L, SERVER_STRING_FMT, sv->path);
   } else {
-    lua_pushnil(L);
-    // TODO: add pos to error message
-    lua_pushstring(L, "Could not read pattern line");
-    return 2;
+    lua_pushfstring(L, SERVER_STRING_FMT, "closed");
   }
+
+  return 1;
 }
 
-/*** Clears the entire pattern.
- *
- * @function clearpattern
- *
- */
-static int lfun_clearPattern(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+static int lfun_poolGc(lua_State *L) {
+  workpool *pool = luaL_checkudata(L, 1, POOL_TYPENAME);
+  stopPool(pool);
 
-  // TODO: adjust the upper bound based on which version blink the device is
-  for (int i = 0; i <= 32; i++) {
-    // TODO: do something with result
-    /*int result = */blink1_writePatternLine(bd->device, 0, 0, 0, 0, i);
-  }
-  
   return 0;
 }
 
-/*** Returns the devices pattern in a Lua table.
+/************************************************************************************
  *
- * This function returns a description of the current pattern in the
- * device's RAM. The description is formatted as a Lua table with each
- * table entry itself a sub-table describing the color details at a particular position.
- * This sub-table has entries for the red, green and blue components as well as the time
- * (in milliseconds) to display the color. Position 0 is at index 0, position 1 at index
- * 1, etc.
- 
- * @function readpattern
- * @treturn table the current pattern
- * @see writepattern
+ * C API
  *
- */
-static int lfun_readPattern(lua_State *L) {
-  uint16_t millis;
-  uint8_t r, g, b;
+ ************************************************************************************/
 
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
+/*
+ * The flat functions declared in blink.h. A luablink handle is a blinker;
+ * the type is only kept opaque in the header. Each call checks what it
+ * must to stay within the blinker's arrays, then goes through the same
+ * paths as the corresponding method, so write-behind, dedup, correction
+ * and the statistics all apply. A handle from luablink_open has no
+ * notifier, so it never posts events, and holds a reference to the
+ * registry as a Lua state does.
+ */
 
-  lua_createtable(L, 32 + 1, 0);
-  
-  // TODO: adjust the upper bound based on which version blink the device is
-  for (int pos = 0; pos <= 32; pos++) {
-    lua_pushinteger(L, pos);
-    lua_createtable(L, 0, 4);
+LUABLINK_API luablink *luablink_open(int id, const char *serial) {
+  if (id < 0 && serial == NULL) {
+    return NULL;
+  }
 
-    // TODO: do something with result
-    // TODO: use blink1_readPatternLineN instead (which blinks does that work with?)
-    // TODO: write a helper function for setting tables...
-    /*int result = */blink1_readPatternLine(bd->device, &millis, &r, &g, &b, pos);
+  // as luaopen_blink does, since the library may not have been loaded by Lua
+  pthread_once(&gammaOnce, initGammaTables);
+  blink1_disableDegamma();
 
-    lua_pushstring(L, MILLIS_KEY);
-    lua_pushinteger(L, millis);
-    lua_settable(L, -3);
+  blinker *b = malloc(sizeof(blinker));
+  if (b == NULL) {
+    return NULL;
+  }
+  initBlinker(b);
 
-    lua_pushstring(L, RED_KEY);
-    lua_pushinteger(L, r);
-    lua_settable(L, -3);
+  registryRetain(NULL);
+  b->device = registryOpen(id, serial);
+  if (b->device == NULL) {
+    registryRelease(NULL);
+    free(b);
+    return NULL;
+  }
+  identifyDevice(b);
 
-    lua_pushstring(L, GREEN_KEY);
-    lua_pushinteger(L, g);
-    lua_settable(L, -3);
+  return (luablink *)b;
+}
 
-    lua_pushstring(L, BLUE_KEY);
-    lua_pushinteger(L, b);
-    lua_settable(L, -3);
+LUABLINK_API void luablink_close(luablink *h) {
+  closeBlinker((blinker *)h);
+}
 
-    lua_settable(L, -3);
+LUABLINK_API void luablink_free(luablink *h) {
+  if (h != NULL) {
+    closeBlinker((blinker *)h);
+    registryRelease(NULL);
+    free(h);
   }
-  
-  return 1;
 }
 
-/*** Writes a pattern ...
- * Pattern position indices run from 0 to MaxPattern - 1.
- * By "default", Lua table indices are 1-based. So t[1] is mapped
- * to pattern 0, etc.
- *
- * @function writepattern
- * @see readpattern
- *
- */
-static int lfun_writePattern(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  int patMax = luaL_len(L, -1);
+LUABLINK_API luablink *luablink_check(lua_State *L, int idx) {
+  return (luablink *)luaL_checkudata(L, idx, BLINK_TYPENAME);
+}
 
-  for (int i = 0; i < patMax; i++) {
-    // TODO: and a helper function for getting tables...
-    lua_pushinteger(L, i + 1); 
-    lua_gettable(L, -2); // gets sub-table for position i
+LUABLINK_API int luablink_set(luablink *h, uint8_t r, uint8_t g, uint8_t b) {
+  return (submitColor((blinker *)h, 1, 0, r, g, b, 0) == BLINK1_ERR) ? -1 : 0;
+}
 
-    lua_pushstring(L, MILLIS_KEY);
-    lua_gettable(L, -2);
-    uint16_t millis = (uint16_t)lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    
-    lua_pushstring(L, RED_KEY);
-    lua_gettable(L, -2);
-    uint8_t r = (uint8_t)lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    
-    lua_pushstring(L, GREEN_KEY);
-    lua_gettable(L, -2);
-    uint8_t g = (uint8_t)lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    
-    lua_pushstring(L, BLUE_KEY);
-    lua_gettable(L, -2);
-    uint8_t b = (uint8_t)lua_tointeger(L, -1);
-    lua_pop(L, 1);
+LUABLINK_API int luablink_fade(luablink *h, uint16_t millis, uint8_t r, uint8_t g, uint8_t b, uint8_t led) {
+  if (led > LED_COUNT) {
+    return -1;
+  }
 
-    printf("[%d] writing %d %d %d -- %d\n", i, r, g, b, millis);
-    blink1_writePatternLine(bd->device, millis, r, g, b, i);
-    // now drop sub-table at top of stack
-    lua_pop(L, 1);
+  return (submitColor((blinker *)h, 0, millis, r, g, b, led) == BLINK1_ERR) ? -1 : 0;
+}
+
+LUABLINK_API int luablink_get(luablink *h, uint8_t led, uint8_t *rgb, uint16_t *millis) {
+  uint16_t ms;
+
+  if (led > LED_COUNT ||
+      blinker_currentRGB((blinker *)h, &ms, &rgb[0], &rgb[1], &rgb[2], led, 0) == BLINK1_ERR) {
+    return -1;
+  }
+  if (millis != NULL) {
+    *millis = ms;
   }
 
-  // TODO: check that stack accesses are balanced...
-  // TODO: error checking
   return 0;
 }
- 
-/*** Saves pattern from RAM into flash.
- *
- * @function savepattern
- * @treturn boolean returns true if the pattern saved or nil and an error message otherwise
- *
- */
-static int lfun_savePattern(lua_State *L) {
-  blinker *bd = luaL_checkudata(L, 1, BLINK_TYPENAME);
-  
-  int result = blink1_savePattern(bd->device);
 
-  if (result != BLINK1_ERR) {
-    lua_pushboolean(L, 1);
-    return 1;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, "Error saving pattern.");
-    return 2;
+LUABLINK_API int luablink_play(luablink *h, uint8_t count, uint8_t startpos, uint8_t endpos) {
+  if (startpos > endpos || endpos >= PATTERN_SLOTS) {
+    return -1;
+  }
+
+  return (blinker_playloop((blinker *)h, PATTERNPLAY_START, startpos, endpos, count) == BLINK1_ERR) ? -1 : 0;
+}
+
+LUABLINK_API int luablink_stop(luablink *h) {
+  return (blinker_playloop((blinker *)h, PATTERNPLAY_STOP, 0, 0, 0) == BLINK1_ERR) ? -1 : 0;
+}
+
+LUABLINK_API int luablink_writepattern(luablink *h, const uint8_t *lines, size_t n) {
+  patternslot slots[PATTERN_SLOTS];
+
+  if (n > PATTERN_SLOTS || unpackLines(lines, n, slots) > -1) {
+    return -1;
+  }
+
+  uint32_t failed;
+  int sent = blinker_uploadPattern((blinker *)h, slots, 0, n, 0, &failed);
+
+  return (failed != 0) ? -1 : sent;
+}
+
+LUABLINK_API int luablink_readpattern(luablink *h, uint8_t *lines, size_t n) {
+  blinker *bd = (blinker *)h;
+  patternslot slots[PATTERN_SLOTS];
+  int count = min((size_t)bd->patternSlots, n);
+
+  uint32_t failed;
+  blinker_readPattern(bd, slots, count, &failed);
+  if (failed != 0) {
+    return -1;
   }
+  packLines(slots, count, lines);
+
+  return count;
 }
 
 /************************************************************************************
@@ -1094,6 +8994,7 @@ static int lfun_savePattern(lua_State *L) {
  *
  */
 static const luaL_Reg lblink_methods[] = {
+  {"connected", lfun_connected},
   {"isMk2", lfun_isMk2},
   {"serial", lfun_serialNumber},
   {"type", lfun_type},
@@ -1103,6 +9004,7 @@ static const luaL_Reg lblink_methods[] = {
   {"black", lfun_setBlack},
   {"blue", lfun_setBlue},
   {"brighten", lfun_brighten},
+  {"calibrate", lfun_calibrate},
   {"dim", lfun_dim},
   {"cyan", lfun_setCyan},
   {"fade", lfun_fadeToRGB}, 
@@ -1123,31 +9025,147 @@ static const luaL_Reg lblink_methods[] = {
 
   {"clearpattern", lfun_clearPattern},
   {"getpattpos", lfun_getPatternPosition},
+  {"getpatternstring", lfun_getPatternString},
   {"readpattern", lfun_readPattern},
   {"savepattern", lfun_savePattern},
+  {"setpatternstring", lfun_setPatternString},
   {"setpattpos", lfun_setPatternPosition},
   {"writepattern", lfun_writePattern},
 
+  {"animate", lfun_animate},
+  {"animating", lfun_animating},
+  {"onanimationend", lfun_onAnimationEnd},
+  {"playtimeline", lfun_playTimeline},
+  {"stopanimation", lfun_stopAnimation},
+  {"stopstream", lfun_stopStream},
+  {"stream", lfun_stream},
+  {"streaming", lfun_streaming},
+  {"streamstats", lfun_streamStats},
+
+  {"dedup", lfun_dedup},
+  {"flush", lfun_flush},
+  {"writebehind", lfun_writeBehind},
+  {"writestats", lfun_writeStats},
+
+  {"heartbeat", lfun_heartbeat},
+  {"watchdog", lfun_watchdog},
+  {"watchdogstats", lfun_watchdogStats},
+
+  {"layers", lfun_layers},
+  {"post", lfun_post},
+  {"withdraw", lfun_withdraw},
+
+  {"stats", lfun_stats},
+
+  {"fadeasync", lfun_fadeAsync},
+  {"getasync", lfun_getAsync},
+  {"readpatternasync", lfun_readPatternAsync},
+  {"savepatternasync", lfun_savePatternAsync},
+  {"setasync", lfun_setAsync},
+  {"writepatternasync", lfun_writePatternAsync},
+
   {"__gc", lfun_close},
   {"__tostring", lfun_tostring},
   {"close", lfun_close},
   {NULL, NULL}
 };
 
+/*
+ *
+ * List of methods to install in the request metatable.
+ *
+ */
+static const luaL_Reg lblink_request_methods[] = {
+  {"__gc", lfun_requestGc},
+  {"done", lfun_requestDone},
+  {"ondone", lfun_requestOnDone},
+  {"result", lfun_requestResult},
+  {"wait", lfun_requestWait},
+  {NULL, NULL}
+};
+
+/*
+ *
+ * List of methods to install in the server metatable.
+ *
+ */
+static const luaL_Reg lblink_server_methods[] = {
+  {"__gc", lfun_serverClose},
+  {"__tostring", lfun_serverTostring},
+  {"close", lfun_serverClose},
+  {"stats", lfun_serverStats},
+  {NULL, NULL}
+};
+
+/*
+ *
+ * List of methods to install in the group metatable. These share
+ * the library's thread pool as an upvalue.
+ *
+ */
+static const luaL_Reg lblink_group_methods[] = {
+  {"black", lfun_groupSetBlack},
+  {"blue", lfun_groupSetBlue},
+  {"brighten", lfun_groupBrighten},
+  {"dim", lfun_groupDim},
+  {"cyan", lfun_groupSetCyan},
+  {"fade", lfun_groupFade},
+  {"get", lfun_groupGet},
+  {"green", lfun_groupSetGreen},
+  {"magenta", lfun_groupSetMagenta},
+  {"off", lfun_groupSetOff},
+  {"on", lfun_groupSetOn},
+  {"orange", lfun_groupSetOrange},
+  {"red", lfun_groupSetRed},
+  {"set", lfun_groupSetRGB},
+  {"white", lfun_groupSetWhite},
+  {"yellow", lfun_groupSetYellow},
+
+  {"play", lfun_groupPlay},
+  {"stop", lfun_groupStop},
+
+  {"clearpattern", lfun_groupClearPattern},
+  {"readpattern", lfun_groupReadPattern},
+  {"savepattern", lfun_groupSavePattern},
+  {"setpatternstring", lfun_groupSetPatternString},
+  {"setpattpos", lfun_groupSetPatternPosition},
+  {"writepattern", lfun_groupWritePattern},
+
+  {"__len", lfun_groupLen},
+  {"__tostring", lfun_groupTostring},
+  {"close", lfun_groupClose},
+  {"devices", lfun_groupDevices},
+  {NULL, NULL}
+};
+
 /*
  *
  * List of functions to install in the library table.
  *
  */
 static const luaL_Reg lblink_functions[] = {
+  {"all", lfun_all},
+  {"blend", lfun_blend},
+  {"compiletimeline", lfun_compileTimeline},
+  {"compress", lfun_compress},
+  {"connect", lfun_connect},
+  {"convert", lfun_convert},
+  {"dispatch", lfun_dispatch},
   {"enumerate", lfun_enumerate},
+  {"fd", lfun_fd},
   {"gamma", lfun_yesDegamma},
+  {"gradient", lfun_gradient},
+  {"group", lfun_group},
   {"hsbtorgb", lfun_hsbToRgb},
   {"list", lfun_list}, 
   {"open", lfun_open},
   {"noGamma", lfun_noDegamma},
+  {"onhotplug", lfun_onHotplug},
+  {"parsepattern", lfun_parsePattern},
   {"pid", lfun_pid}, // TODO: redundant, keep the table field and zap this?
+  {"serve", lfun_serve},
   {"sleep", lfun_sleep},
+  {"stats", lfun_processStats},
   {"vid", lfun_vid}, // TODO: redundant, keep the table field and zap this?
   {NULL, NULL}
 };
@@ -1158,11 +9176,19 @@ static const luaL_Reg lblink_functions[] = {
  *
  * This function performs the following tasks:
  *
- * - create and populate the metatable for blink objects
+ * - create and populate the metatables for blink, request and server objects
+ * - create the thread pool shared by groups
+ * - create and populate the metatable for group objects
+ * - register this state with the device registry
+ * - create the cache of compiled pattern strings
  * - create and populate the library table
  *
  */
 LUABLINK_API int luaopen_blink(lua_State *L) {
+  // colors are corrected per device; see Color Correction
+  pthread_once(&gammaOnce, initGammaTables);
+  blink1_disableDegamma();
+
   // Blink metatable
   luaL_newmetatable(L, BLINK_TYPENAME);
 
@@ -1171,6 +9197,70 @@ LUABLINK_API int luaopen_blink(lua_State *L) {
 
   luaL_setfuncs(L, lblink_methods, 0);
 
+  // Request metatable
+  luaL_newmetatable(L, REQUEST_TYPENAME);
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_setfuncs(L, lblink_request_methods, 0);
+  lua_pop(L, 1);
+
+  // Server metatable
+  luaL_newmetatable(L, SERVER_TYPENAME);
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_setfuncs(L, lblink_server_methods, 0);
+  lua_pop(L, 1);
+
+  // Thread pool; its __gc joins the worker threads when the state is closed
+  workpool *pool = lua_newuserdatauv(L, sizeof(workpool), 0);
+  initPool(pool);
+  luaL_newmetatable(L, POOL_TYPENAME);
+  lua_pushcfunction(L, lfun_poolGc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+
+  // Group metatable
+  luaL_newmetatable(L, GROUP_TYPENAME);
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, lblink_group_methods, 1);
+  lua_pop(L, 2);
+
+  // Hotplug state; its __gc stops the registry's watcher thread once no state uses it
+  hotplug *h = lua_newuserdatauv(L, sizeof(hotplug), 4);
+  h->generation = 0;
+  h->events = NULL;
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 1);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 2);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 3);
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushstring(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setiuservalue(L, -2, 4);
+  luaL_newmetatable(L, HOTPLUG_TYPENAME);
+  lua_pushcfunction(L, lfun_hotplugGc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  h->events = newNotifier();
+  registryRetain(h->events);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &attached);
+
+  // Compiled pattern strings
+  lua_newtable(L);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &patternCache);
+
   // library table
   luaL_newlib(L, lblink_functions);
 
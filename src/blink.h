@@ -6,6 +6,9 @@
 * Matthew M. Burke <matthew@bluedino.net>
 * 2014-08-09
 \*=========================================================================*/
+#include <stddef.h>
+#include <stdint.h>
+
 #include "lua.h"
 
 extern const char * LUABLINK_VERSION;
@@ -23,6 +26,46 @@ extern const char * LUABLINK_VERSION;
 \*-------------------------------------------------------------------------*/
 LUABLINK_API int luaopen_blink(lua_State *L);
 
+/*-------------------------------------------------------------------------*\
+* Flat C API, for callers that don't go through the Lua API, such as the
+* FFI binding in blinkffi.lua (written for LuaJIT, not yet tested on it).
+* A handle comes either from
+* luablink_open, and is the caller's until luablink_free, or from a blink(1)
+* object on a Lua stack, and is valid while that object is reachable.
+* Calls do what the method of the same name does and return 0 (or a count)
+* on success, or -1 on failure or if an argument is out of range.
+\*-------------------------------------------------------------------------*/
+typedef struct luablink luablink;
+
+/* a pattern line: millis (big endian, 2 bytes), red, green, blue, led */
+#define LUABLINK_LINE_LEN 6
+
+/* Opens the device with ID <id>, or with <serial> if id is -1; NULL on failure. */
+LUABLINK_API luablink *luablink_open(int id, const char *serial);
+/* Turns the device off and detaches it; later calls fail. Closing a closed
+   handle, including through luablink_free, does nothing more. */
+LUABLINK_API void luablink_close(luablink *h);
+/* Closes a handle from luablink_open, if need be, and frees it. */
+LUABLINK_API void luablink_free(luablink *h);
+
+/* Returns the handle of the blink(1) object at <idx>, raising an error if it isn't one. */
+LUABLINK_API luablink *luablink_check(lua_State *L, int idx);
+
+LUABLINK_API int luablink_set(luablink *h, uint8_t r, uint8_t g, uint8_t b);
+LUABLINK_API int luablink_fade(luablink *h, uint16_t millis, uint8_t r, uint8_t g, uint8_t b, uint8_t led);
+
+/* Stores LED <led>'s color in rgb[0..2] and its fade millis in <millis>, which may be NULL. */
+LUABLINK_API int luablink_get(luablink *h, uint8_t led, uint8_t *rgb, uint16_t *millis);
+
+LUABLINK_API int luablink_play(luablink *h, uint8_t count, uint8_t startpos, uint8_t endpos);
+LUABLINK_API int luablink_stop(luablink *h);
+
+/* Writes <n> packed lines to pattern positions 0 to n - 1; returns the number of lines sent. */
+LUABLINK_API int luablink_writepattern(luablink *h, const uint8_t *lines, size_t n);
+
+/* Reads up to <n> lines of pattern RAM, packed, into <lines>; returns the number read. */
+LUABLINK_API int luablink_readpattern(luablink *h, uint8_t *lines, size_t n);
+
 #endif /* LUABLINK_H */
 
 
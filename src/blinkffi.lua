@@ -0,0 +1,194 @@
+-- FFI binding to the flat C API declared in blink.h, written for LuaJIT but
+-- not yet tested on it.
+--
+-- On LuaJIT, require 'blinkffi' loads the blink library with ffi.load and
+-- calls it directly, with no trip through the Lua C API:
+--
+--     local blink = require 'blinkffi'
+--     local d = blink.open()
+--     d:set(255, 0, 0)
+--
+-- Objects returned by open have the set, fade, get, play, stop,
+-- writepattern, readpattern and close methods, which take and return what
+-- the methods of the same name in the C module do, except that patterns are
+-- packed strings only, as returned by readpattern{packed = true}. Failures
+-- return nil and a message; bad arguments raise an error. An object is
+-- closed, if it hasn't been already, and freed when it is collected.
+--
+-- Anywhere else (PUC Lua, or a LuaJIT without the library on package.cpath)
+-- this just returns require 'blink'.
+
+local hasffi, ffi = pcall(require, 'ffi')
+if not hasffi or type(jit) ~= 'table' then
+   return require 'blink'
+end
+
+ffi.cdef[[
+typedef struct luablink luablink;
+
+luablink *luablink_open(int id, const char *serial);
+void luablink_close(luablink *h);
+void luablink_free(luablink *h);
+
+int luablink_set(luablink *h, uint8_t r, uint8_t g, uint8_t b);
+int luablink_fade(luablink *h, uint16_t millis, uint8_t r, uint8_t g, uint8_t b, uint8_t led);
+int luablink_get(luablink *h, uint8_t led, uint8_t *rgb, uint16_t *millis);
+int luablink_play(luablink *h, uint8_t count, uint8_t startpos, uint8_t endpos);
+int luablink_stop(luablink *h);
+/* const uint8_t * in blink.h; declared so a Lua string can be passed as is */
+int luablink_writepattern(luablink *h, const char *lines, size_t n);
+int luablink_readpattern(luablink *h, uint8_t *lines, size_t n);
+]]
+
+local path = package.searchpath('blink', package.cpath)
+local loaded, lib = pcall(ffi.load, path or 'blink')
+if not loaded then
+   return require 'blink'
+end
+
+local LINE_LEN = 6
+local PATTERN_SLOTS = 32
+local LED_COUNT = 2
+
+-- scratch buffers; calls run to completion, so one of each is enough
+local rgb = ffi.new('uint8_t[3]')
+local millis = ffi.new('uint16_t[1]')
+local lines = ffi.new('uint8_t[?]', PATTERN_SLOTS * LINE_LEN)
+
+
+local function argcheck(cond, arg, msg, level)
+   if not cond then
+      error(string.format('bad argument #%d (%s)', arg, msg), level or 3)
+   end
+end
+
+local function inrange(v, lo, hi)
+   return type(v) == 'number' and v == math.floor(v) and v >= lo and v <= hi
+end
+
+-- Returns the color given as r, g, b or as a packed 3 byte string at <arg>,
+-- and the index of the argument after it. A string that converts to a number
+-- is taken as the red value.
+local function checkcolor(arg, r, g, b)
+   if type(r) == 'string' and tonumber(r) == nil then
+      argcheck(#r == 3, arg, 'packed color must be a 3 byte string', 4)
+      local pr, pg, pb = r:byte(1, 3)
+      return pr, pg, pb, g, arg + 1
+   end
+
+   r, g, b = tonumber(r) or r, tonumber(g) or g, tonumber(b) or b
+   argcheck(inrange(r, 0, 255), arg, 'red value must be in range [0, 255]', 4)
+   argcheck(inrange(g, 0, 255), arg + 1, 'green value must be in range [0, 255]', 4)
+   argcheck(inrange(b, 0, 255), arg + 2, 'blue value must be in range [0, 255]', 4)
+   return r, g, b, nil, arg + 3
+end
+
+
+local methods = {}
+
+function methods:set(r, g, b)
+   r, g, b = checkcolor(2, r, g, b)
+
+   if lib.luablink_set(self, r, g, b) ~= 0 then
+      return nil, 'could not set RGB'
+   end
+   return true
+end
+
+function methods:fade(ms, r, g, b, led)
+   argcheck(inrange(ms, 0, 65535), 2, 'millis must be in range [0, 65535]')
+   local rest, ledarg
+   r, g, b, rest, ledarg = checkcolor(3, r, g, b)
+   if rest ~= nil then led = rest end
+   led = led or 0
+   argcheck(inrange(led, 0, LED_COUNT), ledarg, 'led must be 0, 1 or 2')
+
+   if lib.luablink_fade(self, ms, r, g, b, led) ~= 0 then
+      return nil, string.format('Could not fade to (%d, %d, %d)', r, g, b)
+   end
+   return true
+end
+
+function methods:get(led)
+   led = led or 0
+   argcheck(inrange(led, 0, LED_COUNT), 2, 'led must be 0, 1 or 2')
+
+   if lib.luablink_get(self, led, rgb, millis) ~= 0 then
+      return nil, 'could not retrieve rgb'
+   end
+   return rgb[0], rgb[1], rgb[2], millis[0]
+end
+
+function methods:play(count, startpos, endpos)
+   count, startpos, endpos = count or 0, startpos or 0, endpos or 0
+   argcheck(inrange(startpos, 0, PATTERN_SLOTS - 1), 3, 'starting position must be in range [0, 32)')
+   argcheck(inrange(endpos, 0, PATTERN_SLOTS - 1), 4, 'ending position must be in range [0, 32)')
+   argcheck(startpos <= endpos, 3, 'start position must be before end position')
+   argcheck(inrange(count, 0, 255), 2, 'count must be in range [0, 255]')
+
+   if lib.luablink_play(self, count, startpos, endpos) ~= 0 then
+      return nil, 'error starting play.'
+   end
+   return true
+end
+
+function methods:stop()
+   if lib.luablink_stop(self) ~= 0 then
+      return nil, 'Error stopping play.'
+   end
+   return true
+end
+
+function methods:writepattern(pattern)
+   argcheck(type(pattern) == 'string' and #pattern % LINE_LEN == 0 and #pattern <= PATTERN_SLOTS * LINE_LEN,
+            2, 'packed pattern must be a string of at most 32 6 byte lines')
+   local n = #pattern / LINE_LEN
+   for i = 0, n - 1 do
+      local led = pattern:byte(i * LINE_LEN + LINE_LEN)
+      argcheck(led <= LED_COUNT, 2, string.format('pattern line %d: led must be 0, 1 or 2', i))
+   end
+
+   local sent = lib.luablink_writepattern(self, pattern, n)
+   if sent < 0 then
+      return nil, 'could not write pattern lines'
+   end
+   return sent
+end
+
+function methods:readpattern()
+   local n = lib.luablink_readpattern(self, lines, PATTERN_SLOTS)
+   if n < 0 then
+      return nil, 'could not read pattern lines'
+   end
+   return ffi.string(lines, n * LINE_LEN)
+end
+
+-- the handle stays allocated until it is collected; closing it again then is harmless
+function methods:close()
+   lib.luablink_close(self)
+end
+
+ffi.metatype('luablink', { __index = methods })
+
+
+local blink = {}
+
+-- Opens the device with the given ID or 8 hex digit serial number (default 0).
+function blink.open(spec)
+   local h
+   if type(spec) == 'string' and #spec == 8 and spec:match('^%x+$') then
+      h = lib.luablink_open(-1, spec)
+   else
+      local id = tonumber(spec or 0)
+      argcheck(inrange(id, 0, math.huge), 1,
+               'ID must be either an integer in [0, n-1] (n = number of attached blinks) or a valid serial number.')
+      h = lib.luablink_open(id, nil)
+   end
+
+   if h == nil then
+      error(string.format('Could not open blink(1) %s.', tostring(spec or 0)), 2)
+   end
+   return ffi.gc(h, lib.luablink_free)
+end
+
+return blink
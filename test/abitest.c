@@ -0,0 +1,95 @@
+/*
+ * Checks the flat C API in blink.h, as the FFI binding uses it, against the
+ * simulator: round trips through set, fade, get, writepattern and
+ * readpattern, the failures for out of range arguments, and closing.
+ *
+ * usage: abitest
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "blink.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static void sleepMillis(long millis) {
+  struct timespec ts = { millis / 1000, (millis % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+}
+
+static int hasColor(luablink *h, uint8_t led, uint8_t r, uint8_t g, uint8_t b) {
+  uint8_t rgb[3];
+
+  return luablink_get(h, led, rgb, NULL) == 0 && rgb[0] == r && rgb[1] == g && rgb[2] == b;
+}
+
+int main(void) {
+  check(luablink_open(-1, NULL) == NULL, "open with neither an ID nor a serial fails");
+
+  luablink *h = luablink_open(0, NULL);
+  if (h == NULL) {
+    puts("FAILED: open");
+    return 1;
+  }
+
+  check(luablink_set(h, 10, 20, 30) == 0, "set");
+  check(hasColor(h, 1, 10, 20, 30) && hasColor(h, 2, 10, 20, 30), "get after set");
+
+  uint8_t rgb[3];
+  uint16_t millis;
+  check(luablink_fade(h, 100, 40, 50, 60, 2) == 0, "fade");
+  sleepMillis(300);
+  check(hasColor(h, 2, 40, 50, 60), "get after fade");
+  check(hasColor(h, 1, 10, 20, 30), "fade leaves the other LED alone");
+  check(luablink_get(h, 1, rgb, &millis) == 0, "get with millis");
+
+  check(luablink_fade(h, 100, 1, 2, 3, 3) == -1, "fade with a bad LED fails");
+  check(luablink_get(h, 3, rgb, NULL) == -1, "get with a bad LED fails");
+
+  // only full and zero levels come back unchanged, since colors are corrected for the LEDs
+  uint8_t lines[4 * LUABLINK_LINE_LEN] = {
+    0x01, 0xf4, 255, 0, 0, 1,
+    0x00, 0x64, 0, 255, 0, 2,
+    0x03, 0xe8, 0, 0, 255, 0,
+    0x00, 0x0a, 255, 255, 0, 0
+  };
+  uint8_t back[4 * LUABLINK_LINE_LEN];
+  check(luablink_writepattern(h, lines, 4) > 0, "writepattern");
+  check(luablink_readpattern(h, back, 4) == 4, "readpattern count");
+  check(memcmp(lines, back, sizeof(lines)) == 0, "readpattern returns what was written");
+  check(luablink_writepattern(h, lines, 4) == 0, "writepattern skips unchanged lines");
+
+  uint8_t badled[LUABLINK_LINE_LEN] = { 0, 100, 1, 2, 3, 3 };
+  uint8_t toomany[33 * LUABLINK_LINE_LEN] = { 0 };
+  check(luablink_writepattern(h, badled, 1) == -1, "writepattern with a bad LED fails");
+  check(luablink_writepattern(h, toomany, 33) == -1, "writepattern with too many lines fails");
+
+  check(luablink_play(h, 0, 2, 1) == -1, "play with start after end fails");
+  check(luablink_play(h, 0, 0, 32) == -1, "play past the last position fails");
+  check(luablink_play(h, 1, 0, 1) == 0, "play");
+  check(luablink_stop(h) == 0, "stop");
+
+  luablink_close(h);
+  check(luablink_set(h, 1, 2, 3) == -1, "set after close fails");
+  check(luablink_get(h, 1, rgb, NULL) == -1, "get after close fails");
+  check(luablink_readpattern(h, back, 4) == -1, "readpattern after close fails");
+  luablink_close(h);
+  luablink_free(h);
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  puts("Success");
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Benchmark host.
+ *
+ * Runs a Lua script with the blink library linked in (normally against the
+ * stand-in libblink1 in blink1sim.c) and a counting allocator, and gives the
+ * script a bench table with:
+ *
+ * - bench.now(): a monotonic clock, in seconds
+ * - bench.allocs(): the number of allocations made by Lua so far, and their total size in bytes
+ *
+ * usage: bench script.lua [args...]
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "blink.h"
+
+static lua_Integer allocations = 0;
+static lua_Integer allocated = 0;
+
+static void *countingAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  (void)ud;
+
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  // osize holds a type tag, not a size, when ptr is NULL
+  size_t old = (ptr != NULL) ? osize : 0;
+  if (nsize > old) {
+    allocations++;
+    allocated += nsize - old;
+  }
+
+  return realloc(ptr, nsize);
+}
+
+static int lfun_now(lua_State *L) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, ts.tv_sec + ts.tv_nsec / 1e9);
+
+  return 1;
+}
+
+static int lfun_allocs(lua_State *L) {
+  lua_pushinteger(L, allocations);
+  lua_pushinteger(L, allocated);
+
+  return 2;
+}
+
+static const luaL_Reg bench_functions[] = {
+  {"allocs", lfun_allocs},
+  {"now", lfun_now},
+  {NULL, NULL}
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s script.lua [args...]\n", argv[0]);
+    return 2;
+  }
+
+  lua_State *L = lua_newstate(countingAlloc, NULL);
+  if (L == NULL) {
+    fprintf(stderr, "%s: cannot create Lua state\n", argv[0]);
+    return 1;
+  }
+  luaL_openlibs(L);
+
+  // require 'blink' finds the library linked into this program
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+  lua_pushcfunction(L, luaopen_blink);
+  lua_setfield(L, -2, "blink");
+  lua_pop(L, 1);
+
+  luaL_newlib(L, bench_functions);
+  lua_setglobal(L, "bench");
+
+  lua_createtable(L, argc, 0);
+  for (int i = 1; i < argc; i++) {
+    lua_pushstring(L, argv[i]);
+    lua_rawseti(L, -2, i - 1);
+  }
+  lua_setglobal(L, "arg");
+
+  int status = luaL_dofile(L, argv[1]);
+  if (status != LUA_OK) {
+    fprintf(stderr, "%s: %s\n", argv[0], lua_tostring(L, -1));
+  }
+  lua_close(L);
+
+  return (status == LUA_OK) ? 0 : 1;
+}
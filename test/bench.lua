@@ -0,0 +1,285 @@
+-- Benchmarks every method of a blink object and every function in the library.
+--
+-- Run with the bench host (see Makefile), which links the library against the
+-- simulated blink(1) in blink1sim.c:
+--
+--     BLINK1_SIM_LATENCY_US=0 ./bench bench.lua [iterations] [name...]
+--
+-- Writes one JSON object per line to stdout, one for each method or function:
+--
+--     {"kind":"method","name":"set","iterations":1000,"calls_per_sec":...,
+--      "p50_us":...,"p99_us":...,"allocs_per_call":...,"bytes_per_call":...}
+--
+-- Entries the script doesn't know how to call are reported with "skipped":true,
+-- so new methods show up in the output even before a benchmark is written for them.
+-- Allocations are those made through Lua's allocator.
+
+local blink = require 'blink'
+
+local iterations = tonumber(arg[1]) or 100
+local only = {}
+for i = 2, #arg do only[arg[i]] = true end
+
+local latency = tonumber(os.getenv('BLINK1_SIM_LATENCY_US')) or 1000
+
+local pattern = {}
+for i = 1, 32 do
+   pattern[i] = { millis = 100, red = i, green = 255 - i, blue = 0 }
+end
+local patternstring = '0,#ff0000,0.5,0,#00ff00,0.5,0,#0000ff,0.5,0'
+local timeline = { { millis = 0, red = 1, wait = 1000 } }
+local frames = string.rep(string.pack('BBB', 255, 0, 0), 100)
+local palette = string.rep(string.pack('BBB', 10, 200, 30), 256)
+local socket = os.tmpname()
+os.remove(socket)
+local function noop() end
+
+
+-- Each entry is either the call itself, or a table with setup, call and
+-- teardown functions. setup's results are passed to call, and call's to
+-- teardown; neither setup nor teardown is timed.
+local methods = {
+   connected = function(d) d:connected() end,
+   isMk2 = function(d) d:isMk2() end,
+   serial = function(d) d:serial() end,
+   type = function(d) d:type() end,
+   typestring = function(d) d:typestring() end,
+   version = function(d) d:version() end,
+
+   black = function(d) d:black() end,
+   blue = function(d) d:blue() end,
+   brighten = function(d) d:brighten() end,
+   calibrate = function(d) d:calibrate{ gamma = 2.2, red = 1, green = 0.8, blue = 0.7 } end,
+   cyan = function(d) d:cyan() end,
+   dim = function(d) d:dim() end,
+   fade = function(d) d:fade(100, 10, 20, 30, 0) end,
+   get = function(d) d:get() end,
+   green = function(d) d:green() end,
+   magenta = function(d) d:magenta() end,
+   off = function(d) d:off() end,
+   on = function(d) d:on() end,
+   orange = function(d) d:orange() end,
+   red = function(d) d:red() end,
+   set = function(d) d:set(10, 20, 30) end,
+   white = function(d) d:white() end,
+   yellow = function(d) d:yellow() end,
+
+   play = function(d) d:play(0, 0, 31) end,
+   readplay = function(d) d:readplay() end,
+   stop = function(d) d:stop() end,
+
+   clearpattern = function(d) d:clearpattern() end,
+   getpattpos = function(d) d:getpattpos(0) end,
+   getpatternstring = function(d) d:getpatternstring() end,
+   readpattern = function(d) d:readpattern() end,
+   savepattern = function(d) d:savepattern() end,
+   setpatternstring = function(d) d:setpatternstring(patternstring) end,
+   setpattpos = function(d) d:setpattpos(100, 1, 2, 3, 0) end,
+   writepattern = function(d) d:writepattern(pattern) end,
+
+   animate = {
+      call = function(d) d:animate(timeline, 0) end,
+      teardown = function(d) d:stopanimation() end,
+   },
+   animating = function(d) d:animating() end,
+   onanimationend = function(d) d:onanimationend(noop) end,
+   playtimeline = {
+      call = function(d) d:playtimeline(timeline, 0) end,
+      teardown = function(d) d:stop() end,
+   },
+   stopanimation = function(d) d:stopanimation() end,
+   stopstream = function(d) d:stopstream() end,
+   stream = {
+      call = function(d) d:stream(frames, 100, { count = 0 }) end,
+      teardown = function(d) d:stopstream() end,
+   },
+   streaming = function(d) d:streaming() end,
+   streamstats = function(d) d:streamstats() end,
+
+   dedup = function(d) d:dedup(false) end,
+   flush = function(d) d:flush() end,
+   writebehind = function(d) d:writebehind(false) end,
+   writestats = function(d) d:writestats() end,
+
+   stats = function(d) d:stats() end,
+
+   heartbeat = function(d) d:heartbeat() end,
+   watchdog = {
+      call = function(d) d:watchdog{ timeout = 1000 } end,
+      teardown = function(d) d:watchdog(false) end,
+   },
+   watchdogstats = function(d) d:watchdogstats() end,
+
+   layers = function(d) d:layers() end,
+   post = {
+      call = function(d) d:post('bench', { red = 10, green = 20, blue = 30, ttl = 1000 }) end,
+      teardown = function(d) d:withdraw('bench') end,
+   },
+   withdraw = {
+      setup = function(d) d:post('bench', { red = 10, green = 20, blue = 30 }); return d end,
+      call = function(d) d:withdraw('bench') end,
+   },
+
+   fadeasync = function(d) d:fadeasync(100, 10, 20, 30, 0):result() end,
+   getasync = function(d) d:getasync():result() end,
+   readpatternasync = function(d) d:readpatternasync():result() end,
+   savepatternasync = function(d) d:savepatternasync():result() end,
+   setasync = function(d) d:setasync(10, 20, 30):result() end,
+   writepatternasync = function(d) d:writepatternasync(pattern):result() end,
+
+   __gc = {
+      setup = function() return blink.open(0) end,
+      call = function(x) getmetatable(x).__gc(x) end,
+   },
+   __tostring = function(d) tostring(d) end,
+   close = {
+      setup = function() return blink.open(0) end,
+      call = function(x) x:close() end,
+   },
+}
+
+local functions = {
+   all = {
+      call = function() return blink.all() end,
+      teardown = function(g) g:close() end,
+   },
+   blend = function() blink.blend(palette, palette, 100) end,
+   compiletimeline = function() blink.compiletimeline(timeline, 0) end,
+   compress = function() blink.compress(palette, 100) end,
+   connect = {
+      setup = function() return blink.serve(socket) end,
+      call = function(s) return { s, blink.connect(socket) } end,
+      teardown = function(c) c[2]:close(); c[1]:close() end,
+   },
+   convert = function() blink.convert(palette, 'hsb', 'rgb') end,
+   dispatch = function() blink.dispatch() end,
+   enumerate = function() blink.enumerate() end,
+   fd = function() blink.fd() end,
+   gamma = function() blink.gamma() end,
+   gradient = function() blink.gradient('\0\0\0', '\255\255\255', 256) end,
+   group = {
+      setup = function() return blink.open(0) end,
+      call = function(d) return blink.group{ d } end,
+      teardown = function(g) g:close() end,
+   },
+   hsbtorgb = function() blink.hsbtorgb(10, 200, 255) end,
+   list = function() blink.list() end,
+   noGamma = function() blink.noGamma() end,
+   onhotplug = function() blink.onhotplug(noop) end,
+   open = {
+      call = function() return blink.open(0) end,
+      teardown = function(d) d:close() end,
+   },
+   parsepattern = function() blink.parsepattern(patternstring) end,
+   pid = function() blink.pid() end,
+   serve = {
+      call = function() return blink.serve(socket) end,
+      teardown = function(s) s:close() end,
+   },
+   sleep = function() blink.sleep(0) end,
+   stats = function() blink.stats() end,
+   vid = function() blink.vid() end,
+}
+
+
+local function percentile(sorted, p)
+   local i = math.max(1, math.ceil(#sorted * p))
+   return sorted[i]
+end
+
+local function json(fields, order)
+   local out = {}
+   for _, k in ipairs(order) do
+      local v = fields[k]
+      if v ~= nil then
+         if type(v) == 'string' then
+            v = '"' .. v:gsub('[%c"\\]', function(c) return string.format('\\u%04x', c:byte()) end) .. '"'
+         elseif type(v) == 'number' and math.type(v) == 'float' then
+            v = string.format('%.3f', v)
+         else
+            v = tostring(v)
+         end
+         out[#out + 1] = string.format('"%s":%s', k, v)
+      end
+   end
+   return '{' .. table.concat(out, ',') .. '}'
+end
+
+local order = { 'kind', 'name', 'skipped', 'error', 'iterations', 'latency_us', 'calls_per_sec',
+   'p50_us', 'p99_us', 'allocs_per_call', 'bytes_per_call' }
+
+local function run(kind, name, spec, subject)
+   if type(spec) == 'function' then
+      spec = { call = spec }
+   end
+
+   local samples = {}
+   local total = 0
+   local allocs, bytes = 0, 0
+
+   collectgarbage()
+   for i = 1, iterations do
+      local state = subject
+      if spec.setup then state = spec.setup(subject) end
+
+      local a0, b0 = bench.allocs()
+      local t0 = bench.now()
+      local result = spec.call(state)
+      local t1 = bench.now()
+      local a1, b1 = bench.allocs()
+
+      if spec.teardown then spec.teardown(result or state) end
+
+      samples[i] = (t1 - t0) * 1e6
+      total = total + (t1 - t0)
+      allocs = allocs + (a1 - a0)
+      bytes = bytes + (b1 - b0)
+   end
+   table.sort(samples)
+
+   return {
+      kind = kind,
+      name = name,
+      iterations = iterations,
+      latency_us = latency,
+      calls_per_sec = (total > 0) and iterations / total or nil,
+      p50_us = percentile(samples, 0.50),
+      p99_us = percentile(samples, 0.99),
+      allocs_per_call = allocs / iterations,
+      bytes_per_call = bytes / iterations,
+   }
+end
+
+local function bench_all(kind, names, specs, subject)
+   table.sort(names)
+   for _, name in ipairs(names) do
+      if next(only) == nil or only[name] then
+         local spec = specs[name]
+         local result
+         if spec == nil then
+            result = { kind = kind, name = name, skipped = true }
+         else
+            local ok, r = pcall(run, kind, name, spec, subject)
+            result = ok and r or { kind = kind, name = name, error = tostring(r) }
+         end
+         print(json(result, order))
+      end
+   end
+end
+
+
+local d = blink.open(0)
+
+local names = {}
+for name, value in pairs(getmetatable(d)) do
+   if type(value) == 'function' then names[#names + 1] = name end
+end
+bench_all('method', names, methods, d)
+
+names = {}
+for name, value in pairs(blink) do
+   if type(value) == 'function' then names[#names + 1] = name end
+end
+bench_all('function', names, functions)
+
+d:close()
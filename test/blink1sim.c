@@ -0,0 +1,621 @@
+/*
+ * A simulated blink(1), used in place of libblink1 to test and benchmark the
+ * binding without hardware.
+ *
+ * Devices live in memory and behave like a mk2: fades are interpolated over
+ * time, so reading a color mid-fade returns the color the LED is showing at
+ * that moment, and a playing pattern steps through its lines on the clock,
+ * looping <count> times, just as the firmware does. Saved patterns survive
+ * closing and reopening the device, and a device left in serverdown mode
+ * past its timeout starts playing its pattern.
+ *
+ * Every USB report takes time. Reports to one device are serialized, reports
+ * to different devices are not, and reads take two reports, one to ask and
+ * one to answer. The model is configured with environment variables:
+ *
+ * - BLINK1_SIM_DEVICES: number of devices plugged in (default 1)
+ * - BLINK1_SIM_LATENCY_US: time per report, in microseconds (default 1000)
+ * - BLINK1_SIM_JITTER_US: random extra time per report, up to this many microseconds (default 0)
+ * - BLINK1_SIM_FAILRATE: probability that a report fails, in [0, 1] (default 0)
+ * - BLINK1_SIM_UNPLUG: <from>,<to>: every device is unplugged from <from> to <to> milliseconds after
+ *   the first call, as in a hub reset: reports fail and opens return NULL (default never)
+ * - BLINK1_SIM_RECORD: file to record the session's command stream in (see replay.c)
+ *
+ * A recording has one line per call that reaches a device:
+ *
+ *     <microseconds since the first call> <device> <command> <arguments...> = <result>
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blink1-lib.h"
+
+#define SIM_MAX_DEVICES 16
+#define SIM_PATTERN_SLOTS 32
+#define SIM_FIRMWARE 204
+#define SIM_REPORT_OK (blink1_report_size + 1)
+
+// the firmware counts pattern and fade times in 10 ms ticks
+#define SIM_TICK_USEC 10000
+
+typedef struct simled {
+  rgb_t from;
+  rgb_t to;
+  uint16_t millis;
+  uint64_t start;
+} simled;
+
+struct hid_device_ {
+  int id;
+  pthread_mutex_t bus;
+  simled leds[2];
+  patternline_t pattern[SIM_PATTERN_SLOTS];
+  patternline_t flash[SIM_PATTERN_SLOTS];
+  uint8_t ledn;
+  uint8_t playing, playstart, playend, playcount;
+  uint64_t playbegan;
+  uint64_t playupdated;
+  uint8_t serverdown, downstart, downend;
+  uint64_t downdeadline;
+  unsigned int seed;
+};
+
+static struct hid_device_ devices[SIM_MAX_DEVICES];
+static char serials[SIM_MAX_DEVICES][16];
+static int ndevices = 0;
+static int degamma = 1;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *recording = NULL;
+static uint64_t epoch;
+static long latency;
+static long jitter;
+static double failrate;
+static uint64_t unplugFrom, unplugTo;
+
+static uint64_t nowMicros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void simInit(void) {
+  const char *value;
+
+  latency = (value = getenv("BLINK1_SIM_LATENCY_US")) ? strtol(value, NULL, 10) : 1000;
+  jitter = (value = getenv("BLINK1_SIM_JITTER_US")) ? strtol(value, NULL, 10) : 0;
+  failrate = (value = getenv("BLINK1_SIM_FAILRATE")) ? strtod(value, NULL) : 0.0;
+
+  unsigned long from, to;
+  if ((value = getenv("BLINK1_SIM_UNPLUG")) != NULL && sscanf(value, "%lu,%lu", &from, &to) == 2) {
+    unplugFrom = (uint64_t)from * 1000;
+    unplugTo = (uint64_t)to * 1000;
+  }
+
+  if ((value = getenv("BLINK1_SIM_RECORD")) != NULL && (recording = fopen(value, "w")) == NULL) {
+    perror(value);
+  }
+
+  for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+    devices[i].id = i;
+    devices[i].seed = i + 1;
+    pthread_mutex_init(&devices[i].bus, NULL);
+  }
+  epoch = nowMicros();
+}
+
+/*
+ * Appends a line to the recording, if one is being made.
+ */
+static void record(blink1_device *dev, int result, const char *fmt, ...) {
+  if (recording == NULL) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  pthread_mutex_lock(&recordLock);
+  fprintf(recording, "%llu %d ", (unsigned long long)(nowMicros() - epoch), (dev != NULL) ? dev->id : -1);
+  vfprintf(recording, fmt, args);
+  fprintf(recording, " = %d\n", result);
+  fflush(recording);
+  pthread_mutex_unlock(&recordLock);
+  va_end(args);
+}
+
+static int unplugged(void) {
+  uint64_t now = nowMicros() - epoch;
+
+  return unplugFrom <= now && now < unplugTo;
+}
+
+/*
+ * Models <n> USB reports to <dev>: holds the device's bus for the time they
+ * take. Returns 0, or -1 if a report failed.
+ */
+static int transfer(blink1_device *dev, int n) {
+  pthread_once(&once, simInit);
+  if (dev == NULL || unplugged()) {
+    return -1;
+  }
+
+  int failed = 0;
+  pthread_mutex_lock(&dev->bus);
+  for (int i = 0; i < n; i++) {
+    long usec = latency + ((jitter > 0) ? rand_r(&dev->seed) % jitter : 0);
+    if (usec > 0) {
+      struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+      nanosleep(&ts, NULL);
+    }
+    if (failrate > 0.0 && rand_r(&dev->seed) < failrate * ((double)RAND_MAX + 1.0)) {
+      failed = 1;
+    }
+  }
+  pthread_mutex_unlock(&dev->bus);
+
+  return failed ? -1 : 0;
+}
+
+/************************************************************************************
+ *
+ * Device Model
+ *
+ * These are called with the device's bus held.
+ *
+ ************************************************************************************/
+
+static rgb_t colorAt(const simled *led, uint64_t now) {
+  uint64_t elapsed = (now - led->start) / 1000;
+  if (led->millis == 0 || elapsed >= led->millis) {
+    return led->to;
+  }
+
+  int t = (int)elapsed;
+  int span = led->millis;
+  rgb_t c;
+  c.r = led->from.r + (led->to.r - led->from.r) * t / span;
+  c.g = led->from.g + (led->to.g - led->from.g) * t / span;
+  c.b = led->from.b + (led->to.b - led->from.b) * t / span;
+
+  return c;
+}
+
+/*
+ * Starts a fade of LED <n> (0 for both) at time <start>.
+ */
+static void startFade(blink1_device *dev, uint64_t start, uint16_t millis, rgb_t to, uint8_t n) {
+  for (int i = 0; i < 2; i++) {
+    if (n == 0 || n == i + 1) {
+      simled *led = &dev->leds[i];
+      led->from = colorAt(led, start);
+      led->to = to;
+      led->millis = millis;
+      led->start = start;
+    }
+  }
+}
+
+static uint64_t lineDuration(const patternline_t *line) {
+  uint64_t ticks = (line->millis * 1000 + SIM_TICK_USEC - 1) / SIM_TICK_USEC;
+
+  return ((ticks > 0) ? ticks : 1) * SIM_TICK_USEC;
+}
+
+static uint64_t cycleDuration(const blink1_device *dev) {
+  uint64_t cycle = 0;
+  for (int pos = dev->playstart; pos <= dev->playend; pos++) {
+    cycle += lineDuration(&dev->pattern[pos]);
+  }
+
+  return cycle;
+}
+
+/*
+ * Brings the LEDs up to date with the pattern being played: applies, in
+ * order, every pattern line whose time has come since the last update.
+ * Lines more than two cycles old are skipped, since later ones supersede them.
+ */
+static void advancePlayback(blink1_device *dev, uint64_t now) {
+  if (dev->serverdown && now >= dev->downdeadline) {
+    dev->serverdown = 0;
+    dev->playing = 1;
+    dev->playstart = dev->downstart;
+    dev->playend = (dev->downend == 0 || dev->downend >= SIM_PATTERN_SLOTS) ? SIM_PATTERN_SLOTS - 1 : dev->downend;
+    dev->playcount = 0;
+    dev->playbegan = dev->playupdated = dev->downdeadline;
+  }
+  if (!dev->playing) {
+    return;
+  }
+
+  uint64_t cycle = cycleDuration(dev);
+  uint64_t end = (dev->playcount > 0) ? dev->playbegan + cycle * dev->playcount : UINT64_MAX;
+  uint64_t from = dev->playupdated;
+  if (now > 2 * cycle && now - 2 * cycle > from) {
+    from = now - 2 * cycle;
+  }
+
+  uint64_t t = dev->playbegan + (from - dev->playbegan) / cycle * cycle;
+  while (t <= now && t < end) {
+    for (int pos = dev->playstart; pos <= dev->playend && t <= now && t < end; pos++) {
+      const patternline_t *line = &dev->pattern[pos];
+      if (t >= from) {
+        startFade(dev, t, line->millis, line->color, line->ledn);
+      }
+      t += lineDuration(line);
+    }
+  }
+
+  dev->playupdated = now + 1;
+  if (now >= end) {
+    dev->playing = 0;
+  }
+}
+
+static uint8_t playPosition(blink1_device *dev, uint64_t now) {
+  if (!dev->playing) {
+    return dev->playstart;
+  }
+
+  uint64_t t = (now - dev->playbegan) % cycleDuration(dev);
+  int pos = dev->playstart;
+  while (pos < dev->playend && t >= lineDuration(&dev->pattern[pos])) {
+    t -= lineDuration(&dev->pattern[pos]);
+    pos++;
+  }
+
+  return pos;
+}
+
+/************************************************************************************
+ *
+ * blink1-lib
+ *
+ ************************************************************************************/
+
+int blink1_vid(void) { return BLINK1_VENDOR_ID; }
+int blink1_pid(void) { return BLINK1_DEVICE_ID; }
+
+int blink1_enumerate(void) {
+  pthread_once(&once, simInit);
+
+  const char *value = getenv("BLINK1_SIM_DEVICES");
+  int n = (value != NULL) ? atoi(value) : 1;
+  ndevices = (n < 0) ? 0 : (n > SIM_MAX_DEVICES) ? SIM_MAX_DEVICES : n;
+
+  for (int i = 0; i < ndevices; i++) {
+    snprintf(serials[i], sizeof(serials[i]), "2%07X", i);
+  }
+
+  return ndevices;
+}
+
+int blink1_enumerateByVidPid(int vid, int pid) {
+  (void)vid;
+  (void)pid;
+
+  return blink1_enumerate();
+}
+
+int blink1_getCachedCount(void) { return ndevices; }
+
+const char *blink1_getCachedPath(int i) {
+  return (i >= 0 && i < ndevices) ? serials[i] : NULL;
+}
+
+const char *blink1_getCachedSerial(int i) {
+  return (i >= 0 && i < ndevices) ? serials[i] : NULL;
+}
+
+int blink1_getCacheIndexBySerial(const char *serial) {
+  for (int i = 0; i < ndevices; i++) {
+    if (strcmp(serial, serials[i]) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+const char *blink1_getSerialForDev(blink1_device *dev) {
+  return (dev != NULL) ? serials[dev->id] : NULL;
+}
+
+int blink1_isMk2ById(int i) { (void)i; return 1; }
+int blink1_isMk2(blink1_device *dev) { (void)dev; return 1; }
+int blink1_deviceTypeById(int i) { (void)i; return BLINK1_MK2; }
+int blink1_deviceType(blink1_device *dev) { (void)dev; return BLINK1_MK2; }
+
+const char *blink1_deviceTypeToStr(int deviceType) {
+  switch (deviceType) {
+  case BLINK1_MK1: return "mk1";
+  case BLINK1_MK2: return "mk2";
+  case BLINK1_MK3: return "mk3";
+  default: return "unknown";
+  }
+}
+
+blink1_device *blink1_openById(uint32_t i) {
+  if (ndevices == 0) {
+    blink1_enumerate();
+  }
+  if (i >= (uint32_t)ndevices || unplugged()) {
+    return NULL;
+  }
+
+  blink1_device *dev = &devices[i];
+  pthread_mutex_lock(&dev->bus);
+  memcpy(dev->pattern, dev->flash, sizeof(dev->pattern));
+  pthread_mutex_unlock(&dev->bus);
+  record(dev, 0, "open");
+
+  return dev;
+}
+
+blink1_device *blink1_open(void) { return blink1_openById(0); }
+
+blink1_device *blink1_openBySerial(const char *serial) {
+  int i = blink1_getCacheIndexBySerial(serial);
+
+  return (i < 0) ? NULL : blink1_openById(i);
+}
+
+blink1_device *blink1_openByPath(const char *path) { return blink1_openBySerial(path); }
+
+#ifdef blink1_close
+void blink1_close_internal(blink1_device *dev) { record(dev, 0, "close"); }
+#else
+void blink1_close(blink1_device *dev) { record(dev, 0, "close"); }
+#endif
+
+int blink1_write(blink1_device *dev, void *buf, int len) {
+  (void)buf;
+  int result = (transfer(dev, 1) == 0) ? len : -1;
+  record(dev, result, "write %d", len);
+
+  return result;
+}
+
+int blink1_read(blink1_device *dev, void *buf, int len) {
+  int result = (transfer(dev, 1) == 0) ? len : -1;
+  if (result >= 0) {
+    memset(buf, 0, len);
+  }
+  record(dev, result, "read %d", len);
+
+  return result;
+}
+
+int blink1_getVersion(blink1_device *dev) {
+  int result = (transfer(dev, 2) == 0) ? SIM_FIRMWARE : -1;
+  record(dev, result, "version");
+
+  return result;
+}
+
+int blink1_fadeToRGBN(blink1_device *dev, uint16_t fadeMillis, uint8_t r, uint8_t g, uint8_t b, uint8_t n) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, now);
+    dev->playing = 0;
+    startFade(dev, now, fadeMillis, (rgb_t){ r, g, b }, n);
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "fade %u %u %u %u %u", fadeMillis, r, g, b, n);
+
+  return result;
+}
+
+int blink1_fadeToRGB(blink1_device *dev, uint16_t fadeMillis, uint8_t r, uint8_t g, uint8_t b) {
+  return blink1_fadeToRGBN(dev, fadeMillis, r, g, b, 0);
+}
+
+int blink1_setRGB(blink1_device *dev, uint8_t r, uint8_t g, uint8_t b) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    dev->playing = 0;
+    startFade(dev, now, 0, (rgb_t){ r, g, b }, 0);
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "set %u %u %u", r, g, b);
+
+  return result;
+}
+
+int blink1_readRGB(blink1_device *dev, uint16_t *fadeMillis, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t ledn) {
+  int result = (transfer(dev, 2) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, now);
+    simled *led = &dev->leds[(ledn == 2) ? 1 : 0];
+    rgb_t c = colorAt(led, now);
+    *r = c.r;
+    *g = c.g;
+    *b = c.b;
+    *fadeMillis = led->millis;
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "readrgb %u", ledn);
+
+  return result;
+}
+
+int blink1_serverdown(blink1_device *dev, uint8_t on, uint32_t millis, uint8_t st, uint8_t startpos, uint8_t endpos) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, now);
+    dev->serverdown = on;
+    dev->downstart = startpos;
+    dev->downend = endpos;
+    dev->downdeadline = now + (uint64_t)millis * 1000;
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "serverdown %u %u %u %u %u", on, millis, st, startpos, endpos);
+
+  return result;
+}
+
+int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos, uint8_t endpos, uint8_t count) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, now);
+    if (endpos == 0 || endpos >= SIM_PATTERN_SLOTS) {
+      endpos = SIM_PATTERN_SLOTS - 1;
+    }
+    dev->playing = play && startpos <= endpos;
+    dev->playstart = startpos;
+    dev->playend = endpos;
+    dev->playcount = count;
+    dev->playbegan = now;
+    dev->playupdated = now;
+    advancePlayback(dev, now);
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "playloop %u %u %u %u", play, startpos, endpos, count);
+
+  return result;
+}
+
+int blink1_play(blink1_device *dev, uint8_t play, uint8_t pos) {
+  return blink1_playloop(dev, play, pos, 0, 0);
+}
+
+int blink1_readPlayState(blink1_device *dev, uint8_t *playing, uint8_t *playstart, uint8_t *playend,
+                         uint8_t *playcount, uint8_t *playpos) {
+  int result = (transfer(dev, 2) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    uint64_t now = nowMicros();
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, now);
+    *playing = dev->playing;
+    *playstart = dev->playstart;
+    *playend = dev->playend;
+    *playcount = dev->playcount;
+    *playpos = playPosition(dev, now);
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "readplay");
+
+  return result;
+}
+
+int blink1_writePatternLine(blink1_device *dev, uint16_t fadeMillis, uint8_t r, uint8_t g, uint8_t b, uint8_t pos) {
+  int result = (transfer(dev, 1) == 0 && pos < SIM_PATTERN_SLOTS) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    pthread_mutex_lock(&dev->bus);
+    advancePlayback(dev, nowMicros());
+    dev->pattern[pos] = (patternline_t){ .color = { r, g, b }, .millis = fadeMillis, .ledn = dev->ledn };
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "writeline %u %u %u %u %u", fadeMillis, r, g, b, pos);
+
+  return result;
+}
+
+int blink1_readPatternLineN(blink1_device *dev, uint16_t *fadeMillis, uint8_t *r, uint8_t *g, uint8_t *b,
+                            uint8_t *ledn, uint8_t pos) {
+  int result = (transfer(dev, 2) == 0 && pos < SIM_PATTERN_SLOTS) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    pthread_mutex_lock(&dev->bus);
+    *fadeMillis = dev->pattern[pos].millis;
+    *r = dev->pattern[pos].color.r;
+    *g = dev->pattern[pos].color.g;
+    *b = dev->pattern[pos].color.b;
+    *ledn = dev->pattern[pos].ledn;
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "readline %u", pos);
+
+  return result;
+}
+
+int blink1_readPatternLine(blink1_device *dev, uint16_t *fadeMillis, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t pos) {
+  uint8_t ledn;
+
+  return blink1_readPatternLineN(dev, fadeMillis, r, g, b, &ledn, pos);
+}
+
+int blink1_savePattern(blink1_device *dev) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    pthread_mutex_lock(&dev->bus);
+    memcpy(dev->flash, dev->pattern, sizeof(dev->flash));
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "save");
+
+  return result;
+}
+
+int blink1_setLEDN(blink1_device *dev, uint8_t ledn) {
+  int result = (transfer(dev, 1) == 0) ? SIM_REPORT_OK : -1;
+
+  if (result >= 0) {
+    pthread_mutex_lock(&dev->bus);
+    dev->ledn = ledn;
+    pthread_mutex_unlock(&dev->bus);
+  }
+  record(dev, result, "setledn %u", ledn);
+
+  return result;
+}
+
+char *blink1_error_msg(int errCode) {
+  (void)errCode;
+
+  return "simulated error";
+}
+
+void blink1_enableDegamma(void) { degamma = 1; }
+void blink1_disableDegamma(void) { degamma = 0; }
+// the same curve as blink1-lib's; the library applies it whether or not degamma is enabled
+int blink1_degamma(int n) { return ((1 << (n / 32)) - 1) + ((1 << (n / 32)) * ((n % 32) + 1) + 15) / 32; }
+
+void blink1_sleep(uint32_t delayMillis) {
+  struct timespec ts = { delayMillis / 1000, (delayMillis % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+}
+
+void hsbtorgb(rgb_t *rgb, uint8_t *hsb) {
+  int h = hsb[0] * 6;
+  int s = hsb[1];
+  int v = hsb[2];
+  int f = h % 256;
+  uint8_t p = v * (255 - s) / 255;
+  uint8_t q = v * (255 - s * f / 255) / 255;
+  uint8_t t = v * (255 - s * (255 - f) / 255) / 255;
+
+  switch (h / 256) {
+  case 0: *rgb = (rgb_t){ v, t, p }; break;
+  case 1: *rgb = (rgb_t){ q, v, p }; break;
+  case 2: *rgb = (rgb_t){ p, v, t }; break;
+  case 3: *rgb = (rgb_t){ p, q, v }; break;
+  case 4: *rgb = (rgb_t){ t, p, v }; break;
+  default: *rgb = (rgb_t){ v, p, q }; break;
+  }
+}
@@ -0,0 +1,202 @@
+/*
+ * Replays a command stream recorded by the simulator (see blink1sim.c).
+ *
+ * Each recorded call is issued again at the time it was originally made,
+ * relative to the start of the replay, against whichever blink1 library this
+ * program is linked with: the simulator, to reproduce a session while
+ * measuring, or the real library, to play it on a device. Raw reads and
+ * writes are not replayed.
+ *
+ * When done, prints one line of JSON: the number of calls replayed and
+ * skipped, the number whose outcome (success or failure) differed from the
+ * recording, and how late calls were issued.
+ *
+ * usage: replay [-s speed] session.log
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blink1-lib.h"
+
+#define REPLAY_MAX_DEVICES 32
+#define REPLAY_LINE_LEN 256
+
+static uint64_t nowMicros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sleeps until <deadline> on the monotonic clock.
+ */
+static void sleepUntil(uint64_t deadline) {
+#if defined(TIMER_ABSTIME) && !defined(__APPLE__)
+  struct timespec ts = { deadline / 1000000, (deadline % 1000000) * 1000 };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    // interrupted; keep waiting
+  }
+#else
+  uint64_t now = nowMicros();
+  if (deadline > now) {
+    uint64_t usec = deadline - now;
+    struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  }
+#endif
+}
+
+static int compareLateness(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Issues the recorded call <cmd> with arguments <a> to <dev>. Returns the
+ * library's result, or 0 with *skipped set if the call can't be replayed.
+ */
+static int issue(blink1_device *dev, const char *cmd, const unsigned *a, int *skipped) {
+  uint16_t millis;
+  uint8_t r, g, b, n, playing, start, end, count, pos;
+
+  *skipped = 0;
+  if (strcmp(cmd, "set") == 0) {
+    return blink1_setRGB(dev, a[0], a[1], a[2]);
+  } else if (strcmp(cmd, "fade") == 0) {
+    return blink1_fadeToRGBN(dev, a[0], a[1], a[2], a[3], a[4]);
+  } else if (strcmp(cmd, "readrgb") == 0) {
+    return blink1_readRGB(dev, &millis, &r, &g, &b, a[0]);
+  } else if (strcmp(cmd, "serverdown") == 0) {
+    return blink1_serverdown(dev, a[0], a[1], a[2], a[3], a[4]);
+  } else if (strcmp(cmd, "playloop") == 0) {
+    return blink1_playloop(dev, a[0], a[1], a[2], a[3]);
+  } else if (strcmp(cmd, "readplay") == 0) {
+    return blink1_readPlayState(dev, &playing, &start, &end, &count, &pos);
+  } else if (strcmp(cmd, "writeline") == 0) {
+    return blink1_writePatternLine(dev, a[0], a[1], a[2], a[3], a[4]);
+  } else if (strcmp(cmd, "readline") == 0) {
+    return blink1_readPatternLineN(dev, &millis, &r, &g, &b, &n, a[0]);
+  } else if (strcmp(cmd, "save") == 0) {
+    return blink1_savePattern(dev);
+  } else if (strcmp(cmd, "setledn") == 0) {
+    return blink1_setLEDN(dev, a[0]);
+  } else if (strcmp(cmd, "version") == 0) {
+    return blink1_getVersion(dev);
+  }
+
+  *skipped = 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  double speed = 1.0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt == 's' && (speed = strtod(optarg, NULL)) > 0.0) {
+      continue;
+    }
+    fprintf(stderr, "usage: %s [-s speed] session.log\n", argv[0]);
+    return 2;
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-s speed] session.log\n", argv[0]);
+    return 2;
+  }
+
+  FILE *in = fopen(argv[optind], "r");
+  if (in == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  blink1_device *devices[REPLAY_MAX_DEVICES] = { NULL };
+  size_t nlate = 0;
+  size_t capacity = 1024;
+  uint64_t *lateness = malloc(capacity * sizeof(uint64_t));
+  int replayed = 0, skipped = 0, mismatched = 0;
+  char line[REPLAY_LINE_LEN];
+
+  blink1_enumerate();
+  uint64_t began = nowMicros();
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    unsigned long long t;
+    int id, expected, consumed;
+    char cmd[16];
+    unsigned a[5] = { 0 };
+
+    if (sscanf(line, "%llu %d %15s%n", &t, &id, cmd, &consumed) != 3 || id < 0 || id >= REPLAY_MAX_DEVICES) {
+      continue;
+    }
+    char *rest = line + consumed;
+    char *equals = strrchr(rest, '=');
+    if (equals == NULL || sscanf(equals + 1, "%d", &expected) != 1) {
+      continue;
+    }
+    *equals = '\0';
+    sscanf(rest, "%u %u %u %u %u", &a[0], &a[1], &a[2], &a[3], &a[4]);
+
+    if (strcmp(cmd, "open") == 0 || devices[id] == NULL) {
+      if (devices[id] == NULL && (devices[id] = blink1_openById(id)) == NULL) {
+        fprintf(stderr, "%s: could not open device %d\n", argv[0], id);
+        return 1;
+      }
+      if (strcmp(cmd, "open") == 0) {
+        continue;
+      }
+    }
+    if (strcmp(cmd, "close") == 0) {
+      continue;
+    }
+
+    uint64_t deadline = began + (uint64_t)(t / speed);
+    sleepUntil(deadline);
+    uint64_t issued = nowMicros();
+
+    int wasSkipped;
+    int result = issue(devices[id], cmd, a, &wasSkipped);
+    if (wasSkipped) {
+      skipped++;
+      continue;
+    }
+
+    replayed++;
+    if ((result < 0) != (expected < 0)) {
+      mismatched++;
+    }
+    if (nlate == capacity) {
+      capacity *= 2;
+      lateness = realloc(lateness, capacity * sizeof(uint64_t));
+    }
+    lateness[nlate++] = (issued > deadline) ? issued - deadline : 0;
+  }
+  fclose(in);
+
+  double duration = (nowMicros() - began) / 1e6;
+  qsort(lateness, nlate, sizeof(uint64_t), compareLateness);
+  uint64_t p50 = (nlate > 0) ? lateness[(nlate - 1) / 2] : 0;
+  uint64_t p99 = (nlate > 0) ? lateness[(nlate - 1) * 99 / 100] : 0;
+  uint64_t worst = (nlate > 0) ? lateness[nlate - 1] : 0;
+
+  printf("{\"replayed\":%d,\"skipped\":%d,\"mismatched\":%d,\"duration_s\":%.3f,"
+         "\"late_p50_us\":%llu,\"late_p99_us\":%llu,\"late_max_us\":%llu}\n",
+         replayed, skipped, mismatched, duration,
+         (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)worst);
+
+  for (int i = 0; i < REPLAY_MAX_DEVICES; i++) {
+    if (devices[i] != NULL) {
+      blink1_close(devices[i]);
+    }
+  }
+  free(lateness);
+
+  return 0;
+}
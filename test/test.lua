@@ -9,7 +9,7 @@ package.cpath = package.cpath .. LUA_PATH_SEP .. '../src/?.so'
 
 local function maketester(t)
    return function(library, name)
-      assert(type(library[name]) == t, string.format('%s not defined as a %s.', name, t)
+      assert(type(library[name]) == t, string.format('%s not defined as a %s.', name, t))
    end
 end
 
@@ -23,25 +23,562 @@ local testNumericDefined = maketester('number')
 
 
 
-local lblink = require 'lblink'
+local blink = require 'blink'
 
 local numericvars = {'VID', 'PID' }
 local stringvars = { '_VERSION' }
-local functions = { 'enumerate', 'list', 'open' }
+local functions = { 'all', 'blend', 'compiletimeline', 'compress', 'connect', 'convert', 'dispatch', 'enumerate',
+   'fd', 'gradient', 'group', 'list', 'onhotplug', 'open', 'parsepattern', 'serve', 'stats' }
 
 
 for _,n in ipairs(numericvars) do
-   testNumericDefined(lblink, n)
+   testNumericDefined(blink, n)
 end
 
 
 for _,s in ipairs(stringvars) do
-   testStringsDefined(lblink, s)
+   testStringsDefined(blink, s)
 end
 
 
 for _,f in ipairs(functions) do
-   testFunctionDefined(lblink, f)
+   testFunctionDefined(blink, f)
+end
+
+
+-- Without LuaJIT's FFI, the FFI binding is just the C module.
+package.path = package.path .. LUA_PATH_SEP .. '../src/?.lua'
+if type(jit) ~= 'table' then
+   assert(require 'blinkffi' == blink, 'blinkffi does not fall back to the blink module')
+end
+
+
+
+-- Behavior tests. These need a device, so are meant to be run by the bench
+-- host (see Makefile), against the simulated blink(1) in blink1sim.c. Each
+-- test gets device 0, opened afresh, and closed afterwards. When the
+-- simulator is set to unplug its devices (BLINK1_SIM_UNPLUG), only the
+-- reconnect test runs.
+
+local failures = 0
+local unplugging = os.getenv('BLINK1_SIM_UNPLUG') ~= nil
+
+local function test(name, f)
+   if unplugging ~= (name == 'reconnect') then return end
+   local d = blink.open(0)
+   local ok, err = pcall(f, d)
+   d:close()
+   if not ok then
+      failures = failures + 1
+      print(string.format('%s: %s', name, err))
+   end
+end
+
+-- Polls <f> every few milliseconds until it returns true or <millis> pass.
+local function eventually(f, millis)
+   for _ = 1, (millis or 1000) / 5 do
+      if f() then return true end
+      blink.sleep(5)
+   end
+   return f()
+end
+
+local function checkColor(d, led, r, g, b)
+   local gr, gg, gb = d:get(led)
+   assert(gr == r and gg == g and gb == b,
+          string.format('LED %d is (%s, %s, %s), not (%d, %d, %d)', led, gr, gg, gb, r, g, b))
+end
+
+-- exact colors: nothing below is about gamma correction unless it says so
+blink.noGamma()
+
+
+-- Animations play in the background
+
+test('animate', function(d)
+   assert(d:animate({ { millis = 0, red = 255, wait = 50 }, { millis = 0, blue = 255 } }, 1))
+   assert(d:animating(), 'not animating after animate')
+   assert(eventually(function() return d:get() == 255 end), 'first keyframe not shown')
+   assert(eventually(function() return not d:animating() end), 'animation did not end')
+   checkColor(d, 0, 0, 0, 255)
+end)
+
+test('stopanimation', function(d)
+   assert(d:animate({ { millis = 0, red = 255, wait = 10 }, { millis = 0, green = 255, wait = 10 } }, 0))
+   blink.sleep(30)
+   assert(d:animating(), 'endless animation ended')
+   d:stopanimation()
+   assert(not d:animating(), 'still animating after stopanimation')
+end)
+
+
+-- writepattern sends only the lines that changed
+
+local function makepattern(n, red)
+   local pattern = {}
+   for i = 1, n do
+      pattern[i] = { millis = 100 * i, red = red, green = i, blue = 0 }
+   end
+   return pattern
+end
+
+test('writepattern diff', function(d)
+   local pattern = makepattern(32, 10)
+   assert(d:writepattern(pattern, true) == 32, 'forced write did not send every line')
+   assert(d:writepattern(pattern) == 0, 'unchanged pattern was sent again')
+   pattern[5].red = 200
+   assert(d:writepattern(pattern) == 1, 'changed line not sent on its own')
+   assert(d:writepattern(pattern, true) == 32, 'force did not resend every line')
+   local back = d:readpattern()
+   assert(back[4].red == 200 and back[4].millis == 500, 'device does not hold the changed line')
+
+   -- lines are counted, not the setledn reports between them
+   d:stats(true)
+   assert(d:writepattern({ { led = 1 }, { led = 2 }, { led = 1 } }, true) == 3, 'count is not of lines')
+   assert(d:stats().setledn.calls == 3, 'setledn not sent between lines')
+end)
+
+
+-- get, dim and brighten work from the colors asked for
+
+test('get after refresh', function(d)
+   blink.gamma()
+   d:set(100, 50, 7)
+   checkColor(d, 0, 100, 50, 7)
+   local r, g, b = d:get{ refresh = true }
+   assert(r == 100 and g == 50 and b == 7, 'refresh returned the corrected color')
+   assert(d:dim())
+   checkColor(d, 0, 68, 34, 5)
+   blink.noGamma()
+end)
+
+test('dim with write-behind', function(d)
+   d:writebehind(true)
+   d:set(255, 0, 0)
+   d:dim()
+   d:dim()
+   d:flush()
+   checkColor(d, 0, 191, 0, 0)
+   d:writebehind(false)
+end)
+
+
+-- Write-behind keeps the order of commands it doesn't drop
+
+test('write-behind order', function(d)
+   d:writebehind(true)
+   for i = 1, 20 do
+      -- B, C and D are queued while the writer sends X, after it has taken
+      -- the command for both LEDs
+      d:set(i, 0, 0)
+      local t = bench.now() + 0.0002
+      repeat until bench.now() >= t
+      d:fade(0, i, 1, 0, 1)
+      d:set(i, 2, 0)
+      d:fade(0, i, 3, 0, 1)
+      d:flush()
+      checkColor(d, 1, i, 3, 0)
+      checkColor(d, 2, i, 2, 0)
+   end
+   d:writebehind(false)
+end)
+
+
+-- Groups send each call to every member
+
+test('group', function(d)
+   local g = blink.group{ d }
+   assert(#g == 1, 'group has the wrong number of members')
+   local ok, results = g:set(10, 20, 30)
+   assert(ok and results[1] == true, 'group set failed')
+   checkColor(d, 0, 10, 20, 30)
+   ok, results = g:fade(0, 40, 50, 60, 2)
+   assert(ok and results[1] == true, 'group fade failed')
+   checkColor(d, 1, 10, 20, 30)
+   checkColor(d, 2, 40, 50, 60)
+end)
+
+
+-- Hotplug notifications and the cached enumeration
+
+test('hotplug', function(d)
+   assert(blink.enumerate() == #blink.list(), 'enumerate and list disagree')
+
+   -- the first dispatch reports attached devices as arrivals; a callback that
+   -- raises an error doesn't keep the others from seeing them
+   local seen = {}
+   local failed = false
+   blink.onhotplug(function()
+      if not failed then failed = true; error('callback failed') end
+   end)
+   blink.onhotplug(function(event, serial) seen[serial] = event end)
+   local ok, err = pcall(blink.dispatch)
+   assert(not ok and err:find('callback failed'), 'callback error not raised')
+   assert(seen[d:serial()] == 'add', 'arrival not delivered after a callback error')
+   assert(blink.dispatch() == 0, 'arrival delivered twice')
+end)
+
+
+-- Asynchronous requests
+
+test('async', function(d)
+   local req = assert(d:setasync(10, 20, 30))
+   assert(req:wait() == true, 'setasync failed')
+   checkColor(d, 1, 10, 20, 30)
+
+   -- a closed device takes no more requests
+   d:close()
+   local r, err = d:setasync(1, 2, 3)
+   assert(r == nil and err:find('closed'), 'request queued on a closed device')
+end)
+
+
+-- Pattern strings
+
+test('pattern strings', function(d)
+   assert(d:setpatternstring('3,#ff0000,0.5,0,#0000ff,0.5,0') == 32, 'pattern string not written')
+   assert(d:getpatternstring() == '3,#ff0000,0.5,0,#0000ff,0.5,0', 'pattern string not read back')
+   assert(not d:stats().setledn, 'LED 0 lines were preceded by setledn')
+
+   -- the cache stays usable past its size
+   for i = 1, 100 do
+      local lines, repeats = blink.parsepattern(string.format('%d,#%06x,0.1,0', i % 256, i))
+      assert(repeats == i % 256 and lines[1].blue == i, 'pattern string parsed wrongly')
+   end
+
+   -- a line for another LED points writes at it; closing points them back
+   assert(d:setpatternstring('0,#00ff00,0.1,2') == 2, 'LED 2 pattern not written')
+   assert(d:stats().setledn, 'setledn not sent for LED 2')
+end)
+
+test('pattern led after close', function(d)
+   assert(d:setpatternstring('0,#010203,0.1,0') == 32, 'pattern string not written')
+   assert(not d:stats().setledn, 'setledn sent for LED 0 on a fresh device')
+   assert(d:readpattern()[0].led == 0, 'LED 0 line written to another LED')
+end)
+
+
+-- Packed colors
+
+test('packed colors', function(d)
+   assert(d:set('\10\20\30'))
+   checkColor(d, 1, 10, 20, 30)
+   assert(d:fade(0, '\1\2\3', 2))
+   checkColor(d, 2, 1, 2, 3)
+   -- strings that convert to numbers are still numbers
+   assert(d:set('100', 0, '7'))
+   checkColor(d, 1, 100, 0, 7)
+end)
+
+
+-- Whole pattern readback, checked against the expected pattern
+
+test('readpattern expected', function(d)
+   local pattern = makepattern(8, 40)
+   assert(d:writepattern(pattern, true) == 8, 'pattern not written')
+   assert(next(d:readpattern{ expected = pattern }) == nil, 'written pattern reported as different')
+   local packed = d:readpattern{ packed = true }
+   assert(#packed == 32 * 6, 'packed pattern has the wrong length')
+   assert(next(d:readpattern{ expected = packed:sub(1, 8 * 6) }) == nil, 'packed pattern reported as different')
+
+   pattern[3] = { millis = 1, red = 1, green = 1, blue = 1 }
+   local diff = d:readpattern{ expected = pattern }
+   assert(diff[2] and diff[2].red == 40 and diff[2].millis == 300, 'changed line not reported')
+   assert(next(diff, next(diff)) == nil, 'unchanged lines reported')
+end)
+
+
+-- Compressing dense frames into fades
+
+test('compress', function(d)
+   local frames = {}
+   for i = 0, 100 do frames[#frames + 1] = string.char(i * 2, 0, 255 - i * 2) end
+   local timeline, report = blink.compress(table.concat(frames), 100, { tolerance = 1 })
+   assert(report.frames == 101 and report.keyframes < 5, 'linear ramp not compressed')
+   assert(report.max_error <= 1, 'compressed timeline strays beyond the tolerance')
+   assert(timeline[#timeline].red == 200 and timeline[#timeline].blue == 55, 'ramp does not end on its last frame')
+
+   -- frames further apart than the longest fade are refused
+   assert(not pcall(blink.compress, '\0\0\0\255\0\0', 0.01), 'fps below the longest fade accepted')
+   local slowest = blink.compress('\0\0\0\255\0\0', 1000 / 65535)
+   assert(slowest[#slowest].millis == 65535, 'slowest frame rate not one long fade')
+end)
+
+
+-- A server shares devices between clients
+
+local socket = os.tmpname()
+
+-- True if ls -l shows <path> with the permissions <perms>.
+local function hasMode(path, perms)
+   return os.execute(string.format('[ "$(ls -l %s | cut -c 1-10)" = "%s" ]', path, perms)) == true
+end
+
+test('server clients', function(d)
+   local server = assert(blink.serve(socket))
+   local ok, err = pcall(function()
+      assert(hasMode(socket, 'srw-------'), 'socket is not private to its owner')
+
+      local a = assert(blink.connect(socket, d:serial()))
+      local b = assert(blink.connect(socket, d:serial()))
+
+      -- neither client trusts what it last sent: the other may have changed it
+      a:set(10, 20, 30)
+      b:set(1, 2, 3)
+      checkColor(a, 1, 1, 2, 3)
+
+      a:dedup(true)
+      a:set(5, 5, 5)
+      b:set(0, 0, 0)
+      a:set(5, 5, 5)
+      checkColor(b, 1, 5, 5, 5)
+
+      local pattern = makepattern(4, 9)
+      assert(a:writepattern(pattern) == 4, 'pattern not written')
+      b:writepattern(makepattern(4, 99))
+      assert(a:writepattern(pattern) == 4, 'pattern changed by another client not rewritten')
+      assert(b:readpattern()[0].red == 9, 'server does not hold the rewritten pattern')
+
+      a:close()
+      b:close()
+   end)
+   server:close()
+   assert(ok, err)
+
+   server = assert(blink.serve(socket, tonumber('660', 8)))
+   local applied = hasMode(socket, 'srw-rw----')
+   server:close()
+   assert(applied, 'socket mode not applied')
+end)
+
+
+-- The watchdog
+
+test('watchdog', function(d)
+   local ok, err = pcall(d.watchdog, d, { timeout = 1 })
+   assert(not ok and err:find('timeout must be', 1, true), 'timeout below one firmware tick not refused as such')
+   assert(d:watchdog{ timeout = 10 }, 'shortest timeout with the default interval refused')
+   assert(d:watchdog(false), 'watchdog not disarmed')
+
+   -- heartbeats keep the device tickled; without them, tickles stop
+   assert(d:watchdog{ timeout = 200, interval = 20 })
+   for _ = 1, 10 do
+      d:heartbeat()
+      blink.sleep(10)
+   end
+   local stats = d:watchdogstats()
+   assert(stats.armed and stats.tickles > 0, 'watchdog not tickled')
+   blink.sleep(60)
+   assert(d:watchdogstats().missed > 0, 'missed heartbeats not counted')
+   assert(d:watchdog(false))
+   assert(not d:watchdogstats().armed, 'watchdog still armed')
+end)
+
+
+-- Call counters
+
+test('stats', function(d)
+   local before = blink.stats().set
+   before = before and before.calls or 0
+   d:set(1, 2, 3)
+   d:set(4, 5, 6)
+   local set = d:stats().set
+   assert(set.calls == 2 and set.failures == 0, 'sets not counted')
+   assert(set.reports == 2 and set.bytes > 0, 'reports not counted')
+   assert(set.max_us <= set.total_us and set.p50_us <= set.p99_us, 'latencies inconsistent')
+   local counted = 0
+   for _, n in pairs(set.histogram) do counted = counted + n end
+   assert(counted == 2, 'histogram does not hold every call')
+   assert(blink.stats().set.calls == before + 2, 'library counters miss the device\'s calls')
+   assert(d:stats(true).set.calls == 2 and d:stats().set == nil, 'counters not reset')
+end)
+
+
+-- Fixed-rate streams
+
+test('stream', function(d)
+   local frames = {}
+   for i = 1, 20 do frames[i] = string.char(i, 0, 0) end
+   assert(d:stream(table.concat(frames), 200, { drop = false }))
+   assert(d:streaming(), 'stream not started')
+   assert(eventually(function() return not d:streaming() end), 'stream did not end')
+   local stats = d:streamstats()
+   assert(stats.sent == 20 and stats.dropped == 0 and stats.failed == 0, 'frames lost')
+   checkColor(d, 1, 20, 0, 0)
+
+   -- two LEDs, looped until stopped
+   assert(d:stream(string.char(1, 2, 3, 4, 5, 6), 100, { leds = 2, count = 0 }))
+   blink.sleep(30)
+   d:stopstream()
+   assert(not d:streaming(), 'stream not stopped')
+   checkColor(d, 1, 1, 2, 3)
+   checkColor(d, 2, 4, 5, 6)
+end)
+
+
+-- Batch color kernels
+
+test('color kernels', function(d)
+   local rgb = string.char(255, 0, 0, 0, 255, 0, 0, 0, 255, 10, 20, 30)
+   local hsb = blink.convert(rgb, 'rgb', 'hsb')
+   assert(#hsb == #rgb, 'conversion changed the number of colors')
+   local back = blink.convert(hsb, 'hsv', 'rgb')
+   for i = 1, #rgb do
+      assert(math.abs(back:byte(i) - rgb:byte(i)) <= 3, 'rgb to hsb and back strays too far')
+   end
+   assert(blink.convert(string.char(0, 0, 0, 255, 255, 255), 'rgb', 'linear') == string.char(0, 0, 0, 255, 255, 255),
+          'linear conversion does not keep black and white')
+
+   local a, b = string.char(0, 100, 200), string.char(200, 100, 0)
+   assert(blink.blend(a, b, 0) == a and blink.blend(a, b, 255) == b, 'blend endpoints wrong')
+   assert(blink.blend(a .. a, b, string.char(0, 255)) == a .. b, 'per-color weights not applied')
+
+   local g = blink.gradient(a, b, 3)
+   assert(g == a .. string.char(100, 100, 100) .. b, 'gradient not evenly spaced')
+end)
+
+
+-- Per-device color correction
+
+test('calibrate', function(d)
+   assert(d:calibrate{ gamma = false, red = 0.5, green = 1, blue = 0 })
+   d:set(200, 100, 50)
+   checkColor(d, 1, 200, 100, 50)
+   d:writepattern(string.char(0, 10, 200, 100, 50, 0))
+   local held = d:readpattern()[0]
+   assert(held.red == 100 and held.green == 100 and held.blue == 0, 'pattern line not corrected')
+
+   local ok = pcall(d.calibrate, d, { gamma = 9 })
+   assert(not ok, 'gamma out of range accepted')
+   assert(d:calibrate(), 'calibration not reset')
+   d:writepattern(string.char(0, 10, 200, 100, 50, 0))
+   held = d:readpattern()[0]
+   assert(held.red == 200 and held.green == 100 and held.blue == 50, 'calibration not reset')
+end)
+
+
+-- Timelines compiled into device patterns
+
+test('timeline', function(d)
+   local red = { millis = 100, red = 255, wait = 100 }
+   local blue = { millis = 100, blue = 255, wait = 200 }
+   local pattern, report = blink.compiletimeline({ red, blue, red, blue }, 1)
+   assert(report.count == 2 and report.lines == #pattern, 'repeated keyframes not played twice')
+   assert(pattern[1].millis == 100 and pattern[1].red == 255, 'first line is not the first fade')
+   assert(report.period == 300, 'period is not one play through the lines')
+
+   local fit, folded = blink.compiletimeline({ red, blue, { millis = 0, green = 255, wait = 50 } }, 1, 3)
+   assert(#fit <= 3 and folded.folded > 0, 'lines not folded to fit the slots')
+   assert(not pcall(blink.compiletimeline, {}, 1), 'empty timeline accepted')
+
+   local played = assert(d:playtimeline({ red, blue }, 0, 4))
+   assert(played.start == 4 and played['end'] == 4 + played.lines - 1, 'lines not played where asked')
+   local playing, startpos, endpos = d:readplay()
+   assert(playing and startpos == played.start and endpos == played['end'], 'device not playing the timeline')
+   assert(d:playtimeline({ red, blue }, 0, 4).sent == 0, 'lines the device holds were sent again')
+   d:stop()
+end)
+
+
+-- Reopening an unplugged device
+
+test('reconnect', function(d)
+   d:writepattern({ { millis = 500, red = 1, green = 2, blue = 3 } }, true)
+   d:set(40, 50, 60)
+   assert(d:connected(), 'device not connected')
+
+   -- keep calling until the failures show the device is gone
+   assert(eventually(function() d:set(40, 50, 60); return not d:connected() end, 2000),
+          'unplugging not noticed')
+   assert(eventually(function() return d:connected() end, 3000), 'device not reopened')
+   local _, reopened = d:connected()
+   assert(reopened == 1, 'device reopened ' .. tostring(reopened) .. ' times')
+   local line = d:readpattern()[0]
+   assert(line.millis == 500 and line.red == 1 and line.blue == 3, 'pattern line not restored')
+   local r, g, b = d:get{ led = 1, refresh = true }
+   assert(r == 40 and g == 50 and b == 60, 'color not restored')
+end)
+
+
+-- Suppressing redundant writes
+
+test('dedup', function(d)
+   d:set(7, 8, 9)
+   d:set(7, 8, 9)
+   assert(d:stats().set.calls == 2, 'write suppressed with dedup off')
+
+   assert(d:dedup(true))
+   d:set(7, 8, 9)
+   local set = d:stats().set
+   assert(set.calls == 2 and set.suppressed == 1, 'unchanged set sent')
+   d:set(7, 8, 10)
+   assert(d:stats().set.calls == 3, 'changed set suppressed')
+
+   -- a fade still in flight is sent again; one that has settled is not
+   d:fade(100, 1, 1, 1)
+   d:fade(100, 1, 1, 1)
+   assert(d:stats().fade.calls == 2, 'fade in flight suppressed')
+   blink.sleep(120)
+   d:fade(100, 1, 1, 1)
+   assert(d:stats().fade.suppressed == 1, 'settled fade sent again')
+
+   assert(d:dedup(true, 20))
+   blink.sleep(30)
+   d:fade(100, 1, 1, 1)
+   assert(d:stats().fade.calls == 3, 'color older than maxage not sent again')
+end)
+
+
+-- Prioritized layers
+
+test('layers', function(d)
+   assert(d:post('base', { red = 10 }))
+   assert(d:post('alert', { red = 200, priority = 5, ttl = 50 }))
+   checkColor(d, 1, 200, 0, 0)
+   assert(d:post('tint', { blue = 30, priority = 9, blend = 'add' }))
+   checkColor(d, 1, 200, 0, 30)
+
+   local layers = d:layers()
+   assert(#layers == 3 and layers[1].name == 'tint' and layers[2].name == 'alert', 'layers not listed top down')
+   assert(layers[2].ttl and layers[2].ttl <= 50, 'ttl not reported')
+
+   -- the alert expires by itself, uncovering the base layer
+   assert(eventually(function() return #d:layers() == 2 end), 'layer did not expire')
+   assert(eventually(function()
+      local r, g, b = d:get(1)
+      return r == 10 and g == 0 and b == 30
+   end), 'expired layer still shown')
+
+   assert(d:withdraw('tint') == true and d:withdraw('tint') == false, 'withdraw results wrong')
+   checkColor(d, 1, 10, 0, 0)
+   assert(d:withdraw('base'))
+   checkColor(d, 1, 0, 0, 0)
+end)
+
+
+-- Completion callbacks delivered by dispatch
+
+test('dispatch callbacks', function(d)
+   local fd = blink.fd()
+   assert(math.type(fd) == 'integer' and fd >= 0 and blink.fd() == fd, 'no stable descriptor')
+
+   local done
+   local req = assert(d:getasync(1))
+   assert(req:ondone(function(...) done = { ... } end) == req, 'ondone does not return the request')
+   assert(eventually(function() blink.dispatch(); return done ~= nil end), 'ondone not called')
+   assert(done[1] == 0 and #done == 4, 'ondone not called with the result')
+
+   local ended
+   d:onanimationend(function(dev) ended = dev end)
+   assert(d:animate({ { millis = 0, red = 1, wait = 10 } }, 1))
+   assert(eventually(function() blink.dispatch(); return ended ~= nil end), 'onanimationend not called')
+   assert(ended == d, 'onanimationend called with the wrong device')
+   assert(blink.dispatch() == 0, 'notifications delivered twice')
+end)
+
+
+if failures > 0 then
+   error(string.format('%d test(s) failed', failures))
 end
 
 print "Success"